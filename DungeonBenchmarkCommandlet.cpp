@@ -0,0 +1,212 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "DungeonBenchmarkCommandlet.h"
+#include "DungeonGenerator.h"
+#include "Engine/Engine.h"
+#include "Engine/StaticMesh.h"
+#include "Engine/World.h"
+#include "HAL/PlatformMemory.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+namespace
+{
+    struct FStageResult
+    {
+        FIntVector Size;
+        int32 NumRooms;
+        int32 Seed;
+        const TCHAR* Stage;
+        double WallMs;
+        int64 NodesExpanded;
+
+        // Change in process memory over the stage, can be negative when the stage frees more than it takes
+        int64 UsedMemoryDelta;
+
+        // Process high-water mark after the stage, only grows over the run
+        uint64 PeakUsedMemory;
+
+        // Cells, RoomIds and StairIds held by the generator after the stage
+        SIZE_T GridBytes;
+    };
+
+    bool ParseSizes(const FString& Value, TArray<FIntVector>& OutSizes)
+    {
+        TArray<FString> Entries;
+        Value.ParseIntoArray(Entries, TEXT(","));
+        for (const FString& Entry : Entries)
+        {
+            TArray<FString> Axes;
+            Entry.ParseIntoArray(Axes, TEXT("x"));
+            if (Axes.Num() != 3)
+            {
+                UE_LOG(LogTemp, Error, TEXT("Grid size '%s' isn't WIDTHxHEIGHTxLENGTH"), *Entry);
+                return false;
+            }
+            OutSizes.Add(FIntVector(FCString::Atoi(*Axes[0]), FCString::Atoi(*Axes[1]), FCString::Atoi(*Axes[2])));
+        }
+        return OutSizes.Num() > 0;
+    }
+
+    bool ParseCounts(const FString& Value, TArray<int32>& OutCounts)
+    {
+        TArray<FString> Entries;
+        Value.ParseIntoArray(Entries, TEXT(","));
+        for (const FString& Entry : Entries)
+        {
+            OutCounts.Add(FCString::Atoi(*Entry));
+        }
+        return OutCounts.Num() > 0;
+    }
+
+    SIZE_T GetGridBytes(const FDungeonLayout& Layout)
+    {
+        return Layout.Cells.GetAllocatedSize() + Layout.RoomIds.GetAllocatedSize() + Layout.StairIds.GetAllocatedSize();
+    }
+
+    FString ToJson(const TArray<FStageResult>& Results)
+    {
+        FString Json = TEXT("[\n");
+        for (int32 i = 0; i < Results.Num(); i++)
+        {
+            const FStageResult& Result = Results[i];
+            Json += FString::Printf(TEXT("  {\"width\": %d, \"height\": %d, \"length\": %d, \"rooms\": %d, \"seed\": %d, \"stage\": \"%s\", ")
+                TEXT("\"wall_ms\": %.4f, \"nodes_expanded\": %lld, \"used_memory_delta_bytes\": %lld, \"peak_used_memory_bytes\": %llu, \"grid_bytes\": %llu}%s\n"),
+                Result.Size.X, Result.Size.Y, Result.Size.Z, Result.NumRooms, Result.Seed, Result.Stage,
+                Result.WallMs, Result.NodesExpanded, Result.UsedMemoryDelta, Result.PeakUsedMemory, uint64(Result.GridBytes),
+                i + 1 < Results.Num() ? TEXT(",") : TEXT(""));
+        }
+        Json += TEXT("]\n");
+        return Json;
+    }
+
+    FString ToCsv(const TArray<FStageResult>& Results)
+    {
+        FString Csv = TEXT("width,height,length,rooms,seed,stage,wall_ms,nodes_expanded,used_memory_delta_bytes,peak_used_memory_bytes,grid_bytes\n");
+        for (const FStageResult& Result : Results)
+        {
+            Csv += FString::Printf(TEXT("%d,%d,%d,%d,%d,%s,%.4f,%lld,%lld,%llu,%llu\n"),
+                Result.Size.X, Result.Size.Y, Result.Size.Z, Result.NumRooms, Result.Seed, Result.Stage,
+                Result.WallMs, Result.NodesExpanded, Result.UsedMemoryDelta, Result.PeakUsedMemory, uint64(Result.GridBytes));
+        }
+        return Csv;
+    }
+}
+
+UDungeonBenchmarkCommandlet::UDungeonBenchmarkCommandlet()
+{
+    IsClient = false;
+    IsServer = false;
+    IsEditor = true;
+    LogToConsole = true;
+}
+
+int32 UDungeonBenchmarkCommandlet::Main(const FString& Params)
+{
+    FString Value;
+    TArray<FIntVector> Sizes;
+    if (!ParseSizes(FParse::Value(*Params, TEXT("sizes="), Value) ? Value : TEXT("30x30x30,64x64x16,128x128x32,256x256x32"), Sizes))
+    {
+        return 1;
+    }
+    TArray<int32> RoomCounts;
+    if (!ParseCounts(FParse::Value(*Params, TEXT("rooms="), Value) ? Value : TEXT("10,40,160"), RoomCounts))
+    {
+        return 1;
+    }
+    int32 Seed = 1;
+    FParse::Value(*Params, TEXT("seed="), Seed);
+
+    UClass* GeneratorClass = ADungeonGenerator::StaticClass();
+    if (FParse::Value(*Params, TEXT("generator="), Value))
+    {
+        GeneratorClass = LoadClass<ADungeonGenerator>(nullptr, *Value);
+        if (!GeneratorClass)
+        {
+            UE_LOG(LogTemp, Error, TEXT("Couldn't load generator class %s"), *Value);
+            return 1;
+        }
+    }
+    UStaticMesh* FallbackMesh = LoadObject<UStaticMesh>(nullptr, TEXT("/Engine/BasicShapes/Cube.Cube"));
+
+    FString OutputBase = FPaths::ProjectSavedDir() / TEXT("DungeonBenchmark") / (TEXT("DungeonBenchmark-") + FDateTime::Now().ToString());
+    FParse::Value(*Params, TEXT("output="), OutputBase);
+
+    // A world that never begins play, so generators spawned into it don't start generating on their own
+    UWorld* World = UWorld::CreateWorld(EWorldType::Game, false, TEXT("DungeonBenchmark"));
+    FWorldContext& WorldContext = GEngine->CreateNewWorldContext(EWorldType::Game);
+    WorldContext.SetCurrentWorld(World);
+
+    TArray<FStageResult> Results;
+    for (const FIntVector& Size : Sizes)
+    {
+        for (int32 NumRooms : RoomCounts)
+        {
+            ADungeonGenerator* Generator = World->SpawnActor<ADungeonGenerator>(GeneratorClass);
+            Generator->Width = Size.X;
+            Generator->Height = Size.Y;
+            Generator->Length = Size.Z;
+            Generator->NumofRoom = NumRooms;
+            Generator->Seed = Seed;
+            Generator->bRandomizeSeed = false;
+            Generator->bUseLayoutCache = false;
+            Generator->RenderMode = EDungeonRenderMode::InstancedMeshes;
+            for (UStaticMesh** Mesh : { &Generator->FloorInstanceMesh, &Generator->WallInstanceMesh, &Generator->StairInstanceMesh, &Generator->StairInstanceMesh2 })
+            {
+                *Mesh = *Mesh ? *Mesh : FallbackMesh;
+            }
+            FDungeonLayout& Layout = Generator->Layout;
+            Generator->ConfigureLayout(Layout);
+
+            TArray<FRoomConnection> MST;
+            auto RunStage = [&](const TCHAR* Stage, TFunctionRef<void()> Body)
+            {
+                const int64 UsedBefore = FPlatformMemory::GetStats().UsedPhysical;
+                Layout.TotalNodesExpanded = 0;
+                const double StartTime = FPlatformTime::Seconds();
+                Body();
+                const double WallMs = (FPlatformTime::Seconds() - StartTime) * 1000.0;
+                const FPlatformMemoryStats Stats = FPlatformMemory::GetStats();
+                Results.Add({ Size, NumRooms, Seed, Stage, WallMs, Layout.TotalNodesExpanded.load(),
+                    int64(Stats.UsedPhysical) - UsedBefore, Stats.PeakUsedPhysical, GetGridBytes(Layout) });
+            };
+
+            // The stages of GenerateLayout and GenerateDungeon, in order
+            RunStage(TEXT("InitializeGrid"), [&]()
+            {
+                Layout.InitializeGrid();
+                Layout.Rooms.Empty();
+                Layout.Stairs.Empty();
+            });
+            RunStage(TEXT("PlaceMultipleRooms"), [&]() { Layout.PlaceMultipleRooms(NumRooms); });
+            RunStage(TEXT("KruskalsMST"), [&]() { MST = Layout.KruskalsMST(); });
+            RunStage(TEXT("ConnectRoomsUsingAStar"), [&]() { Layout.ConnectRoomsUsingAStar(MST); });
+            RunStage(TEXT("SpawnDungeonEnvironment"), [&]() { Generator->SpawnDungeonEnvironment(); });
+
+            FString Summary;
+            for (int32 i = Results.Num() - 5; i < Results.Num(); i++)
+            {
+                Summary += FString::Printf(TEXT("%s%s %.2f ms"), Summary.IsEmpty() ? TEXT("") : TEXT(", "), Results[i].Stage, Results[i].WallMs);
+            }
+            UE_LOG(LogTemp, Display, TEXT("Dungeon benchmark %dx%dx%d, %d rooms (%d placed, %d stairs): %s"),
+                Size.X, Size.Y, Size.Z, NumRooms, Layout.Rooms.Num(), Layout.Stairs.Num(), *Summary);
+
+            Generator->ClearSpawnedEnvironment();
+            Generator->Destroy();
+        }
+    }
+
+    GEngine->DestroyWorldContext(World);
+    World->DestroyWorld(false);
+
+    const bool bSaved = FFileHelper::SaveStringToFile(ToJson(Results), *(OutputBase + TEXT(".json")))
+        && FFileHelper::SaveStringToFile(ToCsv(Results), *(OutputBase + TEXT(".csv")));
+    if (!bSaved)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Failed to write the dungeon benchmark results to %s"), *OutputBase);
+        return 1;
+    }
+    UE_LOG(LogTemp, Display, TEXT("Dungeon benchmark results written to %s.json and .csv"), *OutputBase);
+    return 0;
+}
@@ -0,0 +1,28 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "DungeonBenchmarkCommandlet.generated.h"
+
+// Runs every stage of GenerateDungeon without a viewport over a sweep of grid sizes and room counts, and writes
+// wall time, memory and A* nodes expanded per stage as JSON and CSV, so builds can be compared run against run.
+//
+//   UnrealEditor-Cmd Realone.uproject -run=DungeonBenchmark -nullrhi -LogCmds="LogTemp Error"
+//       [-sizes=30x30x30,64x64x16,128x128x32,256x256x32] [-rooms=10,40,160] [-seed=1]
+//       [-generator=/Game/BP_DungeonGenerator.BP_DungeonGenerator_C] [-output=Saved/DungeonBenchmark/Run]
+//
+// -generator picks a configured generator class, its meshes are used for the spawn pass. Meshes it leaves unset
+// are replaced by the engine cube, and spawning always runs in InstancedMeshes mode so the pass doesn't depend
+// on tile Blueprints. -output is the path without extension, .json and .csv are added.
+UCLASS()
+class REALONE_API UDungeonBenchmarkCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UDungeonBenchmarkCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+};
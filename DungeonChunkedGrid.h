@@ -0,0 +1,144 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// Per-cell values over a Width x Height x Length volume, stored in 16x16x16 chunks. A chunk is only allocated
+// the first time a value other than the default is written to it, until then it reads from one shared chunk
+// holding the default everywhere, so mostly empty volumes cost memory in proportion to what is actually used.
+//
+// Cell indices are chunk-major: the chunk index above ChunkCellBits, the cell inside the chunk below. Finding
+// the chunk of an index is a shift and the cells of one chunk are contiguous. The last chunks along each axis
+// may reach past the volume, those padding indices are valid but never inside the grid.
+template<typename T>
+class TDungeonChunkedGrid
+{
+public:
+    static constexpr int32 ChunkSizeBits = 4;
+    static constexpr int32 ChunkSize = 1 << ChunkSizeBits;
+    static constexpr int32 ChunkCellBits = ChunkSizeBits * 3;
+    static constexpr int32 ChunkCells = 1 << ChunkCellBits;
+
+    void Init(int32 InWidth, int32 InHeight, int32 InLength, T InDefaultValue)
+    {
+        Size = FIntVector(InWidth, InHeight, InLength);
+        ChunksX = FMath::DivideAndRoundUp(InWidth, ChunkSize);
+        ChunksY = FMath::DivideAndRoundUp(InHeight, ChunkSize);
+        const int32 NumChunks = ChunksX * ChunksY * FMath::DivideAndRoundUp(InLength, ChunkSize);
+
+        DefaultValue = InDefaultValue;
+        Sentinel.Init(DefaultValue, ChunkCells);
+        Storage.Reset();
+        Storage.SetNum(NumChunks);
+        ChunkData.Init(Sentinel.GetData(), NumChunks);
+    }
+
+    void Empty()
+    {
+        Size = FIntVector::ZeroValue;
+        ChunksX = ChunksY = 0;
+        Sentinel.Empty();
+        Storage.Empty();
+        ChunkData.Empty();
+    }
+
+    const FIntVector& GetSize() const { return Size; }
+
+    int32 GetNumChunks() const { return ChunkData.Num(); }
+
+    // Chunks along X and Y, chunk indices run X first, then Y, then Z
+    int32 GetNumChunksX() const { return ChunksX; }
+
+    int32 GetNumChunksY() const { return ChunksY; }
+
+    // Every index below this is valid, padding included
+    int32 GetNumIndices() const { return GetNumChunks() << ChunkCellBits; }
+
+    // GetNumIndices once initialized to the given size
+    static int32 GetNumIndicesFor(int32 InWidth, int32 InHeight, int32 InLength)
+    {
+        return (FMath::DivideAndRoundUp(InWidth, ChunkSize) * FMath::DivideAndRoundUp(InHeight, ChunkSize)
+            * FMath::DivideAndRoundUp(InLength, ChunkSize)) << ChunkCellBits;
+    }
+
+    bool IsChunkAllocated(int32 Chunk) const { return Storage[Chunk].IsValid(); }
+
+    int32 GetNumAllocatedChunks() const
+    {
+        int32 Count = 0;
+        for (const TUniquePtr<T[]>& Chunk : Storage)
+        {
+            Count += Chunk.IsValid() ? 1 : 0;
+        }
+        return Count;
+    }
+
+    // Bytes held by the allocated chunks, the sentinel and the chunk tables
+    SIZE_T GetAllocatedSize() const
+    {
+        return SIZE_T(GetNumAllocatedChunks()) * ChunkCells * sizeof(T) + Sentinel.GetAllocatedSize()
+            + Storage.GetAllocatedSize() + ChunkData.GetAllocatedSize();
+    }
+
+    int32 GetIndex(int32 X, int32 Y, int32 Z) const
+    {
+        const int32 Chunk = (X >> ChunkSizeBits) + ((Y >> ChunkSizeBits) + (Z >> ChunkSizeBits) * ChunksY) * ChunksX;
+        const int32 Local = (X & (ChunkSize - 1)) | ((Y & (ChunkSize - 1)) << ChunkSizeBits) | ((Z & (ChunkSize - 1)) << (ChunkSizeBits * 2));
+        return (Chunk << ChunkCellBits) | Local;
+    }
+
+    FIntVector GetPosition(int32 Index) const
+    {
+        const int32 Chunk = Index >> ChunkCellBits;
+        const int32 ChunkYZ = Chunk / ChunksX;
+        const int32 ChunkZ = ChunkYZ / ChunksY;
+        const FIntVector ChunkOrigin(Chunk - ChunkYZ * ChunksX, ChunkYZ - ChunkZ * ChunksY, ChunkZ);
+        return ChunkOrigin * ChunkSize + FIntVector(
+            Index & (ChunkSize - 1),
+            (Index >> ChunkSizeBits) & (ChunkSize - 1),
+            (Index >> (ChunkSizeBits * 2)) & (ChunkSize - 1));
+    }
+
+    // The ChunkCells values of a chunk in index order, the shared default chunk when it isn't allocated
+    const T* GetChunkData(int32 Chunk) const { return ChunkData[Chunk]; }
+
+    T Get(int32 Index) const
+    {
+        return ChunkData[Index >> ChunkCellBits][Index & (ChunkCells - 1)];
+    }
+
+    void Set(int32 Index, T Value)
+    {
+        const int32 Chunk = Index >> ChunkCellBits;
+        if (!Storage[Chunk].IsValid())
+        {
+            if (Value == DefaultValue)
+            {
+                return;  // Already reads as the default, no need to allocate
+            }
+            Storage[Chunk] = MakeUnique<T[]>(ChunkCells);
+            for (int32 i = 0; i < ChunkCells; i++)
+            {
+                Storage[Chunk][i] = DefaultValue;
+            }
+            ChunkData[Chunk] = Storage[Chunk].Get();
+        }
+        Storage[Chunk][Index & (ChunkCells - 1)] = Value;
+    }
+
+private:
+    FIntVector Size = FIntVector::ZeroValue;
+    int32 ChunksX = 0;
+    int32 ChunksY = 0;
+    T DefaultValue = T();
+
+    // One chunk of DefaultValue that every unallocated chunk reads from
+    TArray<T> Sentinel;
+
+    // Owned chunks, null until first written
+    TArray<TUniquePtr<T[]>> Storage;
+
+    // Per chunk, the owned data or the sentinel, so reads never branch
+    TArray<const T*> ChunkData;
+};
@@ -0,0 +1,516 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "DungeonClusterGraph.h"
+#include "DungeonGenerator.h"
+
+DECLARE_CYCLE_STAT(TEXT("Cluster graph build"), STAT_DungeonClusterGraphBuild, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("Cluster corridor search"), STAT_DungeonClusterCorridor, STATGROUP_DungeonGen);
+
+namespace
+{
+    const FIntVector FlatSteps[] = {
+        FIntVector(1, 0, 0), FIntVector(-1, 0, 0), FIntVector(0, 1, 0), FIntVector(0, -1, 0)
+    };
+
+    // Staircases climbing one level, the way down is the same link walked backwards
+    const FIntVector ClimbingStairs[] = {
+        FIntVector(2, 0, 1), FIntVector(-2, 0, 1), FIntVector(0, 2, 1), FIntVector(0, -2, 1)
+    };
+
+    struct FCostEntry
+    {
+        float Cost;
+        int32 Cell;
+
+        bool operator<(const FCostEntry& Other) const
+        {
+            return Cost != Other.Cost ? Cost < Other.Cost : Cell < Other.Cell;
+        }
+    };
+}
+
+bool FDungeonClusterGraph::IsOpen(const FDungeonLayout& Layout, int32 Cell)
+{
+    const EDungeonCell Value = Layout.GetCell(Cell);
+    return Value == EDungeonCell::Empty || Value == EDungeonCell::Corridor;
+}
+
+void FDungeonClusterGraph::Reset()
+{
+    Clusters.Empty();
+    DirtyClusters.Empty();
+    bAnyDirty = false;
+    ClusterSize = 0;
+}
+
+void FDungeonClusterGraph::Build(const FDungeonLayout& Layout, int32 InClusterSize)
+{
+    DUNGEON_SCOPE(STAT_DungeonClusterGraphBuild);
+    Reset();
+
+    ClusterSize = FMath::Max(InClusterSize, 2);
+    Width = Layout.Width;
+    Height = Layout.Height;
+    Length = Layout.Length;
+    ClustersX = FMath::DivideAndRoundUp(Width, ClusterSize);
+    ClustersY = FMath::DivideAndRoundUp(Height, ClusterSize);
+    ClustersZ = Length;
+
+    Clusters.SetNum(ClustersX * ClustersY * ClustersZ);
+
+    // Link every pair once, lower index first
+    for (int32 ClusterIndex = 0; ClusterIndex < Clusters.Num(); ClusterIndex++)
+    {
+        TArray<int32, TInlineAllocator<6>> Neighbors;
+        GetNeighborClusters(ClusterIndex, Neighbors);
+        for (int32 Neighbor : Neighbors)
+        {
+            if (Neighbor > ClusterIndex)
+            {
+                LinkClusters(Layout, ClusterIndex, Neighbor);
+            }
+        }
+    }
+
+    for (int32 ClusterIndex = 0; ClusterIndex < Clusters.Num(); ClusterIndex++)
+    {
+        RebuildPortals(Layout, ClusterIndex);
+    }
+
+    DirtyClusters.Init(false, Clusters.Num());
+
+    UE_LOG(LogTemp, Log, TEXT("Cluster graph built: %d clusters of %d cells per side"), Clusters.Num(), ClusterSize);
+}
+
+void FDungeonClusterGraph::MarkCellChanged(int32 X, int32 Y, int32 Z)
+{
+    if (!IsBuilt() || X < 0 || X >= Width || Y < 0 || Y >= Height || Z < 0 || Z >= Length)
+    {
+        return;
+    }
+    DirtyClusters[GetClusterIndex(X, Y, Z)] = true;
+    bAnyDirty = true;
+}
+
+void FDungeonClusterGraph::GetClusterBounds(int32 ClusterIndex, FIntVector& OutMin, FIntVector& OutMax) const
+{
+    const int32 Layer = ClustersX * ClustersY;
+    const int32 CZ = ClusterIndex / Layer;
+    const int32 CY = (ClusterIndex - CZ * Layer) / ClustersX;
+    const int32 CX = ClusterIndex - CZ * Layer - CY * ClustersX;
+
+    OutMin = FIntVector(CX * ClusterSize, CY * ClusterSize, CZ);
+    OutMax = FIntVector(FMath::Min((CX + 1) * ClusterSize, Width) - 1, FMath::Min((CY + 1) * ClusterSize, Height) - 1, CZ);
+}
+
+void FDungeonClusterGraph::GetNeighborClusters(int32 ClusterIndex, TArray<int32, TInlineAllocator<6>>& OutNeighbors) const
+{
+    const int32 Layer = ClustersX * ClustersY;
+    const int32 CZ = ClusterIndex / Layer;
+    const int32 CY = (ClusterIndex - CZ * Layer) / ClustersX;
+    const int32 CX = ClusterIndex - CZ * Layer - CY * ClustersX;
+
+    OutNeighbors.Reset();
+    if (CX > 0) OutNeighbors.Add(ClusterIndex - 1);
+    if (CX < ClustersX - 1) OutNeighbors.Add(ClusterIndex + 1);
+    if (CY > 0) OutNeighbors.Add(ClusterIndex - ClustersX);
+    if (CY < ClustersY - 1) OutNeighbors.Add(ClusterIndex + ClustersX);
+    if (CZ > 0) OutNeighbors.Add(ClusterIndex - Layer);
+    if (CZ < ClustersZ - 1) OutNeighbors.Add(ClusterIndex + Layer);
+}
+
+void FDungeonClusterGraph::UnlinkClusters(int32 ClusterA, int32 ClusterB)
+{
+    Clusters[ClusterA].Links.RemoveAll([ClusterB](const FClusterLink& Link) { return Link.ToCluster == ClusterB; });
+    Clusters[ClusterB].Links.RemoveAll([ClusterA](const FClusterLink& Link) { return Link.ToCluster == ClusterA; });
+}
+
+void FDungeonClusterGraph::LinkClusters(const FDungeonLayout& Layout, int32 ClusterA, int32 ClusterB)
+{
+    if (ClusterA > ClusterB)
+    {
+        Swap(ClusterA, ClusterB);
+    }
+
+    FIntVector MinA, MaxA, MinB, MaxB;
+    GetClusterBounds(ClusterA, MinA, MaxA);
+    GetClusterBounds(ClusterB, MinB, MaxB);
+
+    auto AddLink = [this, ClusterA, ClusterB](int32 CellA, int32 CellB, float Cost)
+    {
+        Clusters[ClusterA].Links.Add({ CellA, CellB, ClusterB, Cost });
+        Clusters[ClusterB].Links.Add({ CellB, CellA, ClusterA, Cost });
+    };
+
+    if (MinA.Z != MinB.Z)
+    {
+        // Same column one level up: one link per climbing direction, the first staircase that fits inside the column
+        for (const FIntVector& Dir : ClimbingStairs)
+        {
+            bool bLinked = false;
+            for (int32 y = MinA.Y; y <= MaxA.Y && !bLinked; y++)
+            {
+                for (int32 x = MinA.X; x <= MaxA.X && !bLinked; x++)
+                {
+                    const int32 ToX = x + Dir.X;
+                    const int32 ToY = y + Dir.Y;
+                    if (ToX < MinB.X || ToX > MaxB.X || ToY < MinB.Y || ToY > MaxB.Y)
+                    {
+                        continue;
+                    }
+                    const int32 FromCell = Layout.GetIndex(x, y, MinA.Z);
+                    const int32 ToCell = Layout.GetIndex(ToX, ToY, MinB.Z);
+                    if (IsOpen(Layout, FromCell) && IsOpen(Layout, ToCell) && Layout.IsStaircaseWalkable(FIntVector(x, y, MinA.Z), Dir))
+                    {
+                        AddLink(FromCell, ToCell, FDungeonLayout::GridDistance(FIntVector::ZeroValue, Dir));
+                        bLinked = true;
+                    }
+                }
+            }
+        }
+        return;
+    }
+
+    // Side by side on one level: every run of open cell pairs along the shared border gets a link at its middle
+    const bool bAlongX = MinA.Y == MinB.Y;
+    const int32 RunStart = bAlongX ? MinA.Y : MinA.X;
+    const int32 RunEnd = bAlongX ? MaxA.Y : MaxA.X;
+    int32 OpenRunStart = INDEX_NONE;
+
+    for (int32 i = RunStart; i <= RunEnd + 1; i++)
+    {
+        bool bOpen = false;
+        int32 CellA = INDEX_NONE;
+        int32 CellB = INDEX_NONE;
+        if (i <= RunEnd)
+        {
+            CellA = bAlongX ? Layout.GetIndex(MaxA.X, i, MinA.Z) : Layout.GetIndex(i, MaxA.Y, MinA.Z);
+            CellB = bAlongX ? Layout.GetIndex(MinB.X, i, MinB.Z) : Layout.GetIndex(i, MinB.Y, MinB.Z);
+            bOpen = IsOpen(Layout, CellA) && IsOpen(Layout, CellB);
+        }
+
+        if (bOpen && OpenRunStart == INDEX_NONE)
+        {
+            OpenRunStart = i;
+        }
+        else if (!bOpen && OpenRunStart != INDEX_NONE)
+        {
+            const int32 Middle = (OpenRunStart + i - 1) / 2;
+            const int32 MidA = bAlongX ? Layout.GetIndex(MaxA.X, Middle, MinA.Z) : Layout.GetIndex(Middle, MaxA.Y, MinA.Z);
+            const int32 MidB = bAlongX ? Layout.GetIndex(MinB.X, Middle, MinB.Z) : Layout.GetIndex(Middle, MinB.Y, MinB.Z);
+            AddLink(MidA, MidB, 1.0f);
+            OpenRunStart = INDEX_NONE;
+        }
+    }
+}
+
+void FDungeonClusterGraph::RebuildPortals(const FDungeonLayout& Layout, int32 ClusterIndex)
+{
+    FCluster& Cluster = Clusters[ClusterIndex];
+    Cluster.Portals.Reset();
+    for (const FClusterLink& Link : Cluster.Links)
+    {
+        Cluster.Portals.AddUnique(Link.FromCell);
+    }
+
+    const int32 NumPortals = Cluster.Portals.Num();
+    Cluster.PortalCosts.Init(MAX_flt, NumPortals * NumPortals);
+
+    const TArray<int32> OnlyThisCluster = { ClusterIndex };
+    TMap<int32, float> Costs;
+    for (int32 i = 0; i < NumPortals; i++)
+    {
+        FloodCosts(Layout, Cluster.Portals[i], OnlyThisCluster, INDEX_NONE, INDEX_NONE, Costs);
+        for (int32 j = 0; j < NumPortals; j++)
+        {
+            if (const float* Cost = Costs.Find(Cluster.Portals[j]))
+            {
+                Cluster.PortalCosts[i * NumPortals + j] = *Cost;
+            }
+        }
+    }
+}
+
+void FDungeonClusterGraph::RebuildDirty(const FDungeonLayout& Layout)
+{
+    TSet<TPair<int32, int32>> Relinked;
+    TSet<int32> PortalsToRebuild;
+
+    for (TConstSetBitIterator<> It(DirtyClusters); It; ++It)
+    {
+        const int32 ClusterIndex = It.GetIndex();
+        PortalsToRebuild.Add(ClusterIndex);
+
+        TArray<int32, TInlineAllocator<6>> Neighbors;
+        GetNeighborClusters(ClusterIndex, Neighbors);
+        for (int32 Neighbor : Neighbors)
+        {
+            const TPair<int32, int32> Pair(FMath::Min(ClusterIndex, Neighbor), FMath::Max(ClusterIndex, Neighbor));
+            if (!Relinked.Contains(Pair))
+            {
+                Relinked.Add(Pair);
+                UnlinkClusters(Pair.Key, Pair.Value);
+                LinkClusters(Layout, Pair.Key, Pair.Value);
+            }
+            // The neighbor's portals on the shared border may have moved
+            PortalsToRebuild.Add(Neighbor);
+        }
+    }
+
+    for (int32 ClusterIndex : PortalsToRebuild)
+    {
+        RebuildPortals(Layout, ClusterIndex);
+    }
+
+    DirtyClusters.Init(false, Clusters.Num());
+    bAnyDirty = false;
+}
+
+void FDungeonClusterGraph::FloodCosts(const FDungeonLayout& Layout, int32 SourceCell, const TArray<int32>& AllowedClusters, int32 WalkableRoomA, int32 WalkableRoomB, TMap<int32, float>& OutCosts) const
+{
+    OutCosts.Reset();
+
+    // Tested for every neighbor, a bit per cluster instead of a scan of the list
+    TBitArray<> AllowedMask(false, Clusters.Num());
+    for (int32 ClusterIndex : AllowedClusters)
+    {
+        AllowedMask[ClusterIndex] = true;
+    }
+
+    TArray<FCostEntry> Open;
+    Open.HeapPush({ 0.0f, SourceCell });
+    OutCosts.Add(SourceCell, 0.0f);
+
+    while (Open.Num() > 0)
+    {
+        FCostEntry Current;
+        Open.HeapPop(Current, false);
+        if (Current.Cost > OutCosts.FindChecked(Current.Cell))
+        {
+            continue;  // Stale entry
+        }
+
+        const FIntVector Position = Layout.GetPositionFromIndex(Current.Cell);
+        for (const FIntVector& Step : FlatSteps)
+        {
+            const int32 X = Position.X + Step.X;
+            const int32 Y = Position.Y + Step.Y;
+            const int32 Z = Position.Z;
+            if (X < 0 || X >= Width || Y < 0 || Y >= Height || !AllowedMask[GetClusterIndex(X, Y, Z)])
+            {
+                continue;
+            }
+
+            const int32 Cell = Layout.GetIndex(X, Y, Z);
+            const int32 RoomId = Layout.RoomIds.Get(Cell);
+            const bool bWalkableRoom = RoomId != INDEX_NONE && (RoomId == WalkableRoomA || RoomId == WalkableRoomB);
+            if (!IsOpen(Layout, Cell) && !bWalkableRoom)
+            {
+                continue;
+            }
+
+            const float Cost = Current.Cost + 1.0f;
+            float* Known = OutCosts.Find(Cell);
+            if (!Known || Cost < *Known)
+            {
+                OutCosts.Add(Cell, Cost);
+                Open.HeapPush({ Cost, Cell });
+            }
+        }
+    }
+}
+
+void FDungeonClusterGraph::GetRoomClusters(const FDungeonLayout& Layout, int32 RoomId, TArray<int32>& OutClusters) const
+{
+    if (!Layout.Rooms.IsValidIndex(RoomId))
+    {
+        return;
+    }
+    const FRoom& Room = Layout.Rooms[RoomId];
+    for (int32 z = Room.StartZ; z < Room.StartZ + FMath::Max(Room.Length, 1) && z < Length; z++)
+    {
+        for (int32 y = Room.StartY; y < Room.StartY + Room.Height; y += ClusterSize)
+        {
+            for (int32 x = Room.StartX; x < Room.StartX + Room.Width; x += ClusterSize)
+            {
+                OutClusters.AddUnique(GetClusterIndex(x, y, z));
+            }
+            OutClusters.AddUnique(GetClusterIndex(Room.StartX + Room.Width - 1, y, z));
+        }
+        OutClusters.AddUnique(GetClusterIndex(Room.StartX, Room.StartY + Room.Height - 1, z));
+        OutClusters.AddUnique(GetClusterIndex(Room.StartX + Room.Width - 1, Room.StartY + Room.Height - 1, z));
+    }
+}
+
+bool FDungeonClusterGraph::FindClusterCorridor(const FDungeonLayout& Layout, const FIntVector& Start, const FIntVector& Goal, int32 Margin, TArray<int32>& OutClusters)
+{
+    DUNGEON_SCOPE(STAT_DungeonClusterCorridor);
+    OutClusters.Reset();
+    if (!IsBuilt())
+    {
+        return false;
+    }
+    if (bAnyDirty)
+    {
+        RebuildDirty(Layout);
+    }
+
+    const int32 StartCell = Layout.GetIndex(Start);
+    const int32 GoalCell = Layout.GetIndex(Goal);
+    const int32 StartRoomId = Layout.RoomIds.Get(StartCell);
+    const int32 GoalRoomId = Layout.RoomIds.Get(GoalCell);
+
+    // Start and goal join the abstract graph through every portal of the clusters their rooms cover
+    TArray<int32> StartClusters = { GetClusterIndex(Start.X, Start.Y, Start.Z) };
+    GetRoomClusters(Layout, StartRoomId, StartClusters);
+    TArray<int32> GoalClusters = { GetClusterIndex(Goal.X, Goal.Y, Goal.Z) };
+    GetRoomClusters(Layout, GoalRoomId, GoalClusters);
+
+    TMap<int32, float> StartCosts;
+    TMap<int32, float> GoalCosts;
+    FloodCosts(Layout, StartCell, StartClusters, StartRoomId, GoalRoomId, StartCosts);
+    FloodCosts(Layout, GoalCell, GoalClusters, StartRoomId, GoalRoomId, GoalCosts);
+
+    auto GetCellCluster = [this, &Layout](int32 Cell)
+    {
+        const FIntVector Position = Layout.GetPositionFromIndex(Cell);
+        return GetClusterIndex(Position.X, Position.Y, Position.Z);
+    };
+
+    // Abstract A*, nodes are identified by their cell
+    TMap<int32, float> GCosts;
+    TMap<int32, int32> Parents;
+    TArray<FCostEntry> Open;
+    GCosts.Add(StartCell, 0.0f);
+    Parents.Add(StartCell, INDEX_NONE);
+    Open.HeapPush({ FDungeonLayout::GridDistance(Start, Goal), StartCell });
+
+    auto Relax = [&](int32 FromCell, int32 ToCell, float StepCost)
+    {
+        const float Cost = GCosts.FindChecked(FromCell) + StepCost;
+        float* Known = GCosts.Find(ToCell);
+        if (!Known || Cost < *Known)
+        {
+            GCosts.Add(ToCell, Cost);
+            Parents.Add(ToCell, FromCell);
+            Open.HeapPush({ Cost + FDungeonLayout::GridDistance(Layout.GetPositionFromIndex(ToCell), Goal), ToCell });
+        }
+    };
+
+    bool bFound = false;
+    while (Open.Num() > 0)
+    {
+        FCostEntry Current;
+        Open.HeapPop(Current, false);
+        const float CurrentG = GCosts.FindChecked(Current.Cell);
+        if (Current.Cost > CurrentG + FDungeonLayout::GridDistance(Layout.GetPositionFromIndex(Current.Cell), Goal) + KINDA_SMALL_NUMBER)
+        {
+            continue;  // Stale entry
+        }
+        if (Current.Cell == GoalCell)
+        {
+            bFound = true;
+            break;
+        }
+
+        if (Current.Cell == StartCell)
+        {
+            if (StartCosts.Contains(GoalCell))
+            {
+                Relax(StartCell, GoalCell, StartCosts[GoalCell]);
+            }
+            for (int32 ClusterIndex : StartClusters)
+            {
+                for (int32 Portal : Clusters[ClusterIndex].Portals)
+                {
+                    if (const float* Cost = StartCosts.Find(Portal))
+                    {
+                        Relax(StartCell, Portal, *Cost);
+                    }
+                }
+            }
+            continue;
+        }
+
+        if (const float* Cost = GoalCosts.Find(Current.Cell))
+        {
+            Relax(Current.Cell, GoalCell, *Cost);
+        }
+
+        const FCluster& Cluster = Clusters[GetCellCluster(Current.Cell)];
+        const int32 PortalIndex = Cluster.Portals.Find(Current.Cell);
+        if (PortalIndex == INDEX_NONE)
+        {
+            continue;
+        }
+        const int32 NumPortals = Cluster.Portals.Num();
+        for (int32 j = 0; j < NumPortals; j++)
+        {
+            const float Cost = Cluster.PortalCosts[PortalIndex * NumPortals + j];
+            if (j != PortalIndex && Cost < MAX_flt)
+            {
+                Relax(Current.Cell, Cluster.Portals[j], Cost);
+            }
+        }
+        for (const FClusterLink& Link : Cluster.Links)
+        {
+            if (Link.FromCell == Current.Cell)
+            {
+                Relax(Current.Cell, Link.ToCell, Link.Cost);
+            }
+        }
+    }
+
+    if (!bFound)
+    {
+        return false;
+    }
+
+    TArray<int32> PathClusters = StartClusters;
+    for (int32 ClusterIndex : GoalClusters)
+    {
+        PathClusters.AddUnique(ClusterIndex);
+    }
+    for (int32 Cell = GoalCell; Cell != INDEX_NONE; Cell = Parents.FindChecked(Cell))
+    {
+        PathClusters.AddUnique(GetCellCluster(Cell));
+    }
+
+    // Widen on each level so the exact search has room to cut corners between portals
+    const int32 Layer = ClustersX * ClustersY;
+    for (int32 ClusterIndex : PathClusters)
+    {
+        const int32 CZ = ClusterIndex / Layer;
+        const int32 CY = (ClusterIndex - CZ * Layer) / ClustersX;
+        const int32 CX = ClusterIndex - CZ * Layer - CY * ClustersX;
+        for (int32 DY = -Margin; DY <= Margin; DY++)
+        {
+            for (int32 DX = -Margin; DX <= Margin; DX++)
+            {
+                if (CX + DX >= 0 && CX + DX < ClustersX && CY + DY >= 0 && CY + DY < ClustersY)
+                {
+                    OutClusters.AddUnique(ClusterIndex + DX + DY * ClustersX);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void FDungeonClusterGraph::BuildCellMask(const FDungeonLayout& Layout, const TArray<int32>& InClusters, TBitArray<>& OutMask) const
+{
+    OutMask.Init(false, Layout.GetNumCellIndices());
+    for (int32 ClusterIndex : InClusters)
+    {
+        FIntVector Min, Max;
+        GetClusterBounds(ClusterIndex, Min, Max);
+        for (int32 y = Min.Y; y <= Max.Y; y++)
+        {
+            for (int32 x = Min.X; x <= Max.X; x++)
+            {
+                OutMask[Layout.GetIndex(x, y, Min.Z)] = true;
+            }
+        }
+    }
+}
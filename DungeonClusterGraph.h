@@ -0,0 +1,94 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+struct FDungeonLayout;
+
+// Abstract graph for hierarchical pathfinding (HPA*). The grid is cut into ClusterSize x ClusterSize tiles on
+// every z-level. Open runs along the border of two neighboring clusters become entrance links between portal
+// cells, staircases give links between a cluster and the one above or below it, and the cost between the
+// portals inside a cluster is precomputed. FindClusterCorridor plans over that graph so the exact cell search
+// only has to run inside the clusters the abstract path goes through.
+class FDungeonClusterGraph
+{
+public:
+    void Build(const FDungeonLayout& Layout, int32 InClusterSize);
+
+    void Reset();
+
+    bool IsBuilt() const { return ClusterSize > 0; }
+
+    // Called whenever a cell changes value. The cluster is rebuilt, together with the links to its neighbors, before the next query
+    void MarkCellChanged(int32 X, int32 Y, int32 Z);
+
+    // Abstract search from Start to Goal. On success OutClusters holds every cluster the abstract path visits,
+    // the clusters covered by the start and goal rooms, and everything within Margin clusters of those on the same level
+    bool FindClusterCorridor(const FDungeonLayout& Layout, const FIntVector& Start, const FIntVector& Goal, int32 Margin, TArray<int32>& OutClusters);
+
+    // Sets the bit of every cell inside Clusters, indexed like the layout's cells
+    void BuildCellMask(const FDungeonLayout& Layout, const TArray<int32>& Clusters, TBitArray<>& OutMask) const;
+
+    int32 GetClusterIndex(int32 X, int32 Y, int32 Z) const
+    {
+        return X / ClusterSize + (Y / ClusterSize) * ClustersX + Z * ClustersX * ClustersY;
+    }
+
+    int32 GetNumClusters() const { return Clusters.Num(); }
+
+private:
+    struct FClusterLink
+    {
+        int32 FromCell;   // Portal inside this cluster
+        int32 ToCell;     // Portal on the other side
+        int32 ToCluster;
+        float Cost;
+    };
+
+    struct FCluster
+    {
+        TArray<FClusterLink> Links;
+
+        // Unique FromCells of Links
+        TArray<int32> Portals;
+
+        // Portals.Num() x Portals.Num() in-cluster path costs, MAX_flt when unreachable
+        TArray<float> PortalCosts;
+    };
+
+    void RebuildDirty(const FDungeonLayout& Layout);
+
+    void LinkClusters(const FDungeonLayout& Layout, int32 ClusterA, int32 ClusterB);
+
+    void UnlinkClusters(int32 ClusterA, int32 ClusterB);
+
+    void RebuildPortals(const FDungeonLayout& Layout, int32 ClusterIndex);
+
+    // Horizontal and vertical neighbors of a cluster
+    void GetNeighborClusters(int32 ClusterIndex, TArray<int32, TInlineAllocator<6>>& OutNeighbors) const;
+
+    void GetClusterBounds(int32 ClusterIndex, FIntVector& OutMin, FIntVector& OutMax) const;
+
+    // Clusters overlapped by a room's footprint
+    void GetRoomClusters(const FDungeonLayout& Layout, int32 RoomId, TArray<int32>& OutClusters) const;
+
+    // Dijkstra over flat steps from SourceCell, restricted to AllowedClusters. Cells of WalkableRoomA/B count as
+    // open like they do for FindPath when those rooms are being connected
+    void FloodCosts(const FDungeonLayout& Layout, int32 SourceCell, const TArray<int32>& AllowedClusters, int32 WalkableRoomA, int32 WalkableRoomB, TMap<int32, float>& OutCosts) const;
+
+    // Empty or corridor, the cells any corridor search may walk through
+    static bool IsOpen(const FDungeonLayout& Layout, int32 Cell);
+
+    int32 ClusterSize = 0;
+    int32 ClustersX = 0;
+    int32 ClustersY = 0;
+    int32 ClustersZ = 0;
+    int32 Width = 0;
+    int32 Height = 0;
+    int32 Length = 0;
+
+    TArray<FCluster> Clusters;
+    TBitArray<> DirtyClusters;
+    bool bAnyDirty = false;
+};
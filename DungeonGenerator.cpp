@@ -7,24 +7,193 @@
 #include "Containers/Queue.h"
 #include "GameFramework/PlayerStart.h"
 #include "Kismet/GameplayStatics.h"
-
-TArray<FVector> ADungeonGenerator::GetNeighbors(const FVector& NodePosition, const FVector& StartPos, const FVector& TargetPos, bool IsStairCase, FVector StairDirection)
+#include "Async/ParallelFor.h"
+#include "Async/Async.h"
+#include "Components/HierarchicalInstancedStaticMeshComponent.h"
+#include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+#include "Hash/CityHash.h"
+#include "Engine/CollisionProfile.h"
+#include "Engine/StaticMesh.h"
+#include "ProceduralMeshComponent.h"
+#include "Algo/BinarySearch.h"
+
+DECLARE_CYCLE_STAT(TEXT("Generate layout"), STAT_DungeonGenerateLayout, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("Initialize grid"), STAT_DungeonInitializeGrid, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("Place rooms"), STAT_DungeonPlaceRooms, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("Build MST"), STAT_DungeonBuildMST, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("Connect rooms"), STAT_DungeonConnectRooms, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("FindPath"), STAT_DungeonFindPath, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("FindPath hierarchical"), STAT_DungeonFindPathHierarchical, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("FindPathsToRooms"), STAT_DungeonFindPathsToRooms, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("Place path"), STAT_DungeonPlacePath, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("Spawn environment"), STAT_DungeonSpawnEnvironment, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("Build wall edges"), STAT_DungeonBuildWallEdges, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("Load layout"), STAT_DungeonLoadLayout, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("Save layout"), STAT_DungeonSaveLayout, STATGROUP_DungeonGen);
+DECLARE_CYCLE_STAT(TEXT("Update room"), STAT_DungeonUpdateRoom, STATGROUP_DungeonGen);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Nodes expanded"), STAT_DungeonNodesExpanded, STATGROUP_DungeonGen);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Neighbor tests"), STAT_DungeonNeighborTests, STATGROUP_DungeonGen);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Open set peak (last search)"), STAT_DungeonOpenSetPeak, STATGROUP_DungeonGen);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Searches"), STAT_DungeonSearches, STATGROUP_DungeonGen);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Failed searches"), STAT_DungeonFailedSearches, STATGROUP_DungeonGen);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Rooms rejected by CanPlaceRoom"), STAT_DungeonRoomsRejected, STATGROUP_DungeonGen);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Actors spawned"), STAT_DungeonActorsSpawned, STATGROUP_DungeonGen);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Instances spawned"), STAT_DungeonInstancesSpawned, STATGROUP_DungeonGen);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Merged quads spawned"), STAT_DungeonMergedQuadsSpawned, STATGROUP_DungeonGen);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Wall edges"), STAT_DungeonWallEdges, STATGROUP_DungeonGen);
+
+namespace
 {
+    const FIntVector FlatDirections[] = {
+        FIntVector(1, 0, 0), FIntVector(-1, 0, 0),  // East, West
+        FIntVector(0, 1, 0), FIntVector(0, -1, 0), // North, South
+    };
+
+    const FIntVector StaircaseDirections[] = {
+        FIntVector(2, 0, 1), FIntVector(-2, 0, 1), // Moving East/West, Ascending
+        FIntVector(2, 0, -1), FIntVector(-2, 0, -1), // Moving East/West, Descending
+        FIntVector(0, 2, 1), FIntVector(0, -2, 1), // Moving North/South, Ascending
+        FIntVector(0, 2, -1), FIntVector(0, -2, -1) // Moving North/South, Descending
+    };
+
+    // Room center in half cells, exact so connection distances can be compared without rounding
+    FIntPoint GetRoomCenterKey(const FRoom& Room)
+    {
+        return FIntPoint(2 * Room.StartX + Room.Width, 2 * Room.StartY + Room.Height);
+    }
+
+    // Which of 8 half-open 45 degree cones, counterclockwise from +X, the nonzero offset (DX, DY) falls in
+    int32 GetConeIndex(int64 DX, int64 DY)
+    {
+        if (DX > 0 && DY >= 0) return DY < DX ? 0 : 1;
+        if (DX <= 0 && DY > 0) return -DX < DY ? 2 : 3;
+        if (DX < 0 && DY <= 0) return -DY < -DX ? 4 : 5;
+        return DX < -DY ? 6 : 7;
+    }
 
+    // Quads of one procedural mesh section
+    struct FMergedMeshSection
+    {
+        TArray<FVector> Vertices;
+        TArray<int32> Triangles;
+        TArray<FVector> Normals;
+        TArray<FVector2D> UVs;
+        TArray<FProcMeshTangent> Tangents;
+
+        // Quad spanned by U and V from Origin, facing Normal
+        void AddQuad(const FVector& Origin, const FVector& U, const FVector& V, const FVector& Normal, float CellSize)
+        {
+            const int32 First = Vertices.Num();
+            Vertices.Append({ Origin, Origin + U, Origin + U + V, Origin + V });
+
+            // UVs in cells, so a tiling material repeats once per cell however many cells the quad covers
+            const double SizeU = U.Size() / CellSize;
+            const double SizeV = V.Size() / CellSize;
+            UVs.Append({ FVector2D(0, 0), FVector2D(SizeU, 0), FVector2D(SizeU, SizeV), FVector2D(0, SizeV) });
+            const FProcMeshTangent Tangent(U.GetSafeNormal(), false);
+            for (int32 i = 0; i < 4; i++)
+            {
+                Normals.Add(Normal);
+                Tangents.Add(Tangent);
+            }
 
+            // Winding the engine treats as front facing from the side Normal points to
+            if (((V ^ U) | Normal) > 0)
+            {
+                Triangles.Append({ First, First + 1, First + 2, First, First + 2, First + 3 });
+            }
+            else
+            {
+                Triangles.Append({ First, First + 2, First + 1, First, First + 3, First + 2 });
+            }
+        }
 
-     TArray<FVector> Neighbors;
-    TArray<FVector> Directions = {
-        FVector(1, 0, 0), FVector(-1, 0, 0),  // East, West
-        FVector(0, 1, 0), FVector(0, -1, 0), // North, South
-        // Up, Down
+        void Reset()
+        {
+            Vertices.Reset();
+            Triangles.Reset();
+            Normals.Reset();
+            UVs.Reset();
+            Tangents.Reset();
+        }
     };
-        
+
+    // Convex hull of a quad pushed Thickness back behind its face, the collision of one merged quad
+    TArray<FVector> MakeQuadCollision(const FVector& Origin, const FVector& U, const FVector& V, const FVector& Normal, float Thickness)
+    {
+        const FVector Back = -Normal * Thickness;
+        return { Origin, Origin + U, Origin + U + V, Origin + V,
+            Origin + Back, Origin + U + Back, Origin + U + V + Back, Origin + V + Back };
+    }
+
+    // Greedy rectangles over the set bits of a chunk wide mask, bit B of row R being the cell B along row R. Each
+    // rectangle is the run starting at the lowest set bit of the lowest row, grown over the following rows while
+    // they hold the whole run when bGrowRows. Bits are cleared as they are taken
+    template<int32 NumRows, typename FuncType>
+    void ForEachMergedRect(uint32 (&Rows)[NumRows], bool bGrowRows, FuncType&& Func)
+    {
+        for (int32 Row = 0; Row < NumRows; Row++)
+        {
+            while (Rows[Row])
+            {
+                const int32 Bit = FMath::CountTrailingZeros(Rows[Row]);
+                const int32 NumBits = FMath::CountTrailingZeros(~(Rows[Row] >> Bit));
+                const uint32 RunMask = ((1u << NumBits) - 1) << Bit;
+
+                int32 NumRunRows = 1;
+                while (bGrowRows && Row + NumRunRows < NumRows && (Rows[Row + NumRunRows] & RunMask) == RunMask)
+                {
+                    NumRunRows++;
+                }
+                for (int32 i = Row; i < Row + NumRunRows; i++)
+                {
+                    Rows[i] &= ~RunMask;
+                }
+                Func(Bit, Row, NumBits, NumRunRows);
+            }
+        }
+    }
+
+    // LOD 0 triangles and physics bodies of a spawned component, for BenchmarkSpawning
+    void CountRenderCost(UActorComponent* Component, int64& InOutTriangles, int32& InOutBodies)
+    {
+        if (UInstancedStaticMeshComponent* Instanced = Cast<UInstancedStaticMeshComponent>(Component))
+        {
+            const UStaticMesh* Mesh = Instanced->GetStaticMesh();
+            InOutTriangles += Mesh ? int64(Mesh->GetNumTriangles(0)) * Instanced->GetInstanceCount() : 0;
+            InOutBodies += Instanced->IsCollisionEnabled() ? Instanced->GetInstanceCount() : 0;
+        }
+        else if (UStaticMeshComponent* StaticMesh = Cast<UStaticMeshComponent>(Component))
+        {
+            InOutTriangles += StaticMesh->GetStaticMesh() ? StaticMesh->GetStaticMesh()->GetNumTriangles(0) : 0;
+            InOutBodies += StaticMesh->IsCollisionEnabled() ? 1 : 0;
+        }
+        else if (UProceduralMeshComponent* Procedural = Cast<UProceduralMeshComponent>(Component))
+        {
+            for (int32 i = 0; i < Procedural->GetNumSections(); i++)
+            {
+                InOutTriangles += Procedural->GetProcMeshSection(i)->ProcIndexBuffer.Num() / 3;
+            }
+            InOutBodies += Procedural->IsCollisionEnabled() ? 1 : 0;
+        }
+    }
+}
+
+TArray<FIntVector, TInlineAllocator<8>> FDungeonLayout::GetNeighbors(const FIntVector& NodePosition, int32 StartRoomId, int32 TargetRoomId, bool IsStairCase, const FIntVector& StairDirection) const
+{
+
+
+
+     TArray<FIntVector, TInlineAllocator<8>> Neighbors;
     
 
-    for (const FVector& Dir : Directions)
+    for (const FIntVector& Dir : FlatDirections)
     {
-        FVector NewPos = NodePosition + Dir;  
+        FIntVector NewPos = NodePosition + Dir;  
         if (NewPos.X >= 0 && NewPos.X < Width  && NewPos.Y >= 0 && NewPos.Y < Height  && NewPos.Z >= 0 && NewPos.Z < Length )
         {
 
@@ -42,7 +211,7 @@ TArray<FVector> ADungeonGenerator::GetNeighbors(const FVector& NodePosition, con
 
            
 
-            if (IsWalkable(NewPos,StartPos,TargetPos))
+            if (IsWalkable(NewPos,StartRoomId,TargetRoomId))
             {
                 Neighbors.Add(NewPos);
             }
@@ -54,34 +223,27 @@ TArray<FVector> ADungeonGenerator::GetNeighbors(const FVector& NodePosition, con
     return Neighbors;
 }
 
-bool ADungeonGenerator::checkpath(TArray<FAStarNode*> path)
+bool FDungeonLayout::checkpath(const TArray<FIntVector>& path)
 {
 
     return false;
 }
 
-TArray<FVector> ADungeonGenerator::GetStairNeighbors(const FVector& NodePosition, const FVector& StartPos, const FVector& TargetPos, bool IsStairCase,FVector Direction,bool IsStairCorridor,FAStarNode* node )
+TArray<FIntVector, TInlineAllocator<8>> FDungeonLayout::GetStairNeighbors(const FIntVector& NodePosition, int32 StartRoomId, bool IsStairCase,const FIntVector& Direction,bool IsStairCorridor,const FIntVector& ParentPosition ) const
 {
     
 
-    TArray<FVector> StaircaseDirections = {
-    FVector(2, 0, 1), FVector(-2, 0, 1), // Moving East/West, Ascending
-    FVector(2, 0, -1), FVector(-2, 0, -1), // Moving East/West, Descending
-    FVector(0, 2, 1), FVector(0, -2, 1), // Moving North/South, Ascending
-    FVector(0, 2, -1), FVector(0, -2, -1) // Moving North/South, Descending
-    };
-
-     TArray<FVector> Neighbors;
+     TArray<FIntVector, TInlineAllocator<8>> Neighbors;
    
    if(IsStairCorridor)
         {
             return Neighbors;
         }
 
-    if(!IsInRoom(NodePosition,GetRoomFromPosition(StartPos))&&GetIndex(NodePosition.X,NodePosition.Y,NodePosition.Z))
-    for (const FVector& Dir : StaircaseDirections)
+    if(GetRoomIdAt(NodePosition)!=StartRoomId&&GetIndex(NodePosition))
+    for (const FIntVector& Dir : StaircaseDirections)
     {
-        FVector NewPos = NodePosition + Dir;
+        FIntVector NewPos = NodePosition + Dir;
 
         if(IsStairCase)
         {
@@ -96,20 +258,15 @@ TArray<FVector> ADungeonGenerator::GetStairNeighbors(const FVector& NodePosition
         }
 
         
-            FVector nodeDirection=node->CameFrom->Position;
-           
-            FVector result= nodeDirection+FVector(Dir.X/2,Dir.Y/2,Dir.Z);
-
-            FVector check= node->Position+Dir;
-          
-            if(result.Equals(check, 1e-4f))
+            // Don't climb straight back over the cell we came from
+            if(ParentPosition==NodePosition+FIntVector(Dir.X/2,Dir.Y/2,0))
             {
                
                 continue;
             }
 
 
-        if(Direction+Dir==FVector(0,0,-2))
+        if(Direction+Dir==FIntVector(0,0,-2))
         {
             continue;
         }
@@ -128,32 +285,32 @@ TArray<FVector> ADungeonGenerator::GetStairNeighbors(const FVector& NodePosition
 }
 
 
-bool ADungeonGenerator::IsStaircaseWalkable(const FVector& StartPos, const FVector& Direction)
+void FDungeonLayout::GetStaircaseCells(const FIntVector& StartPosition, const FIntVector& Direction, TArray<FIntVector, TInlineAllocator<4>>& OutCells)
 {
-   
+    OutCells.Reset();
+    OutCells.Add(StartPosition + FIntVector(Direction.X / 2, Direction.Y / 2, 0));
+    OutCells.Add(StartPosition + FIntVector(Direction.X , Direction.Y , 0));
+    OutCells.Add(StartPosition + FIntVector(Direction.X / 2, Direction.Y / 2, Direction.Z ));
+    OutCells.Add(StartPosition + Direction);
+}
 
-    TArray<FVector> StaircaseCells;
-   
+bool FDungeonLayout::IsStaircaseWalkable(const FIntVector& StartPos, const FIntVector& Direction) const
+{
    
-    StaircaseCells.Add(StartPos + FVector(Direction.X / 2, Direction.Y / 2, 0));
-     StaircaseCells.Add(StartPos + FVector(Direction.X , Direction.Y , 0));
-    StaircaseCells.Add(StartPos + FVector(Direction.X / 2, Direction.Y / 2, Direction.Z ));
-    StaircaseCells.Add(StartPos + Direction);
 
-    for (const FVector& Point : StaircaseCells) {
+    TArray<FIntVector, TInlineAllocator<4>> StaircaseCells;
+    GetStaircaseCells(StartPos, Direction, StaircaseCells);
 
-                int32 X = Point.X ;
-            int32 Y = Point.Y;
-            int32 Z = Point.Z ;
-            int32 Index = GetIndex(X, Y, Z);
+    for (const FIntVector& Point : StaircaseCells) {
 
-        
-            if (!Grid.IsValidIndex(Index))
+            if (!IsInGrid(Point))
             {
             
                 return false;  // Out of bounds
             }
-            if (Grid[Index] == 1||Grid[Index]==6||Grid[Index]==2)  // Assuming '0' means walkable/open space
+            int32 Index = GetIndex(Point);
+            const EDungeonCell Cell = GetCell(Index);
+            if (Cell == EDungeonCell::Room||Cell==EDungeonCell::Stair||Cell==EDungeonCell::Corridor)  // Assuming '0' means walkable/open space
             {
                 
                 return false;
@@ -166,171 +323,404 @@ bool ADungeonGenerator::IsStaircaseWalkable(const FVector& StartPos, const FVect
     return true;
 }
 
-FVector ADungeonGenerator::RoomCenter(const FRoom& Room)
+FIntVector FDungeonLayout::RoomCenter(const FRoom& Room) const
 {
   
 
-    return FVector(
+    return FIntVector(
         (Room.StartX + Room.Width / 2) ,
         (Room.StartY + Room.Height / 2) ,
         (Room.StartZ)
     );
 }
 
-bool ADungeonGenerator::IsWalkable(const FVector& Position, const FVector& StartPos, const FVector& TargetPos)
+bool FDungeonLayout::IsWalkable(const FIntVector& Position, int32 StartRoomId, int32 TargetRoomId) const
 {
-    int32 X = Position.X ;
-    int32 Y = Position.Y;
-    int32 Z = Position.Z ;
-    int32 Index = GetIndex(X, Y, Z);
-
-   
-    if (!Grid.IsValidIndex(Index))
+    if (!IsInGrid(Position))
     {
        
         return false;  // Out of bounds
     }
-    if (Grid[Index] == 0||Grid[Index]==2)  // Assuming '0' means walkable/open space
+    int32 Index = GetIndex(Position);
+    const EDungeonCell Cell = GetCell(Index);
+    if (Cell == EDungeonCell::Empty||Cell==EDungeonCell::Corridor)  // Assuming '0' means walkable/open space
     {
         
         return true;
     }
     // Check if the position is within the start or target room
-    bool isInStartRoom = IsInRoom(Position, GetRoomFromPosition(StartPos));
-    bool isInTargetRoom = IsInRoom(Position, GetRoomFromPosition(TargetPos));
+    const int32 RoomId = RoomIds.Get(Index);
 
     
 
-    return (isInStartRoom || isInTargetRoom);
+    return RoomId != INDEX_NONE && (RoomId == StartRoomId || RoomId == TargetRoomId);
 }
 
-FRoom ADungeonGenerator::GetRoomFromPosition(const FVector& Position)
+FRoom FDungeonLayout::GetRoomFromPosition(const FIntVector& Position)
 {
-    for (const FRoom& Room : Rooms)
+    const int32 RoomId = GetRoomIdAt(Position);
+    if (RoomId != INDEX_NONE)
+        return Rooms[RoomId];
+    return FRoom();  // Return an empty room if no room is found
+}
+
+int32 FDungeonLayout::GetRoomIdAt(const FIntVector& GridPosition) const
+{
+    if (!IsInGrid(GridPosition) || !IsGridInitialized())
     {
-        if (IsInRoom(Position, Room))
-            return Room;
+        return INDEX_NONE;
     }
-    return FRoom();  // Return an empty room if no room is found
+    return RoomIds.Get(GetIndex(GridPosition));
+}
+
+int32 ADungeonGenerator::GetRoomIdAt(const FIntVector& GridPosition) const
+{
+    return Layout.GetRoomIdAt(GridPosition);
+}
+
+EDungeonCell ADungeonGenerator::GetCellAt(const FIntVector& GridPosition) const
+{
+    return Layout.GetCellAt(GridPosition);
+}
+
+TArray<int32> ADungeonGenerator::GetGrid() const
+{
+    return Layout.GetGrid();
+}
+
+int32 ADungeonGenerator::GetRoomIdAtWorldLocation(const FVector& WorldLocation) const
+{
+    return Layout.GetRoomIdAt(GetGridLocation(WorldLocation));
+}
+
+bool FDungeonLayout::IsInRoom(const FIntVector& Position, const FRoom& Room)
+{
+    return Position.X >= Room.StartX && Position.X < Room.StartX + Room.Width &&
+           Position.Y >= Room.StartY && Position.Y < Room.StartY + Room.Height &&
+           Position.Z == Room.StartZ;
 }
 
-bool ADungeonGenerator::IsInRoom(const FVector& Position, const FRoom& Room)
+namespace
 {
-    int32 X = Position.X ;  // Convert from world coordinates to grid indices
-    int32 Y = Position.Y ;
-    int32 Z = Position.Z ;
+    // Every direction FindPath stores for a node: none, the 4 flat steps leaving a staircase and the 8 staircase moves
+    const FIntVector SearchDirections[] = {
+        FIntVector(0, 0, 0),
+        FIntVector(1, 0, 0), FIntVector(-1, 0, 0), FIntVector(0, 1, 0), FIntVector(0, -1, 0),
+        FIntVector(2, 0, 1), FIntVector(-2, 0, 1), FIntVector(2, 0, -1), FIntVector(-2, 0, -1),
+        FIntVector(0, 2, 1), FIntVector(0, -2, 1), FIntVector(0, 2, -1), FIntVector(0, -2, -1)
+    };
+}
 
-    return X >= Room.StartX && X < Room.StartX + Room.Width &&
-           Y >= Room.StartY && Y < Room.StartY + Room.Height &&
-           Z == Room.StartZ;
+float FDungeonLayout::GridDistance(const FIntVector& A, const FIntVector& B)
+{
+    const FIntVector Delta = A - B;
+    return FMath::Sqrt(float(Delta.X * Delta.X + Delta.Y * Delta.Y + Delta.Z * Delta.Z));
 }
 
-bool checkpath( TArray<FAStarNode*> Path)
+uint8 FDungeonSearchState::EncodeDirection(const FIntVector& Direction)
 {
-    TArray<FVector> staircasecells;
-    for(FAStarNode* node:Path)
+    for (int32 i = 0; i < UE_ARRAY_COUNT(SearchDirections); i++)
     {
-        if(node->Istair)
+        if (SearchDirections[i] == Direction)
         {
-            FVector Direction= node->StairDirection;
-            staircasecells.Add(node->Position);
+            return i;
         }
     }
-    return false;
+    return 0;
 }
 
-TArray<FAStarNode*> ADungeonGenerator::FindPath(const FVector& StartPos, const FVector& TargetPos)
+FIntVector FDungeonSearchState::DecodeDirection(uint8 Code)
 {
-    TArray<FAStarNode*> Path;
-    TArray<FAStarNode*> OpenSet;
-    TMap<FVector, FAStarNode*> AllNodes;  // No need for custom key comparators
+    return SearchDirections[Code];
+}
 
-    FAStarNode* StartNode = new FAStarNode(StartPos, 0, FVector::Dist(StartPos, TargetPos));
-	
-    OpenSet.Add(StartNode);
-    AllNodes.Add(StartPos, StartNode);
+void FDungeonSearchState::Begin(int32 NumCells)
+{
+    const int32 NumPages = FMath::DivideAndRoundUp(NumCells, PageCells);
+    if (Pages.Num() != NumPages)
+    {
+        Pages.Empty(NumPages);
+        Pages.SetNum(NumPages);
+        Generation = 0;
+    }
+
+    Generation++;
+    if (Generation == 0)
+    {
+        // Wrapped around, old stamps could alias the new generation
+        for (TUniquePtr<FPage>& Page : Pages)
+        {
+            if (Page.IsValid())
+            {
+                FMemory::Memzero(Page->Stamp, sizeof(Page->Stamp));
+            }
+        }
+        Generation = 1;
+    }
+
+    Heap.Reset();
+    NextSequence = 0;
+    NodesExpanded = 0;
+    PeakOpen = 0;
+    NeighborTests = 0;
+    MinPrunedFCost = MAX_flt;
+}
+
+void FDungeonSearchState::Empty()
+{
+    Pages.Empty();
+    Heap.Empty();
+    Generation = 0;
+}
+
+void FDungeonSearchState::Visit(int32 Cell, float G, float H, int32 ParentCell, uint8 CellFlags)
+{
+    TUniquePtr<FPage>& Page = Pages[Cell >> PageBits];
+    if (!Page.IsValid())
+    {
+        Page = MakeUnique<FPage>();  // Zeroed, so no stamp matches a live generation
+    }
+    const int32 Local = Cell & PageMask;
+    Page->Stamp[Local] = Generation;
+    Page->GCost[Local] = G;
+    Page->HCost[Local] = H;
+    Page->Parent[Local] = ParentCell;
+    Page->Flags[Local] = CellFlags;
+    Page->HeapIndex[Local] = INDEX_NONE;
+}
+
+void FDungeonSearchState::Place(const FOpenEntry& Entry, int32 Index)
+{
+    Heap[Index] = Entry;
+    GetPage(Entry.Cell).HeapIndex[Entry.Cell & PageMask] = Index;
+}
+
+void FDungeonSearchState::SiftUp(int32 Index)
+{
+    const FOpenEntry Entry = Heap[Index];
+    while (Index > 0)
+    {
+        const int32 ParentIndex = (Index - 1) / 2;
+        if (!Less(Entry, Heap[ParentIndex]))
+        {
+            break;
+        }
+        Place(Heap[ParentIndex], Index);
+        Index = ParentIndex;
+    }
+    Place(Entry, Index);
+}
 
+void FDungeonSearchState::SiftDown(int32 Index)
+{
+    const FOpenEntry Entry = Heap[Index];
+    const int32 Count = Heap.Num();
+    while (true)
+    {
+        int32 ChildIndex = Index * 2 + 1;
+        if (ChildIndex >= Count)
+        {
+            break;
+        }
+        if (ChildIndex + 1 < Count && Less(Heap[ChildIndex + 1], Heap[ChildIndex]))
+        {
+            ChildIndex++;
+        }
+        if (!Less(Heap[ChildIndex], Entry))
+        {
+            break;
+        }
+        Place(Heap[ChildIndex], Index);
+        Index = ChildIndex;
+    }
+    Place(Entry, Index);
+}
 
+void FDungeonSearchState::PushOpen(int32 Cell)
+{
+    FPage& Page = GetPage(Cell);
+    const int32 Local = Cell & PageMask;
+    FOpenEntry Entry;
+    Entry.FCost = Page.GCost[Local] + Page.HCost[Local];
+    Entry.HCost = Page.HCost[Local];
+    Entry.Sequence = NextSequence++;
+    Entry.Cell = Cell;
+
+    Page.HeapIndex[Local] = Heap.Add(Entry);
+    PeakOpen = FMath::Max(PeakOpen, Heap.Num());
+    if (!bSortedArrayBaseline)
+    {
+        SiftUp(Page.HeapIndex[Local]);
+    }
+}
 
-    while (OpenSet.Num() > 0)
+int32 FDungeonSearchState::PopOpen()
+{
+    if (bSortedArrayBaseline)
     {
-        // Sort OpenSet based on FCost, then HCost for ties
-        OpenSet.Sort([](const FAStarNode& A, const FAStarNode& B) {
-            return A.FCost() == B.FCost() ? A.HCost < B.HCost : A.FCost() < B.FCost();
+        // Old behaviour: sort everything, then shift the whole array down by one
+        Heap.Sort([](const FOpenEntry& A, const FOpenEntry& B) {
+            return A.FCost == B.FCost ? A.HCost < B.HCost : A.FCost < B.FCost;
         });
+        const int32 FrontCell = Heap[0].Cell;
+        Heap.RemoveAt(0);
+        for (int32 i = 0; i < Heap.Num(); i++)
+        {
+            GetPage(Heap[i].Cell).HeapIndex[Heap[i].Cell & PageMask] = i;
+        }
+        GetPage(FrontCell).HeapIndex[FrontCell & PageMask] = INDEX_NONE;
+        return FrontCell;
+    }
 
-        FAStarNode* CurrentNode = OpenSet[0];
-        OpenSet.RemoveAt(0);  // Pop the first element (the node with the lowest F cost)
-		
-        
+    const int32 FrontCell = Heap[0].Cell;
+    const FOpenEntry Last = Heap.Pop(false);
+    if (Heap.Num() > 0)
+    {
+        Place(Last, 0);
+        SiftDown(0);
+    }
+    GetPage(FrontCell).HeapIndex[FrontCell & PageMask] = INDEX_NONE;
+    return FrontCell;
+}
+
+void FDungeonSearchState::DecreaseKey(int32 Cell)
+{
+    const FPage& Page = GetPage(Cell);
+    const int32 Local = Cell & PageMask;
+    const int32 Index = Page.HeapIndex[Local];
+    if (Index == INDEX_NONE)
+    {
+        return;  // Already expanded, like before the new cost is recorded but the cell isn't reopened
+    }
+    Heap[Index].FCost = Page.GCost[Local] + Page.HCost[Local];
+    if (!bSortedArrayBaseline)
+    {
+        SiftUp(Index);
+    }
+}
+
+TArray<FIntVector> FDungeonLayout::FindPath(const FIntVector& StartPos, const FIntVector& TargetPos)
+{
+    SearchState.bSortedArrayBaseline = bUseSortedOpenSetBaseline;
+    TArray<FIntVector> Path = FindPath(StartPos, TargetPos, SearchState, nullptr);
+    LastSearchNodesExpanded = SearchState.NodesExpanded;
+    return Path;
+}
+
+TArray<FIntVector> FDungeonLayout::FindPath(const FIntVector& StartPos, const FIntVector& TargetPos, FDungeonSearchState& State, TArray<int32>* OutExpandedCells) const
+{
+    DUNGEON_SCOPE(STAT_DungeonFindPath);
+    TArray<FIntVector> Path;
+    State.Begin(GetNumCellIndices());
+    if (OutExpandedCells)
+    {
+        OutExpandedCells->Reset();
+    }
+
+    const int32 StartCell = GetIndex(StartPos);
+    const int32 TargetCell = GetIndex(TargetPos);
+    const int32 StartRoomId = RoomIds.Get(StartCell);
+    const int32 TargetRoomId = RoomIds.Get(TargetCell);
+
+    State.Visit(StartCell, 0, GridDistance(StartPos, TargetPos), INDEX_NONE, 0);
+    State.PushOpen(StartCell);
+
+
+
+    while (State.NumOpen() > 0)
+    {
+        // Lowest FCost, then HCost for ties
+        const int32 CurrentCell = State.PopOpen();
+        State.NodesExpanded++;
+        if (OutExpandedCells)
+        {
+            OutExpandedCells->Add(CurrentCell);
+        }
+
+        const bool bCurrentIsStair = State.IsStair(CurrentCell);
         
-        if (CurrentNode->Position.Equals(TargetPos, 0.0f)&&CurrentNode->Istair==false)  // Check proximity within a small threshold
+        if (CurrentCell == TargetCell && !bCurrentIsStair)
         {
 
         
-            while (CurrentNode != nullptr)
+            for (int32 Cell = CurrentCell; Cell != INDEX_NONE; Cell = State.GetParent(Cell))
             {
                 
-                Path.Add(CurrentNode);
+                Path.Add(GetPositionFromIndex(Cell));
                 
-                CurrentNode = CurrentNode->CameFrom;
             }
             Algo::Reverse(Path);
             break;
         }
 
-        TArray<FVector> Neighbors = GetNeighbors(CurrentNode->Position,StartPos, TargetPos,CurrentNode->Istair,CurrentNode->StairDirection);
+        const FIntVector CurrentPos = GetPositionFromIndex(CurrentCell);
+        const FIntVector StairDirection = State.GetStairDirection(CurrentCell);
+        const int32 ParentCell = State.GetParent(CurrentCell);
+        const FIntVector ParentPos = ParentCell != INDEX_NONE ? GetPositionFromIndex(ParentCell) : CurrentPos;
+        const float CurrentGCost = State.GetGCost(CurrentCell);
 
-        TArray<FVector> StairNeighbors= GetStairNeighbors(CurrentNode->Position,StartPos, TargetPos,CurrentNode->Istair,CurrentNode->StairDirection,CurrentNode->IsStaircorridor,CurrentNode);
+        const TArray<FIntVector, TInlineAllocator<8>> Neighbors = GetNeighbors(CurrentPos,StartRoomId, TargetRoomId,bCurrentIsStair,StairDirection);
 
-        for (const FVector& Neighbor : Neighbors)
+        const TArray<FIntVector, TInlineAllocator<8>> StairNeighbors= GetStairNeighbors(CurrentPos,StartRoomId,bCurrentIsStair,StairDirection,State.IsStairCorridor(CurrentCell),ParentPos);
+        State.NeighborTests += Neighbors.Num() + StairNeighbors.Num();
+
+        for (const FIntVector& Neighbor : Neighbors)
         {
 			
 			
-            float TentativeGCost = CurrentNode->GCost + (CurrentNode->Position - Neighbor).Size();  // Distance as cost
-            FAStarNode* NeighborNode = AllNodes.FindRef(Neighbor);
+            float TentativeGCost = CurrentGCost + GridDistance(CurrentPos, Neighbor);  // Distance as cost
+            const int32 NeighborCell = GetIndex(Neighbor);
+            if (State.AllowedCells && !(*State.AllowedCells)[NeighborCell])
+            {
+                State.MinPrunedFCost = FMath::Min(State.MinPrunedFCost, TentativeGCost + GridDistance(Neighbor, TargetPos));
+                continue;
+            }
 			
-            if (!NeighborNode)
+            if (!State.IsVisited(NeighborCell))
             {
-                NeighborNode = new FAStarNode(Neighbor, TentativeGCost, FVector::Dist(Neighbor, TargetPos), CurrentNode);
+                uint8 NeighborFlags = 0;
                
                 
-              if(CurrentNode->Istair)
+              if(bCurrentIsStair)
                 {
-                    NeighborNode->IsStaircorridor=true;
-                    NeighborNode->StairDirection=Neighbor-CurrentNode->Position;
+                    NeighborFlags = FDungeonSearchState::Flag_StairCorridor
+                        | (FDungeonSearchState::EncodeDirection(Neighbor - CurrentPos) << FDungeonSearchState::DirectionShift);
                 }
                 
-                OpenSet.Add(NeighborNode);
-                AllNodes.Add(Neighbor, NeighborNode);
+                State.Visit(NeighborCell, TentativeGCost, GridDistance(Neighbor, TargetPos), CurrentCell, NeighborFlags);
+                State.PushOpen(NeighborCell);
             }
-            else if (TentativeGCost < NeighborNode->GCost)
+            else if (TentativeGCost < State.GetGCost(NeighborCell))
             {
-                NeighborNode->CameFrom = CurrentNode;
-                NeighborNode->GCost = TentativeGCost;
+                State.Reparent(NeighborCell, CurrentCell, TentativeGCost);
+                State.DecreaseKey(NeighborCell);
             }
         }
 
-        for (const FVector& Neighbor : StairNeighbors)
+        for (const FIntVector& Neighbor : StairNeighbors)
         {
 			
 			
-            float TentativeGCost = CurrentNode->GCost + (CurrentNode->Position - Neighbor).Size();  // Distance as cost
-            FAStarNode* NeighborNode = AllNodes.FindRef(Neighbor);
+            float TentativeGCost = CurrentGCost + GridDistance(CurrentPos, Neighbor);  // Distance as cost
+            const int32 NeighborCell = GetIndex(Neighbor);
+            if (State.AllowedCells && !(*State.AllowedCells)[NeighborCell])
+            {
+                State.MinPrunedFCost = FMath::Min(State.MinPrunedFCost, TentativeGCost + GridDistance(Neighbor, TargetPos));
+                continue;
+            }
 			
-            if (!NeighborNode)
+            if (!State.IsVisited(NeighborCell))
             {
-                NeighborNode = new FAStarNode(Neighbor, TentativeGCost, FVector::Dist(Neighbor, TargetPos), CurrentNode);
-                NeighborNode->Istair=true;
-                NeighborNode->StairDirection=Neighbor-CurrentNode->Position;
+                const uint8 NeighborFlags = FDungeonSearchState::Flag_Stair
+                    | (FDungeonSearchState::EncodeDirection(Neighbor - CurrentPos) << FDungeonSearchState::DirectionShift);
                 
-                OpenSet.Add(NeighborNode);
-                AllNodes.Add(Neighbor, NeighborNode);
+                State.Visit(NeighborCell, TentativeGCost, GridDistance(Neighbor, TargetPos), CurrentCell, NeighborFlags);
+                State.PushOpen(NeighborCell);
             }
-            else if (TentativeGCost < NeighborNode->GCost)
+            else if (TentativeGCost < State.GetGCost(NeighborCell))
             {
-                NeighborNode->CameFrom = CurrentNode;
-                NeighborNode->GCost = TentativeGCost;
+                State.Reparent(NeighborCell, CurrentCell, TentativeGCost);
+                State.DecreaseKey(NeighborCell);
             }
         }
 
@@ -338,396 +728,2643 @@ TArray<FAStarNode*> ADungeonGenerator::FindPath(const FVector& StartPos, const F
         
     }
 
-    // Clean up
-    /*for (const auto& NodePair : AllNodes)
+    TotalNodesExpanded += State.NodesExpanded;
+    INC_DWORD_STAT(STAT_DungeonSearches);
+    INC_DWORD_STAT_BY(STAT_DungeonNodesExpanded, State.NodesExpanded);
+    INC_DWORD_STAT_BY(STAT_DungeonNeighborTests, State.NeighborTests);
+    SET_DWORD_STAT(STAT_DungeonOpenSetPeak, State.PeakOpen);
+    if (Path.Num() == 0)
+    {
+        INC_DWORD_STAT(STAT_DungeonFailedSearches);
+    }
+    UE_LOG(LogTemp, Verbose, TEXT("Path Length %d"), Path.Num());
+    return Path;
+}
+
+void ADungeonGenerator::BenchmarkPathfinding()
+{
+    // On a copy, so this layout and what it spawned stay in sync
+    FDungeonLayout Scratch;
+    ConfigureLayout(Scratch);
+    Scratch.InitializeGrid();
+    Scratch.Rooms.Empty();
+    Scratch.Stairs.Empty();
+    Scratch.PlaceMultipleRooms(NumofRoom);
+    TArray<FRoomConnection> MST = Scratch.KruskalsMST();
+
+    // Both modes search the same untouched grid so the expanded node sets match
+    for (int32 Mode = 0; Mode < 2; Mode++)
     {
-        if (!Path.Contains(NodePair.Value))
+        Scratch.bUseSortedOpenSetBaseline = (Mode == 0);
+        int64 TotalExpanded = 0;
+        const double StartTime = FPlatformTime::Seconds();
+        for (const FRoomConnection& Connection : MST)
         {
-            delete NodePair.Value;  // Delete nodes not in the final path to prevent memory leaks
+            Scratch.FindPath(Scratch.RoomCenter(Scratch.Rooms[Connection.RoomIndexA]), Scratch.RoomCenter(Scratch.Rooms[Connection.RoomIndexB]));
+            TotalExpanded += Scratch.LastSearchNodesExpanded;
         }
-    }*/
-
-    UE_LOG(LogTemp, Warning, TEXT("Path Length %d"), Path.Num());
-    return Path;
+        const double Elapsed = FPlatformTime::Seconds() - StartTime;
+        UE_LOG(LogTemp, Warning, TEXT("FindPath benchmark [%s]: %d searches, %lld nodes expanded in %.3f ms (%.0f nodes/s)"),
+            Scratch.bUseSortedOpenSetBaseline ? TEXT("sorted array") : TEXT("binary heap"), MST.Num(), TotalExpanded,
+            Elapsed * 1000.0, Elapsed > 0.0 ? TotalExpanded / Elapsed : 0.0);
+    }
 }
 
-int32 ADungeonGenerator::GetCorridorType(const FVector& Direction)
+EDungeonCell FDungeonLayout::GetCorridorType(const FIntVector& Direction)
 {
-    return 2;
+    return EDungeonCell::Corridor;
    
 }
-FVector ADungeonGenerator::GetStaircaseDirectionFromIndex(const FVector& Location)
+FIntVector FDungeonLayout::GetStaircaseDirectionFromIndex(const FIntVector& Location) const
 {
-    // Example function to retrieve direction vector based on cell index, needs actual implementation based on data structure
-    for (const FStair& Stair : Stairs)  // Assuming AllStairs is TArray<FStair>
+    const int32 StairIndex = GetStairIndex(Location);
+    if (StairIndex != INDEX_NONE)
     {
-        if (Stair.StairCells.Contains(Location))  // Convert index back to FVector or adjust logic based on actual usage
-        {
-            return Stair.Direction;  // Scale direction for visualization purposes
-        }
+        return Stairs[StairIndex].Direction;
     }
-    return FVector(0,0,0);  // Default to no direction if not found
+    return FIntVector(0,0,0);  // Default to no direction if not found
 }
 
-int32 ADungeonGenerator::GetStairIndex(const FVector& Location)
+int32 FDungeonLayout::GetStairIndex(const FIntVector& Location) const
 {
-    // Example function to retrieve direction vector based on cell index, needs actual implementation based on data structure
-    for(int i=0;i<Stairs.Num();i++)  
+    if (!IsInGrid(Location) || !IsGridInitialized())
     {
-        if (Stairs[i].StairCells.Contains(Location))  // Convert index back to FVector or adjust logic based on actual usage
-        {
-            return i;  // Scale direction for visualization purposes
-        }
+        return INDEX_NONE;
     }
-    return 0;  // Default to no direction if not found
+    return StairIds.Get(GetIndex(Location));
 }
 
-void ADungeonGenerator::PlaceStaircase(const FVector& StartPosition, const FVector& Direction)
+bool ADungeonGenerator::GetStairAtWorldLocation(const FVector& WorldLocation, int32& OutStairIndex, FIntVector& OutDirection) const
 {
-    TArray<FVector> StaircaseCells;
-   
-  
+    OutStairIndex = Layout.GetStairIndex(GetGridLocation(WorldLocation));
+    OutDirection = OutStairIndex != INDEX_NONE ? Layout.Stairs[OutStairIndex].Direction : FIntVector::ZeroValue;
+    return OutStairIndex != INDEX_NONE;
+}
 
-    StaircaseCells.Add(StartPosition + FVector(Direction.X / 2, Direction.Y / 2, 0));
-     StaircaseCells.Add(StartPosition + FVector(Direction.X , Direction.Y , 0));
-    StaircaseCells.Add(StartPosition + FVector(Direction.X / 2, Direction.Y / 2, Direction.Z ));
-    StaircaseCells.Add(StartPosition + Direction);
+void FDungeonLayout::PlaceStaircase(const FIntVector& StartPosition, const FIntVector& Direction)
+{
+    TArray<FIntVector, TInlineAllocator<4>> StaircaseCells;
+    GetStaircaseCells(StartPosition, Direction, StaircaseCells);
 
     FStair newstair;
+    const int32 StairIndex = Stairs.Num();
 
     newstair.Direction = Direction;
     for (int i = 0; i < StaircaseCells.Num(); i++)
     {
         
         
-        int32 X = StaircaseCells[i].X;
-        int32 Y = StaircaseCells[i].Y;
-        int32 Z = StaircaseCells[i].Z;
-        int32 Index = GetIndex(X, Y, Z);
+        const FIntVector& Cell = StaircaseCells[i];
+        int32 Index = GetIndex(Cell);
+        if (GetCell(Index) != EDungeonCell::Stair)
+        {
+            ClusterGraph.MarkCellChanged(Cell.X, Cell.Y, Cell.Z);
+        }
        
-        Grid[Index] = 6;  // 6, 7, 8, 9 represent parts of the staircase
+        SetCell(Index, EDungeonCell::Stair);
+        if (StairIds.Get(Index) == INDEX_NONE)
+        {
+            StairIds.Set(Index, StairIndex);  // Cells shared with an older staircase keep pointing at it
+        }
         
-        newstair.AddStairCell(X, Y, Z);
+        newstair.StairCells.Add(Cell);
 
         
     }
 
     Stairs.Add(newstair);
+    StairUses.Add(0);
   
 
     
 }
 
-void ADungeonGenerator::PlaceCorridor(const FVector& Position, int32 Type)
+void FDungeonLayout::PlaceCorridor(const FIntVector& Position, EDungeonCell Type)
+{
+    int32 Index = GetIndex(Position);
+    const EDungeonCell Current = GetCell(Index);
+    if (Current != EDungeonCell::Stair&&Current!=EDungeonCell::Room&&Current!=Type)
+    {
+        SetCell(Index, Type);
+        ClusterGraph.MarkCellChanged(Position.X, Position.Y, Position.Z);
+    }
+}
+
+
+
+
+namespace
 {
-    int32 X = Position.X ;
-    int32 Y = Position.Y ;
-    int32 Z = Position.Z ;
-    int32 Index = GetIndex(X, Y, Z);
-    if (Grid[Index] != 6&&Grid[Index]!=1)
-        Grid[Index] = Type;
+    // Offsets from an expanded cell to every cell FindPath reads while expanding it:
+    // the flat neighbors checked by IsWalkable and the staircase cells checked by IsStaircaseWalkable
+    const FIntVector SearchReadOffsets[] = {
+        FIntVector(1, 0, 0), FIntVector(-1, 0, 0), FIntVector(0, 1, 0), FIntVector(0, -1, 0),
+        FIntVector(2, 0, 0), FIntVector(-2, 0, 0), FIntVector(0, 2, 0), FIntVector(0, -2, 0),
+        FIntVector(1, 0, 1), FIntVector(-1, 0, 1), FIntVector(0, 1, 1), FIntVector(0, -1, 1),
+        FIntVector(1, 0, -1), FIntVector(-1, 0, -1), FIntVector(0, 1, -1), FIntVector(0, -1, -1),
+        FIntVector(2, 0, 1), FIntVector(-2, 0, 1), FIntVector(0, 2, 1), FIntVector(0, -2, 1),
+        FIntVector(2, 0, -1), FIntVector(-2, 0, -1), FIntVector(0, 2, -1), FIntVector(0, -2, -1)
+    };
 }
 
+void FDungeonLayout::RouteConnectionsInParallel(const TArray<FRoomConnection>& MST, TArray<FDungeonRoute>& OutRoutes) const
+{
+    OutRoutes.Reset();
+    OutRoutes.SetNum(MST.Num());
 
+    // One search state per batch, batches take every NumBatches-th edge so long and short searches spread out
+    const int32 NumBatches = FMath::Clamp(FTaskGraphInterface::Get().GetNumWorkerThreads() + 1, 1, FMath::Max(MST.Num(), 1));
+    TArray<FDungeonSearchState> States;
+    States.SetNum(NumBatches);
 
+    ParallelFor(NumBatches, [&](int32 Batch)
+    {
+        for (int32 EdgeIndex = Batch; EdgeIndex < MST.Num(); EdgeIndex += NumBatches)
+        {
+            const FRoomConnection& Connection = MST[EdgeIndex];
+            FDungeonRoute& Route = OutRoutes[EdgeIndex];
+            Route.Path = FindPath(RoomCenter(Rooms[Connection.RoomIndexA]), RoomCenter(Rooms[Connection.RoomIndexB]), States[Batch], &Route.ExpandedCells);
+        }
+    });
+}
 
-void ADungeonGenerator::ConnectRoomsUsingAStar(const TArray<FRoomConnection>& MST)
+TArray<FIntVector> FDungeonLayout::FindPathHierarchical(const FIntVector& StartPos, const FIntVector& TargetPos)
 {
-    for (const FRoomConnection& Connection : MST)
+    DUNGEON_SCOPE(STAT_DungeonFindPathHierarchical);
+    if (!ClusterGraph.IsBuilt())
     {
-        const FRoom& RoomA = Rooms[Connection.RoomIndexA];
-        const FRoom& RoomB = Rooms[Connection.RoomIndexB];
+        ClusterGraph.Build(*this, HierarchicalClusterSize);
+    }
 
+    TArray<int32> CorridorClusters;
+    if (ClusterGraph.FindClusterCorridor(*this, StartPos, TargetPos, HierarchicalCorridorMargin, CorridorClusters))
+    {
+        TBitArray<> Mask;
+        ClusterGraph.BuildCellMask(*this, CorridorClusters, Mask);
 
-        
-          FVector StartPos = RoomCenter(RoomA);
-        FVector TargetPos = RoomCenter(RoomB);
+        SearchState.AllowedCells = &Mask;
+        TArray<FIntVector> Path = FindPath(StartPos, TargetPos);
+        SearchState.AllowedCells = nullptr;
 
-   
-        TArray<FAStarNode*> Path = FindPath(StartPos, TargetPos);
-         UE_LOG(LogTemp, Warning, TEXT("Path Generated between %d and %d"), Connection.RoomIndexA, Connection.RoomIndexB);
-         
-          
-        FAStarNode* LastNode = nullptr;
         if (Path.Num() > 0)
         {
-             
-            for (FAStarNode* Node : Path)
+            float Cost = 0.0f;
+            for (int32 i = 1; i < Path.Num(); i++)
             {
-                if (LastNode != nullptr)
-                {
-                    FVector Direction = Node->Position - LastNode->Position;
-                    int32 CorridorType = GetCorridorType(Direction);
+                Cost += GridDistance(Path[i - 1], Path[i]);
+            }
 
-                    UE_LOG(LogTemp, Warning, TEXT("path location %s"), *Node->Position.ToString());
-                    
-                    if(Node->Position.Z-LastNode->Position.Z>=1||Node->Position.Z-LastNode->Position.Z<=-1)
-                    {
-                       
-                       PlaceStaircase(LastNode->Position, Direction);
-                        PlaceCorridor(LastNode->Position, CorridorType);
-                    }
-                    else 
-                     PlaceCorridor(LastNode->Position, CorridorType);
-                    
-                }
-                LastNode = Node;
+            // Every path leaving the corridor costs at least MinPrunedFCost. That only bounds what FindPath finds, not the
+            // shortest corridor: a cell keeps the stair state it was first reached with, so FindPath isn't optimal itself
+            const float LowerBound = FMath::Min(Cost, SearchState.MinPrunedFCost);
+            if (Cost <= LowerBound * (1.0f + HierarchicalCostTolerance))
+            {
+                return Path;
             }
+            UE_LOG(LogTemp, Log, TEXT("Hierarchical corridor cost %.1f exceeds tolerance over bound %.1f, searching the full grid"), Cost, LowerBound);
         }
-        else
-        {
-            UE_LOG(LogTemp, Warning, TEXT("No path found between rooms %d and %d"), Connection.RoomIndexA, Connection.RoomIndexB);
-        }
-        UE_LOG(LogTemp, Warning, TEXT("Done"));
     }
+
+    return FindPath(StartPos, TargetPos);
 }
 
-void ADungeonGenerator::PlaceDoors()
+void FDungeonLayout::PlacePath(const TArray<FIntVector>& Path, TArray<int32>* OutChangedCells)
 {
-    for (int32 i = 0; i < Rooms.Num(); i++)
+    DUNGEON_SCOPE(STAT_DungeonPlacePath);
+    // Cells this path writes and what they held before, to report real changes only
+    TArray<TPair<int32, EDungeonCell>> Written;
+
+    for (int32 i = 1; i < Path.Num(); i++)
     {
-        const FRoom& room = Rooms[i];
-        // Check potential door positions around the room perimeter
-        for (int32 x = room.StartX; x < room.StartX + room.Width; x++) {
-            // Top edge of the room
-            if (room.StartY > 0 && Grid[(room.StartY - 1) * Width + x] == 2) {
-                Grid[(room.StartY - 1) * Width + x] = 3;  // 3 for door
+        const FIntVector& LastPosition = Path[i - 1];
+        const FIntVector& Position = Path[i];
+        FIntVector Direction = Position - LastPosition;
+        EDungeonCell CorridorType = GetCorridorType(Direction);
+
+        UE_LOG(LogTemp, VeryVerbose, TEXT("path location %s"), *Position.ToString());
+
+        if (OutChangedCells)
+        {
+            const int32 Index = GetIndex(LastPosition);
+            Written.Emplace(Index, GetCell(Index));
+        }
+        
+        if(Position.Z-LastPosition.Z>=1||Position.Z-LastPosition.Z<=-1)
+        {
+            if (OutChangedCells)
+            {
+                TArray<FIntVector, TInlineAllocator<4>> StaircaseCells;
+                GetStaircaseCells(LastPosition, Direction, StaircaseCells);
+                for (const FIntVector& Cell : StaircaseCells)
+                {
+                    const int32 Index = GetIndex(Cell);
+                    Written.Emplace(Index, GetCell(Index));
+                }
             }
-            // Bottom edge of the room
-            if (room.StartY + room.Height < Height && Grid[(room.StartY + room.Height) * Width + x] == 2) {
-                Grid[(room.StartY + room.Height) * Width + x] = 3;  // 3 for door
+           
+            // Corridors read off one flood can run over the same staircase
+            if (FindStaircase(LastPosition, Direction) == INDEX_NONE)
+            {
+                PlaceStaircase(LastPosition, Direction);
             }
+            PlaceCorridor(LastPosition, CorridorType);
         }
-        for (int32 y = room.StartY; y < room.StartY + room.Height; y++) {
-            // Left edge of the room
-            if (room.StartX > 0 && Grid[y * Width + (room.StartX - 1)] == 2) {
-                Grid[y * Width + (room.StartX - 1)] = 3;  // 3 for door
-            }
+        else 
+         PlaceCorridor(LastPosition, CorridorType);
+    }
+
+    if (OutChangedCells)
+    {
+        for (const TPair<int32, EDungeonCell>& Cell : Written)
+        {
+            if (GetCell(Cell.Key) != Cell.Value)
+            {
+                OutChangedCells->Add(Cell.Key);
+            }
+        }
+    }
+}
+
+void FDungeonLayout::ConnectRoomsUsingAStar(const TArray<FRoomConnection>& MST)
+{
+    DUNGEON_SCOPE(STAT_DungeonConnectRooms);
+    if (bFloodCorridorRouting && !bHierarchicalPathfinding)
+    {
+        ConnectRoomsUsingFloods(MST);
+        return;
+    }
+
+    // Search everything up front, then place in MST order below
+    TArray<FDungeonRoute> Routes;
+    const bool bSpeculative = bParallelCorridorRouting && !bHierarchicalPathfinding && MST.Num() > 1;
+    if (bHierarchicalPathfinding)
+    {
+        ClusterGraph.Build(*this, HierarchicalClusterSize);
+    }
+    if (bSpeculative)
+    {
+        RouteConnectionsInParallel(MST, Routes);
+    }
+
+    // Expanded cells whose surroundings changed since the parallel searches ran. A route that expanded
+    // one of these may have read a stale value and is searched again on the current grid
+    TBitArray<> StaleCells(false, bSpeculative ? GetNumCellIndices() : 0);
+    TArray<int32> ChangedCells;
+    int32 NumRerouted = 0;
+    NumFailedConnections = 0;
+
+    for (int32 EdgeIndex = 0; EdgeIndex < MST.Num(); EdgeIndex++)
+    {
+        const FRoomConnection& Connection = MST[EdgeIndex];
+        const FRoom& RoomA = Rooms[Connection.RoomIndexA];
+        const FRoom& RoomB = Rooms[Connection.RoomIndexB];
+        FDungeonCorridor& Corridor = Corridors.AddDefaulted_GetRef();
+        Corridor.RoomIndexA = Connection.RoomIndexA;
+        Corridor.RoomIndexB = Connection.RoomIndexB;
+
+
+        
+          FIntVector StartPos = RoomCenter(RoomA);
+        FIntVector TargetPos = RoomCenter(RoomB);
+
+        TArray<FIntVector> Path;
+        bool bNeedsSearch = true;
+        if (bSpeculative)
+        {
+            bNeedsSearch = false;
+            for (int32 Cell : Routes[EdgeIndex].ExpandedCells)
+            {
+                if (StaleCells[Cell])
+                {
+                    bNeedsSearch = true;
+                    NumRerouted++;
+                    break;
+                }
+            }
+        }
+
+        if (bNeedsSearch)
+        {
+            Path = bHierarchicalPathfinding ? FindPathHierarchical(StartPos, TargetPos) : FindPath(StartPos, TargetPos);
+        }
+        else
+        {
+            Path = MoveTemp(Routes[EdgeIndex].Path);
+        }
+         UE_LOG(LogTemp, Verbose, TEXT("Path Generated between %d and %d"), Connection.RoomIndexA, Connection.RoomIndexB);
+         
+          
+        if (Path.Num() > 0)
+        {
+            ChangedCells.Reset();
+            PlacePath(Path, bSpeculative ? &ChangedCells : nullptr);
+            AddPathStairs(Path, Corridor.StairIndices);
+            AddCorridorUses(Path, 1);
+            Corridor.Path = MoveTemp(Path);
+
+            for (int32 Changed : ChangedCells)
+            {
+                const FIntVector Cell = GetPositionFromIndex(Changed);
+                for (const FIntVector& Offset : SearchReadOffsets)
+                {
+                    // Any cell that would have read Changed while being expanded
+                    const FIntVector Reader = Cell - Offset;
+                    if (Reader.X >= 0 && Reader.X < Width && Reader.Y >= 0 && Reader.Y < Height && Reader.Z >= 0 && Reader.Z < Length)
+                    {
+                        StaleCells[GetIndex(Reader)] = true;
+                    }
+                }
+            }
+        }
+        else
+        {
+            UE_LOG(LogTemp, Warning, TEXT("No path found between rooms %d and %d"), Connection.RoomIndexA, Connection.RoomIndexB);
+            NumFailedConnections++;
+        }
+        UE_LOG(LogTemp, Verbose, TEXT("Done"));
+    }
+
+    if (bSpeculative)
+    {
+        UE_LOG(LogTemp, Log, TEXT("Parallel corridor routing: %d of %d edges re-routed after earlier corridors changed the grid"), NumRerouted, MST.Num());
+    }
+
+    // Searches are over, don't keep the per-cell search arrays alive until the next regeneration
+    SearchState.Empty();
+}
+
+void FDungeonLayout::ConnectRoomsUsingFloods(const TArray<FRoomConnection>& MST)
+{
+    // Every edge gets its record up front, so Corridors stays in MST order whatever order they are placed in
+    const int32 FirstCorridor = Corridors.Num();
+    TArray<TArray<int32>> RoomEdges;
+    RoomEdges.SetNum(Rooms.Num());
+    TArray<int32> NumEdgesLeft;
+    NumEdgesLeft.Init(0, Rooms.Num());
+    for (int32 EdgeIndex = 0; EdgeIndex < MST.Num(); EdgeIndex++)
+    {
+        const FRoomConnection& Connection = MST[EdgeIndex];
+        FDungeonCorridor& Corridor = Corridors.AddDefaulted_GetRef();
+        Corridor.RoomIndexA = Connection.RoomIndexA;
+        Corridor.RoomIndexB = Connection.RoomIndexB;
+        RoomEdges[Connection.RoomIndexA].Add(EdgeIndex);
+        RoomEdges[Connection.RoomIndexB].Add(EdgeIndex);
+        NumEdgesLeft[Connection.RoomIndexA]++;
+        NumEdgesLeft[Connection.RoomIndexB]++;
+    }
+
+    TBitArray<> Routed(false, MST.Num());
+    NumFailedConnections = 0;
+    auto PlaceEdge = [&](int32 EdgeIndex, TArray<FIntVector>& Path)
+    {
+        FDungeonCorridor& Corridor = Corridors[FirstCorridor + EdgeIndex];
+        Routed[EdgeIndex] = true;
+        NumEdgesLeft[Corridor.RoomIndexA]--;
+        NumEdgesLeft[Corridor.RoomIndexB]--;
+        if (Path.Num() == 0)
+        {
+            UE_LOG(LogTemp, Warning, TEXT("No path found between rooms %d and %d"), Corridor.RoomIndexA, Corridor.RoomIndexB);
+            NumFailedConnections++;
+            return;
+        }
+        PlacePath(Path);
+        AddPathStairs(Path, Corridor.StairIndices);
+        AddCorridorUses(Path, 1);
+        Corridor.Path = MoveTemp(Path);
+    };
+
+    int32 NumFloods = 0;
+    int32 NumFloodEdges = 0;
+    int32 NumResearched = 0;
+    TArray<int32> HubEdges;
+    TArray<int32> TargetRoomIds;
+    TArray<TArray<FIntVector>> Paths;
+    while (true)
+    {
+        // The room with the most edges left saves the most searches
+        int32 Hub = INDEX_NONE;
+        for (int32 RoomIndex = 0; RoomIndex < Rooms.Num(); RoomIndex++)
+        {
+            if (NumEdgesLeft[RoomIndex] >= 2 && (Hub == INDEX_NONE || NumEdgesLeft[RoomIndex] > NumEdgesLeft[Hub]))
+            {
+                Hub = RoomIndex;
+            }
+        }
+        if (Hub == INDEX_NONE)
+        {
+            break;
+        }
+
+        HubEdges.Reset();
+        TargetRoomIds.Reset();
+        for (int32 EdgeIndex : RoomEdges[Hub])
+        {
+            if (!Routed[EdgeIndex])
+            {
+                HubEdges.Add(EdgeIndex);
+                TargetRoomIds.Add(MST[EdgeIndex].RoomIndexA == Hub ? MST[EdgeIndex].RoomIndexB : MST[EdgeIndex].RoomIndexA);
+            }
+        }
+        FindPathsToRooms(RoomCenter(Rooms[Hub]), TargetRoomIds, Paths);
+        NumFloods++;
+        NumFloodEdges += HubEdges.Num();
+
+        for (int32 i = 0; i < HubEdges.Num(); i++)
+        {
+            // The flood saw the grid before the corridors placed from it, one of them may block this one now
+            TArray<FIntVector>& Path = Paths[i];
+            if (Path.Num() > 0 && !IsPathPlaceable(Path, Hub, TargetRoomIds[i]))
+            {
+                Path = FindPath(RoomCenter(Rooms[Hub]), RoomCenter(Rooms[TargetRoomIds[i]]));
+                NumResearched++;
+            }
+            PlaceEdge(HubEdges[i], Path);
+        }
+    }
+
+    // No room has two edges left, these are searched one by one
+    for (int32 EdgeIndex = 0; EdgeIndex < MST.Num(); EdgeIndex++)
+    {
+        if (!Routed[EdgeIndex])
+        {
+            TArray<FIntVector> Path = FindPath(RoomCenter(Rooms[MST[EdgeIndex].RoomIndexA]), RoomCenter(Rooms[MST[EdgeIndex].RoomIndexB]));
+            PlaceEdge(EdgeIndex, Path);
+        }
+    }
+
+    UE_LOG(LogTemp, Log, TEXT("Flood corridor routing: %d floods routed %d of %d edges, %d searched again after an earlier corridor blocked them"),
+        NumFloods, NumFloodEdges, MST.Num(), NumResearched);
+
+    // Searches are over, don't keep the per-cell search arrays alive until the next regeneration
+    SearchState.Empty();
+}
+
+void FDungeonLayout::FindPathsToRooms(const FIntVector& StartPos, const TArray<int32>& TargetRoomIds, TArray<TArray<FIntVector>>& OutPaths)
+{
+    DUNGEON_SCOPE(STAT_DungeonFindPathsToRooms);
+    FDungeonSearchState& State = SearchState;
+    State.bSortedArrayBaseline = false;
+    State.Begin(GetNumCellIndices());
+    OutPaths.Reset();
+    OutPaths.SetNum(TargetRoomIds.Num());
+
+    const int32 StartCell = GetIndex(StartPos);
+    const int32 StartRoomId = RoomIds.Get(StartCell);
+    int32 NumTargetsLeft = TargetRoomIds.Num();
+
+    // No heuristic, so cells come out of the open set in order of distance and any settled cell's parent chain is
+    // a valid path from the start, whichever target the flood is still heading for. Like FindPath it isn't
+    // guaranteed shortest through stairs, a cell keeps the stair state it was first reached with
+    State.Visit(StartCell, 0, 0, INDEX_NONE, 0);
+    State.PushOpen(StartCell);
+    while (State.NumOpen() > 0 && NumTargetsLeft > 0)
+    {
+        const int32 CurrentCell = State.PopOpen();
+        State.NodesExpanded++;
+
+        const int32 RoomId = RoomIds.Get(CurrentCell);
+        const int32 Target = RoomId != INDEX_NONE && RoomId != StartRoomId ? TargetRoomIds.IndexOfByKey(RoomId) : INDEX_NONE;
+        if (Target != INDEX_NONE)
+        {
+            // First cell of a target room, the corridor ends here
+            if (OutPaths[Target].Num() == 0)
+            {
+                for (int32 Cell = CurrentCell; Cell != INDEX_NONE; Cell = State.GetParent(Cell))
+                {
+                    OutPaths[Target].Add(GetPositionFromIndex(Cell));
+                }
+                Algo::Reverse(OutPaths[Target]);
+                NumTargetsLeft--;
+            }
+            continue;
+        }
+
+        const bool bCurrentIsStair = State.IsStair(CurrentCell);
+        const FIntVector CurrentPos = GetPositionFromIndex(CurrentCell);
+        const FIntVector StairDirection = State.GetStairDirection(CurrentCell);
+        const int32 ParentCell = State.GetParent(CurrentCell);
+        const FIntVector ParentPos = ParentCell != INDEX_NONE ? GetPositionFromIndex(ParentCell) : CurrentPos;
+        const float CurrentGCost = State.GetGCost(CurrentCell);
+
+        // Same moves as FindPath, with the cells of every target room open on top of the start room's
+        TArray<FIntVector, TInlineAllocator<8>> Neighbors = GetNeighbors(CurrentPos, StartRoomId, INDEX_NONE, bCurrentIsStair, StairDirection);
+        for (const FIntVector& Dir : FlatDirections)
+        {
+            // A staircase is only left straight ahead
+            const FIntVector NewPos = CurrentPos + Dir;
+            if (IsInGrid(NewPos) && (!bCurrentIsStair || Dir * 2 == FIntVector(StairDirection.X, StairDirection.Y, 0))
+                && TargetRoomIds.Contains(RoomIds.Get(GetIndex(NewPos))))
+            {
+                Neighbors.Add(NewPos);
+            }
+        }
+        const TArray<FIntVector, TInlineAllocator<8>> StairNeighbors = GetStairNeighbors(CurrentPos, StartRoomId, bCurrentIsStair, StairDirection, State.IsStairCorridor(CurrentCell), ParentPos);
+        State.NeighborTests += Neighbors.Num() + StairNeighbors.Num();
+
+        auto Relax = [&](const FIntVector& Neighbor, uint8 NeighborFlags)
+        {
+            const float TentativeGCost = CurrentGCost + GridDistance(CurrentPos, Neighbor);
+            const int32 NeighborCell = GetIndex(Neighbor);
+            if (!State.IsVisited(NeighborCell))
+            {
+                State.Visit(NeighborCell, TentativeGCost, 0, CurrentCell, NeighborFlags);
+                State.PushOpen(NeighborCell);
+            }
+            else if (TentativeGCost < State.GetGCost(NeighborCell))
+            {
+                State.Reparent(NeighborCell, CurrentCell, TentativeGCost);
+                State.DecreaseKey(NeighborCell);
+            }
+        };
+        for (const FIntVector& Neighbor : Neighbors)
+        {
+            Relax(Neighbor, bCurrentIsStair ? uint8(FDungeonSearchState::Flag_StairCorridor
+                | (FDungeonSearchState::EncodeDirection(Neighbor - CurrentPos) << FDungeonSearchState::DirectionShift)) : uint8(0));
+        }
+        for (const FIntVector& Neighbor : StairNeighbors)
+        {
+            Relax(Neighbor, uint8(FDungeonSearchState::Flag_Stair
+                | (FDungeonSearchState::EncodeDirection(Neighbor - CurrentPos) << FDungeonSearchState::DirectionShift)));
+        }
+    }
+
+    LastSearchNodesExpanded = State.NodesExpanded;
+    TotalNodesExpanded += State.NodesExpanded;
+    INC_DWORD_STAT(STAT_DungeonSearches);
+    INC_DWORD_STAT_BY(STAT_DungeonNodesExpanded, State.NodesExpanded);
+    INC_DWORD_STAT_BY(STAT_DungeonNeighborTests, State.NeighborTests);
+    SET_DWORD_STAT(STAT_DungeonOpenSetPeak, State.PeakOpen);
+    INC_DWORD_STAT_BY(STAT_DungeonFailedSearches, NumTargetsLeft);
+}
+
+bool FDungeonLayout::IsPathPlaceable(const TArray<FIntVector>& Path, int32 StartRoomId, int32 TargetRoomId) const
+{
+    for (int32 i = 1; i < Path.Num(); i++)
+    {
+        const FIntVector Step = Path[i] - Path[i - 1];
+        const bool bOpen = Step.Z != 0
+            ? IsStaircaseWalkable(Path[i - 1], Step) || FindStaircase(Path[i - 1], Step) != INDEX_NONE
+            : IsWalkable(Path[i], StartRoomId, TargetRoomId);
+        if (!bOpen)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int32 FDungeonLayout::FindStaircase(const FIntVector& StartPosition, const FIntVector& Direction) const
+{
+    TArray<FIntVector, TInlineAllocator<4>> StaircaseCells;
+    GetStaircaseCells(StartPosition, Direction, StaircaseCells);
+    if (!IsInGrid(StaircaseCells[0]))
+    {
+        return INDEX_NONE;
+    }
+    const int32 StairIndex = StairIds.Get(GetIndex(StaircaseCells[0]));
+    return StairIndex != INDEX_NONE && Stairs[StairIndex].Direction == Direction && Stairs[StairIndex].StairCells[0] == StaircaseCells[0]
+        ? StairIndex : INDEX_NONE;
+}
+
+void FDungeonLayout::AddPathStairs(const TArray<FIntVector>& Path, TArray<int32>& OutStairIndices)
+{
+    for (int32 i = 1; i < Path.Num(); i++)
+    {
+        if (Path[i].Z != Path[i - 1].Z)
+        {
+            const int32 StairIndex = FindStaircase(Path[i - 1], Path[i] - Path[i - 1]);
+            if (StairIndex != INDEX_NONE && !OutStairIndices.Contains(StairIndex))
+            {
+                OutStairIndices.Add(StairIndex);
+                StairUses[StairIndex]++;
+            }
+        }
+    }
+}
+
+void ADungeonGenerator::ValidateParallelRouting()
+{
+    FDungeonLayout Layouts[2];
+    for (int32 i = 0; i < 2; i++)
+    {
+        // Neither of the other modes uses the parallel search, so both are off to test it
+        ConfigureLayout(Layouts[i]);
+        Layouts[i].bParallelCorridorRouting = i == 1;
+        Layouts[i].bFloodCorridorRouting = false;
+        Layouts[i].bHierarchicalPathfinding = false;
+        Layouts[i].Generate();
+    }
+    const FDungeonLayout& Serial = Layouts[0];
+    const FDungeonLayout& Parallel = Layouts[1];
+
+    FString Difference;
+    for (int32 Index = 0; Index < Serial.GetNumCellIndices() && Difference.IsEmpty(); Index++)
+    {
+        if (Serial.Cells.Get(Index) != Parallel.Cells.Get(Index))
+        {
+            const FIntVector Cell = Serial.GetPositionFromIndex(Index);
+            Difference = FString::Printf(TEXT("cell (%d, %d, %d) is %d serial, %d parallel"),
+                Cell.X, Cell.Y, Cell.Z, Serial.Cells.Get(Index), Parallel.Cells.Get(Index));
+        }
+    }
+    if (Difference.IsEmpty() && Serial.Stairs.Num() != Parallel.Stairs.Num())
+    {
+        Difference = FString::Printf(TEXT("%d stairs serial, %d parallel"), Serial.Stairs.Num(), Parallel.Stairs.Num());
+    }
+    for (int32 i = 0; i < Serial.Stairs.Num() && Difference.IsEmpty(); i++)
+    {
+        if (Serial.Stairs[i].StairCells != Parallel.Stairs[i].StairCells || Serial.Stairs[i].Direction != Parallel.Stairs[i].Direction)
+        {
+            Difference = FString::Printf(TEXT("stair %d"), i);
+        }
+    }
+    if (Difference.IsEmpty() && Serial.Corridors.Num() != Parallel.Corridors.Num())
+    {
+        Difference = FString::Printf(TEXT("%d corridors serial, %d parallel"), Serial.Corridors.Num(), Parallel.Corridors.Num());
+    }
+    for (int32 i = 0; i < Serial.Corridors.Num() && Difference.IsEmpty(); i++)
+    {
+        const FDungeonCorridor& A = Serial.Corridors[i];
+        const FDungeonCorridor& B = Parallel.Corridors[i];
+        if (A.RoomIndexA != B.RoomIndexA || A.RoomIndexB != B.RoomIndexB || A.Path != B.Path || A.StairIndices != B.StairIndices)
+        {
+            Difference = FString::Printf(TEXT("corridor %d between rooms %d and %d"), i, A.RoomIndexA, A.RoomIndexB);
+        }
+    }
+
+    UE_LOG(LogTemp, Warning, TEXT("Parallel routing for seed %d (%d rooms, %d corridors): serial %.2f ms, parallel %.2f ms, %s"),
+        Seed, Serial.Rooms.Num(), Serial.Corridors.Num(), Serial.LayoutGenerationMs, Parallel.LayoutGenerationMs,
+        Difference.IsEmpty() ? TEXT("identical") : *(TEXT("MISMATCH at ") + Difference));
+}
+
+void ADungeonGenerator::BenchmarkFloodRouting()
+{
+    // A transient layout per mode, so this layout and what it spawned stay in sync. Same rooms and MST for every mode, the room
+    // stream only depends on the seed
+    struct FMode { const TCHAR* Name; bool bParallel; bool bFlood; };
+    const FMode Modes[] = { { TEXT("A* per edge"), false, false }, { TEXT("parallel A*"), true, false }, { TEXT("flood per room"), false, true } };
+    for (const FMode& Mode : Modes)
+    {
+        FDungeonLayout Scratch;
+        ConfigureLayout(Scratch);
+        Scratch.bParallelCorridorRouting = Mode.bParallel;
+        Scratch.bFloodCorridorRouting = Mode.bFlood;
+        Scratch.bHierarchicalPathfinding = false;
+        Scratch.InitializeGrid();
+        Scratch.Rooms.Empty();
+        Scratch.Stairs.Empty();
+        Scratch.PlaceMultipleRooms(NumofRoom);
+        const TArray<FRoomConnection> MST = Scratch.KruskalsMST();
+
+        // Edges at the busiest room, what a flood saves on
+        TArray<int32> Degrees;
+        Degrees.Init(0, Scratch.Rooms.Num());
+        for (const FRoomConnection& Connection : MST)
+        {
+            Degrees[Connection.RoomIndexA]++;
+            Degrees[Connection.RoomIndexB]++;
+        }
+
+        Scratch.TotalNodesExpanded = 0;
+        const double StartTime = FPlatformTime::Seconds();
+        Scratch.ConnectRoomsUsingAStar(MST);
+        const double Elapsed = FPlatformTime::Seconds() - StartTime;
+        UE_LOG(LogTemp, Warning, TEXT("Corridor routing benchmark [%s]: %d edges (max %d at one room), %lld nodes expanded in %.3f ms, %d stairs, %d failed"),
+            Mode.Name, MST.Num(), Degrees.Num() > 0 ? FMath::Max(Degrees) : 0, Scratch.TotalNodesExpanded.load(), Elapsed * 1000.0,
+            Scratch.Stairs.Num(), Scratch.NumFailedConnections);
+    }
+}
+
+void FDungeonLayout::AddCorridorUses(const TArray<FIntVector>& Path, int32 Delta)
+{
+    // PlacePath writes every cell but the last, room cells and staircases keep their type
+    for (int32 i = 1; i < Path.Num(); i++)
+    {
+        const int32 Index = GetIndex(Path[i - 1]);
+        if (GetCell(Index) == EDungeonCell::Corridor)
+        {
+            CorridorUses.Set(Index, uint16(CorridorUses.Get(Index) + Delta));
+        }
+    }
+}
+
+void FDungeonLayout::RemoveCorridor(FDungeonCorridor& Corridor, TArray<int32>& OutChangedCells)
+{
+    // Newest staircase first, so the ones still listed keep their indices. Staircases another corridor from the
+    // same flood runs over stay for it
+    while (Corridor.StairIndices.Num() > 0)
+    {
+        const int32 StairIndex = Corridor.StairIndices.Pop();
+        if (--StairUses[StairIndex] == 0)
+        {
+            RemoveStair(StairIndex, OutChangedCells);
+        }
+    }
+
+    AddCorridorUses(Corridor.Path, -1);
+    for (int32 i = 1; i < Corridor.Path.Num(); i++)
+    {
+        const FIntVector& Cell = Corridor.Path[i - 1];
+        const int32 Index = GetIndex(Cell);
+        if (GetCell(Index) == EDungeonCell::Corridor && CorridorUses.Get(Index) == 0)
+        {
+            SetCell(Index, EDungeonCell::Empty);
+            ClusterGraph.MarkCellChanged(Cell.X, Cell.Y, Cell.Z);
+            OutChangedCells.Add(Index);
+        }
+    }
+    Corridor.Path.Reset();
+}
+
+void FDungeonLayout::RemoveStair(int32 StairIndex, TArray<int32>& OutChangedCells)
+{
+    for (const FIntVector& Cell : Stairs[StairIndex].StairCells)
+    {
+        const int32 Index = GetIndex(Cell);
+        if (StairIds.Get(Index) == StairIndex)
+        {
+            StairIds.Set(Index, INDEX_NONE);
+            SetCell(Index, EDungeonCell::Empty);
+            ClusterGraph.MarkCellChanged(Cell.X, Cell.Y, Cell.Z);
+            OutChangedCells.Add(Index);
+        }
+    }
+
+    // The last staircase moves into the hole, only its index changes
+    const int32 LastIndex = Stairs.Num() - 1;
+    if (StairIndex != LastIndex)
+    {
+        for (const FIntVector& Cell : Stairs[LastIndex].StairCells)
+        {
+            const int32 Index = GetIndex(Cell);
+            if (StairIds.Get(Index) == LastIndex)
+            {
+                StairIds.Set(Index, StairIndex);
+            }
+        }
+        for (FDungeonCorridor& Corridor : Corridors)
+        {
+            for (int32& Index : Corridor.StairIndices)
+            {
+                Index = Index == LastIndex ? StairIndex : Index;
+            }
+        }
+    }
+    Stairs.RemoveAtSwap(StairIndex);
+    StairUses.RemoveAtSwap(StairIndex);
+}
+
+bool FDungeonLayout::UpdateRoom(int32 RoomIndex, const FRoom& NewRoom, TArray<int32>& OutDirtyChunks)
+{
+    DUNGEON_SCOPE(STAT_DungeonUpdateRoom);
+    if (!Rooms.IsValidIndex(RoomIndex) || !IsGridInitialized())
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Room %d isn't part of the current layout"), RoomIndex);
+        return false;
+    }
+    const FIntVector NewMin(NewRoom.StartX, NewRoom.StartY, NewRoom.StartZ);
+    const FIntVector NewMax = NewMin + FIntVector(NewRoom.Width, NewRoom.Height, NewRoom.Length);
+    if (NewRoom.Width < 1 || NewRoom.Height < 1 || NewRoom.Length < 1 || !IsInGrid(NewMin) || !IsInGrid(NewMax - FIntVector(1, 1, 1)))
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Room %d at (%d, %d, %d) doesn't fit the grid, not updated"), RoomIndex, NewRoom.StartX, NewRoom.StartY, NewRoom.StartZ);
+        return false;
+    }
+    auto IsInNewRoom = [&NewMin, &NewMax](const FIntVector& Cell)
+    {
+        return Cell.X >= NewMin.X && Cell.X < NewMax.X && Cell.Y >= NewMin.Y && Cell.Y < NewMax.Y && Cell.Z >= NewMin.Z && Cell.Z < NewMax.Z;
+    };
+
+    // The new cells may hold this room and corridors, never another room
+    const double StartTime = FPlatformTime::Seconds();
+    bool bCrossesCorridor = false;
+    TSet<int32> CrossedStairs;
+    for (int32 z = NewMin.Z; z < NewMax.Z; z++)
+    {
+        for (int32 y = NewMin.Y; y < NewMax.Y; y++)
+        {
+            for (int32 x = NewMin.X; x < NewMax.X; x++)
+            {
+                const int32 Index = GetIndex(x, y, z);
+                const int32 Owner = RoomIds.Get(Index);
+                if (Owner != INDEX_NONE && Owner != RoomIndex)
+                {
+                    UE_LOG(LogTemp, Warning, TEXT("Room %d would overlap room %d, not updated"), RoomIndex, Owner);
+                    return false;
+                }
+                const EDungeonCell Type = GetCell(Index);
+                bCrossesCorridor |= Type == EDungeonCell::Corridor;
+                if (Type == EDungeonCell::Stair)
+                {
+                    CrossedStairs.Add(StairIds.Get(Index));
+                }
+            }
+        }
+    }
+
+    // Corridors ending at the room, and the ones the new cells would cut through. Only scan the paths when the
+    // new cells hold a corridor at all
+    TBitArray<> Affected(false, Corridors.Num());
+    int32 NumAffected = 0;
+    for (int32 CorridorIndex = 0; CorridorIndex < Corridors.Num(); CorridorIndex++)
+    {
+        const FDungeonCorridor& Corridor = Corridors[CorridorIndex];
+        bool bAffected = Corridor.RoomIndexA == RoomIndex || Corridor.RoomIndexB == RoomIndex;
+        for (int32 i = 0; !bAffected && CrossedStairs.Num() > 0 && i < Corridor.StairIndices.Num(); i++)
+        {
+            bAffected = CrossedStairs.Contains(Corridor.StairIndices[i]);
+        }
+        for (int32 i = 0; !bAffected && bCrossesCorridor && i < Corridor.Path.Num(); i++)
+        {
+            bAffected = IsInNewRoom(Corridor.Path[i]);
+        }
+        Affected[CorridorIndex] = bAffected;
+        NumAffected += bAffected ? 1 : 0;
+    }
+
+    // Edges can only be patched when they matched the cells before the edit, every write below dirties them
+    const bool bPatchWallEdges = !bWallEdgesDirty && WallEdgeOffsets.Num() == Cells.GetNumChunks() * TDungeonChunkedGrid<uint8>::ChunkSize + 1;
+    TArray<int32> ChangedCells;
+    for (int32 CorridorIndex = 0; CorridorIndex < Corridors.Num(); CorridorIndex++)
+    {
+        if (Affected[CorridorIndex])
+        {
+            RemoveCorridor(Corridors[CorridorIndex], ChangedCells);
+        }
+    }
+
+    // Old cells out, new cells in
+    const FRoom OldRoom = Rooms[RoomIndex];
+    for (int32 z = OldRoom.StartZ; z < OldRoom.StartZ + OldRoom.Length; z++)
+    {
+        for (int32 y = OldRoom.StartY; y < OldRoom.StartY + OldRoom.Height; y++)
+        {
+            for (int32 x = OldRoom.StartX; x < OldRoom.StartX + OldRoom.Width; x++)
+            {
+                const int32 Index = GetIndex(x, y, z);
+                if (!IsInNewRoom(FIntVector(x, y, z)) && RoomIds.Get(Index) == RoomIndex)
+                {
+                    RoomIds.Set(Index, INDEX_NONE);
+                    SetCell(Index, EDungeonCell::Empty);
+                    ClusterGraph.MarkCellChanged(x, y, z);
+                    ChangedCells.Add(Index);
+                }
+            }
+        }
+    }
+    for (int32 z = NewMin.Z; z < NewMax.Z; z++)
+    {
+        for (int32 y = NewMin.Y; y < NewMax.Y; y++)
+        {
+            for (int32 x = NewMin.X; x < NewMax.X; x++)
+            {
+                const int32 Index = GetIndex(x, y, z);
+                if (RoomIds.Get(Index) != RoomIndex)
+                {
+                    RoomIds.Set(Index, RoomIndex);
+                    SetCell(Index, EDungeonCell::Room);
+                    ClusterGraph.MarkCellChanged(x, y, z);
+                    ChangedCells.Add(Index);
+                }
+            }
+        }
+    }
+    Rooms[RoomIndex] = NewRoom;
+
+    // Route the corridors that were taken out again, in the order ConnectRoomsUsingAStar placed them
+    for (int32 CorridorIndex = 0; CorridorIndex < Corridors.Num(); CorridorIndex++)
+    {
+        if (!Affected[CorridorIndex])
+        {
+            continue;
+        }
+        FDungeonCorridor& Corridor = Corridors[CorridorIndex];
+        const FIntVector StartPos = RoomCenter(Rooms[Corridor.RoomIndexA]);
+        const FIntVector TargetPos = RoomCenter(Rooms[Corridor.RoomIndexB]);
+        TArray<FIntVector> Path = bHierarchicalPathfinding ? FindPathHierarchical(StartPos, TargetPos) : FindPath(StartPos, TargetPos);
+        if (Path.Num() == 0)
+        {
+            UE_LOG(LogTemp, Warning, TEXT("No path found between rooms %d and %d"), Corridor.RoomIndexA, Corridor.RoomIndexB);
+            continue;
+        }
+        PlacePath(Path, &ChangedCells);
+        AddPathStairs(Path, Corridor.StairIndices);
+        AddCorridorUses(Path, 1);
+        Corridor.Path = MoveTemp(Path);
+    }
+    SearchState.Empty();
+
+    NumFailedConnections = 0;
+    for (const FDungeonCorridor& Corridor : Corridors)
+    {
+        NumFailedConnections += Corridor.Path.Num() == 0 ? 1 : 0;
+    }
+
+    // Chunks of the changed cells, and the chunk behind every chunk face a changed cell touches, since the
+    // neighbor masks and wall edges of the cells on the other side change with it
+    constexpr int32 ChunkSize = TDungeonChunkedGrid<uint8>::ChunkSize;
+    const int32 ChunksX = Cells.GetNumChunksX();
+    const int32 ChunksY = Cells.GetNumChunksY();
+    const int32 ChunksZ = Cells.GetNumChunks() / (ChunksX * ChunksY);
+    TBitArray<> DirtyChunks(false, Cells.GetNumChunks());
+    for (int32 Index : ChangedCells)
+    {
+        const int32 Chunk = Index >> TDungeonChunkedGrid<uint8>::ChunkCellBits;
+        const int32 Local = Index & (TDungeonChunkedGrid<uint8>::ChunkCells - 1);
+        const FIntVector LocalCell(Local % ChunkSize, (Local / ChunkSize) % ChunkSize, Local / (ChunkSize * ChunkSize));
+        const FIntVector ChunkCell(Chunk % ChunksX, (Chunk / ChunksX) % ChunksY, Chunk / (ChunksX * ChunksY));
+        const int32 ChunkSteps[] = { 1, ChunksX, ChunksX * ChunksY };
+        const int32 NumChunksOnAxis[] = { ChunksX, ChunksY, ChunksZ };
+        DirtyChunks[Chunk] = true;
+        for (int32 Axis = 0; Axis < 3; Axis++)
+        {
+            if (LocalCell[Axis] == 0 && ChunkCell[Axis] > 0)
+            {
+                DirtyChunks[Chunk - ChunkSteps[Axis]] = true;
+            }
+            else if (LocalCell[Axis] == ChunkSize - 1 && ChunkCell[Axis] + 1 < NumChunksOnAxis[Axis])
+            {
+                DirtyChunks[Chunk + ChunkSteps[Axis]] = true;
+            }
+        }
+    }
+    OutDirtyChunks.Reset();
+    for (TConstSetBitIterator<> It(DirtyChunks); It; ++It)
+    {
+        OutDirtyChunks.Add(It.GetIndex());
+    }
+
+    if (bPatchWallEdges)
+    {
+        UpdateWallEdges(OutDirtyChunks);
+    }
+    else
+    {
+        BuildWallEdges();
+    }
+
+    // Not saved to the layout cache, the seed no longer produces this layout
+    UE_LOG(LogTemp, Log, TEXT("Room %d updated in %.2f ms: %d corridors routed again, %d cells and %d of %d chunks changed, %d connections failed"),
+        RoomIndex, (FPlatformTime::Seconds() - StartTime) * 1000.0, NumAffected, ChangedCells.Num(), OutDirtyChunks.Num(), Cells.GetNumChunks(), NumFailedConnections);
+    return true;
+}
+
+bool ADungeonGenerator::UpdateRoom(int32 RoomIndex, const FRoom& NewRoom)
+{
+    if (LayoutTask.IsValid() || GenerationStage == EDungeonGenerationStage::Spawning)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Can't update room %d while the dungeon is generating"), RoomIndex);
+        return false;
+    }
+    TArray<int32> DirtyChunks;
+    if (!Layout.UpdateRoom(RoomIndex, NewRoom, DirtyChunks))
+    {
+        return false;
+    }
+    if (SpawnedTileActors.Num() > 0 || InstancedTileComponents.Num() > 0 || MergedMeshComponents.Num() > 0)
+    {
+        RespawnChunks(DirtyChunks);
+    }
+    return true;
+}
+
+void ADungeonGenerator::BenchmarkRoomUpdate()
+{
+    // On a copy, so this generator's layout, rooms already moved with UpdateRoom included, and its tiles stay as they are
+    ADungeonGenerator* Scratch = SpawnScratchGenerator();
+    if (!Scratch)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Failed to spawn a copy of the generator for the room update benchmark"));
+        return;
+    }
+    const double StartTime = FPlatformTime::Seconds();
+    Scratch->GenerateLayout();
+    Scratch->SpawnDungeonEnvironment();
+    const double FullTime = FPlatformTime::Seconds() - StartTime;
+
+    // Every room one cell over, the first way it fits
+    int32 NumUpdates = 0;
+    double UpdateTime = 0.0;
+    for (int32 RoomIndex = 0; RoomIndex < Scratch->Layout.Rooms.Num(); RoomIndex++)
+    {
+        for (const FIntVector& Direction : FlatDirections)
+        {
+            FRoom Moved = Scratch->Layout.Rooms[RoomIndex];
+            Moved.StartX += Direction.X;
+            Moved.StartY += Direction.Y;
+            const double UpdateStart = FPlatformTime::Seconds();
+            if (Scratch->UpdateRoom(RoomIndex, Moved))
+            {
+                UpdateTime += FPlatformTime::Seconds() - UpdateStart;
+                NumUpdates++;
+                break;
+            }
+        }
+    }
+
+    UE_LOG(LogTemp, Warning, TEXT("Room update benchmark (%d rooms, %d corridors): generate and spawn %.3f ms, %d room updates %.3f ms on average"),
+        Scratch->Layout.Rooms.Num(), Scratch->Layout.Corridors.Num(), FullTime * 1000.0, NumUpdates, NumUpdates > 0 ? UpdateTime * 1000.0 / NumUpdates : 0.0);
+
+    Scratch->ClearSpawnedEnvironment();
+    Scratch->Destroy();
+}
+
+void FDungeonLayout::PlaceDoors()
+{
+    for (int32 i = 0; i < Rooms.Num(); i++)
+    {
+        const FRoom& room = Rooms[i];
+        // Check potential door positions around the room perimeter
+        for (int32 x = room.StartX; x < room.StartX + room.Width; x++) {
+            // Top edge of the room
+            if (room.StartY > 0 && GetCell(GetIndex(x, room.StartY - 1, 0)) == EDungeonCell::Corridor) {
+                SetCell(GetIndex(x, room.StartY - 1, 0), EDungeonCell::Door);
+            }
+            // Bottom edge of the room
+            if (room.StartY + room.Height < Height && GetCell(GetIndex(x, room.StartY + room.Height, 0)) == EDungeonCell::Corridor) {
+                SetCell(GetIndex(x, room.StartY + room.Height, 0), EDungeonCell::Door);
+            }
+        }
+        for (int32 y = room.StartY; y < room.StartY + room.Height; y++) {
+            // Left edge of the room
+            if (room.StartX > 0 && GetCell(GetIndex(room.StartX - 1, y, 0)) == EDungeonCell::Corridor) {
+                SetCell(GetIndex(room.StartX - 1, y, 0), EDungeonCell::Door);
+            }
             // Right edge of the room
-            if (room.StartX + room.Width < Width && Grid[y * Width + (room.StartX + room.Width)] == 2) {
-                Grid[y * Width + (room.StartX + room.Width)] = 3;  // 3 for door
+            if (room.StartX + room.Width < Width && GetCell(GetIndex(room.StartX + room.Width, y, 0)) == EDungeonCell::Corridor) {
+                SetCell(GetIndex(room.StartX + room.Width, y, 0), EDungeonCell::Door);
+            }
+        }
+    }
+}
+
+
+int32 FDungeonLayout::Find(int32 i, TArray<int32>& Parent)
+{
+    while (Parent[i] != i)
+    {
+        Parent[i] = Parent[Parent[i]];  // Path compression
+        i = Parent[i];
+    }
+    return i;
+}
+
+void FDungeonLayout::Union(int32 a, int32 b, TArray<int32>& Parent, TArray<int32>& Rank)
+{
+    int32 rootA = Find(a, Parent);
+    int32 rootB = Find(b, Parent);
+    if (rootA != rootB)
+    {
+        if (Rank[rootA] < Rank[rootB])
+        {
+            Parent[rootA] = rootB;
+        }
+        else if (Rank[rootA] > Rank[rootB])
+        {
+            Parent[rootB] = rootA;
+        }
+        else
+        {
+            Parent[rootB] = rootA;
+            Rank[rootA]++;
+        }
+    }
+}
+
+TArray<FRoomConnection> FDungeonLayout::KruskalsMST()
+{
+    DUNGEON_SCOPE(STAT_DungeonBuildMST);
+    TArray<FRoomConnection> Candidates;
+    GenerateCandidateRoomConnections(Candidates);
+    return BuildMST(Candidates);
+}
+
+TArray<FRoomConnection> FDungeonLayout::BuildMST(const TArray<FRoomConnection>& AllConnections)
+{
+    TArray<int32> Parent;
+    TArray<int32> Rank;
+    TArray<FRoomConnection> MST;
+
+    for (int32 i = 0; i < Rooms.Num(); i++)
+    {
+        Parent.Add(i);
+        Rank.Add(0);
+    }
+
+    for (const FRoomConnection& Conn : AllConnections)
+    {
+        if (Find(Conn.RoomIndexA, Parent) != Find(Conn.RoomIndexB, Parent))
+        {
+            MST.Add(Conn);
+            Union(Conn.RoomIndexA, Conn.RoomIndexB, Parent, Rank);
+            if (MST.Num() == Rooms.Num() - 1) break;
+        }
+    }
+
+    if (MST.Num() == 0)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("No corridors to connect: MST is empty"));
+    }
+	
+    return MST;
+}
+
+// Sets default values
+ADungeonGenerator::ADungeonGenerator()
+{
+ 	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
+	PrimaryActorTick.bCanEverTick = true;
+	
+    static ConstructorHelpers::FClassFinder<AActor> WallBPClass(TEXT("/Game/PathToBP_Wall.BP_Wall_C"));
+    if (WallBPClass.Class != NULL)
+    {
+        WallClass = WallBPClass.Class;
+    }
+
+}
+FRoomConnection FDungeonLayout::MakeRoomConnection(int32 RoomIndexA, int32 RoomIndexB) const
+{
+    // Only the horizontal offset between centers counts, like the original all-pairs distance
+    const FIntPoint CenterA = GetRoomCenterKey(Rooms[RoomIndexA]);
+    const FIntPoint CenterB = GetRoomCenterKey(Rooms[RoomIndexB]);
+    const int64 DX = CenterB.X - CenterA.X;
+    const int64 DY = CenterB.Y - CenterA.Y;
+
+    FRoomConnection Connection(FMath::Min(RoomIndexA, RoomIndexB), FMath::Max(RoomIndexA, RoomIndexB));
+    Connection.DistanceKey = DX * DX + DY * DY;
+    Connection.Distance = FMath::Sqrt(double(Connection.DistanceKey)) * 0.5;
+    return Connection;
+}
+
+void FDungeonLayout::GenerateAllRoomConnections(TArray<FRoomConnection>& OutConnections)
+{
+    OutConnections.Empty();
+    for (int32 i = 0; i < Rooms.Num(); i++)
+    {
+        for (int32 j = i + 1; j < Rooms.Num(); j++)
+        {
+            OutConnections.Add(MakeRoomConnection(i, j));
+        }
+    }
+
+    // Sort connections by distance
+    OutConnections.Sort();
+}
+
+void FDungeonLayout::GenerateCandidateRoomConnections(TArray<FRoomConnection>& OutConnections)
+{
+    // If p-q is in the MST, no other room r in the same cone around p can come before p-q: the cone is narrower
+    // than 60 degrees so |rq| < |pq|, which would make p-q the last edge of the cycle p, q, r. So keeping only the
+    // first room per cone keeps every MST edge. Rooms sharing a center have no direction and are all paired up
+    OutConnections.Empty();
+    const int32 NumRooms = Rooms.Num();
+    if (NumRooms < 2)
+    {
+        return;
+    }
+
+    TArray<FIntPoint> Centers;
+    Centers.SetNumUninitialized(NumRooms);
+    FIntPoint Min(MAX_int32, MAX_int32);
+    FIntPoint Max(MIN_int32, MIN_int32);
+    for (int32 i = 0; i < NumRooms; i++)
+    {
+        Centers[i] = GetRoomCenterKey(Rooms[i]);
+        Min = FIntPoint(FMath::Min(Min.X, Centers[i].X), FMath::Min(Min.Y, Centers[i].Y));
+        Max = FIntPoint(FMath::Max(Max.X, Centers[i].X), FMath::Max(Max.Y, Centers[i].Y));
+    }
+
+    // Buckets sized for about one room each, rooms sorted by bucket with BucketStart as offsets
+    const int64 Area = int64(Max.X - Min.X + 1) * (Max.Y - Min.Y + 1);
+    const int32 BucketSize = FMath::Max(1, FMath::CeilToInt(FMath::Sqrt(double(Area) / NumRooms)));
+    const int32 BucketsX = (Max.X - Min.X) / BucketSize + 1;
+    const int32 BucketsY = (Max.Y - Min.Y) / BucketSize + 1;
+    auto GetBucket = [&](const FIntPoint& Center)
+    {
+        return FIntPoint((Center.X - Min.X) / BucketSize, (Center.Y - Min.Y) / BucketSize);
+    };
+
+    TArray<int32> BucketStart;
+    BucketStart.SetNumZeroed(BucketsX * BucketsY + 1);
+    for (const FIntPoint& Center : Centers)
+    {
+        const FIntPoint Bucket = GetBucket(Center);
+        BucketStart[Bucket.X + Bucket.Y * BucketsX + 1]++;
+    }
+    for (int32 i = 1; i < BucketStart.Num(); i++)
+    {
+        BucketStart[i] += BucketStart[i - 1];
+    }
+    TArray<int32> BucketRooms;
+    BucketRooms.SetNumUninitialized(NumRooms);
+    {
+        TArray<int32> Fill(BucketStart);
+        for (int32 i = 0; i < NumRooms; i++)
+        {
+            const FIntPoint Bucket = GetBucket(Centers[i]);
+            BucketRooms[Fill[Bucket.X + Bucket.Y * BucketsX]++] = i;
+        }
+    }
+
+    for (int32 Room = 0; Room < NumRooms; Room++)
+    {
+        const FIntPoint Center = Centers[Room];
+        const FIntPoint Bucket = GetBucket(Center);
+
+        FRoomConnection Best[8];
+        bool bHasBest[8] = {};
+
+        auto VisitBucket = [&](int32 BX, int32 BY)
+        {
+            if (BX < 0 || BY < 0 || BX >= BucketsX || BY >= BucketsY)
+            {
+                return;
+            }
+            const int32 BucketIndex = BX + BY * BucketsX;
+            for (int32 i = BucketStart[BucketIndex]; i < BucketStart[BucketIndex + 1]; i++)
+            {
+                const int32 Other = BucketRooms[i];
+                const int64 DX = Centers[Other].X - Center.X;
+                const int64 DY = Centers[Other].Y - Center.Y;
+                if (DX == 0 && DY == 0)
+                {
+                    if (Other > Room)
+                    {
+                        OutConnections.Add(MakeRoomConnection(Room, Other));
+                    }
+                    continue;
+                }
+
+                const int32 Cone = GetConeIndex(DX, DY);
+                const FRoomConnection Connection = MakeRoomConnection(Room, Other);
+                if (!bHasBest[Cone] || Connection < Best[Cone])
+                {
+                    Best[Cone] = Connection;
+                    bHasBest[Cone] = true;
+                }
+            }
+        };
+
+        // Rings of buckets around the room's bucket. Every room outside ring R is more than R * BucketSize away,
+        // so a cone is settled once its best is at most that far
+        const int32 MaxRing = FMath::Max(FMath::Max(Bucket.X, BucketsX - 1 - Bucket.X), FMath::Max(Bucket.Y, BucketsY - 1 - Bucket.Y));
+        for (int32 Ring = 0; Ring <= MaxRing; Ring++)
+        {
+            if (Ring == 0)
+            {
+                VisitBucket(Bucket.X, Bucket.Y);
+            }
+            else
+            {
+                for (int32 Offset = -Ring; Offset <= Ring; Offset++)
+                {
+                    VisitBucket(Bucket.X + Offset, Bucket.Y - Ring);
+                    VisitBucket(Bucket.X + Offset, Bucket.Y + Ring);
+                }
+                for (int32 Offset = -Ring + 1; Offset <= Ring - 1; Offset++)
+                {
+                    VisitBucket(Bucket.X - Ring, Bucket.Y + Offset);
+                    VisitBucket(Bucket.X + Ring, Bucket.Y + Offset);
+                }
+            }
+
+            const int64 Reach = int64(Ring) * BucketSize;
+            bool bSettled = true;
+            for (int32 Cone = 0; Cone < 8 && bSettled; Cone++)
+            {
+                bSettled = bHasBest[Cone] && Best[Cone].DistanceKey <= Reach * Reach;
+            }
+            if (bSettled)
+            {
+                break;
+            }
+        }
+
+        for (int32 Cone = 0; Cone < 8; Cone++)
+        {
+            if (bHasBest[Cone])
+            {
+                OutConnections.Add(Best[Cone]);
+            }
+        }
+    }
+
+    // Both ends usually pick the same edge, drop the copies
+    OutConnections.Sort();
+    int32 NumUnique = 0;
+    for (int32 i = 0; i < OutConnections.Num(); i++)
+    {
+        if (NumUnique == 0 || OutConnections[NumUnique - 1] < OutConnections[i])
+        {
+            OutConnections[NumUnique++] = OutConnections[i];
+        }
+    }
+    OutConnections.SetNum(NumUnique);
+}
+
+void ADungeonGenerator::ValidateCandidateConnections()
+{
+    double StartTime = FPlatformTime::Seconds();
+    TArray<FRoomConnection> AllConnections;
+    Layout.GenerateAllRoomConnections(AllConnections);
+    const TArray<FRoomConnection> AllPairsMST = Layout.BuildMST(AllConnections);
+    const double AllPairsTime = FPlatformTime::Seconds() - StartTime;
+
+    StartTime = FPlatformTime::Seconds();
+    TArray<FRoomConnection> Candidates;
+    Layout.GenerateCandidateRoomConnections(Candidates);
+    const TArray<FRoomConnection> CandidateMST = Layout.BuildMST(Candidates);
+    const double CandidateTime = FPlatformTime::Seconds() - StartTime;
+
+    bool bMatch = AllPairsMST.Num() == CandidateMST.Num();
+    for (int32 i = 0; i < AllPairsMST.Num() && bMatch; i++)
+    {
+        bMatch = AllPairsMST[i].RoomIndexA == CandidateMST[i].RoomIndexA && AllPairsMST[i].RoomIndexB == CandidateMST[i].RoomIndexB;
+    }
+
+    UE_LOG(LogTemp, Warning, TEXT("MST for %d rooms: all pairs %d edges in %.3f ms, candidates %d edges in %.3f ms, %s"),
+        Layout.Rooms.Num(), AllConnections.Num(), AllPairsTime * 1000.0, Candidates.Num(), CandidateTime * 1000.0,
+        bMatch ? TEXT("identical") : TEXT("MISMATCH"));
+}
+
+// Called when the game starts or when spawned
+void ADungeonGenerator::BeginPlay()
+{
+	Super::BeginPlay();
+    if (bScratchCopy)
+    {
+        return;  // Driven by the debug tool that spawned it
+    }
+    if (bGenerateAsync)
+    {
+        GenerateDungeonAsync();
+    }
+    else
+    {
+	    GenerateDungeon();
+    }
+}
+
+void ADungeonGenerator::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+    // The layout task writes to this actor, it has to finish before the actor goes away
+    if (LayoutTask.IsValid())
+    {
+        LayoutTask.Wait();
+        LayoutTask = TFuture<void>();
+        GenerationStage = EDungeonGenerationStage::Idle;
+    }
+    Super::EndPlay(EndPlayReason);
+}
+
+// Called every frame
+void ADungeonGenerator::Tick(float DeltaTime)
+{
+	Super::Tick(DeltaTime);
+    if (IsGenerating())
+    {
+        TickGeneration();
+    }
+	 static int FrameCounter = 0;
+    FrameCounter++;
+    if (FrameCounter >= 400)
+    {
+        //DrawDebugGrid();
+		
+        FrameCounter = 0;  // reset counter after updating
+    }
+	
+}
+
+void ADungeonGenerator::PlacePlayerStart()
+{
+    if (Layout.Rooms.Num() > 0)  // Check if there are any rooms defined
+    {
+        FRoom& FirstRoom = Layout.Rooms[0];  // Reference to the first room
+        FVector RoomCenter = FirstRoom.GetCenter();  // Get the center point of the first room
+        FVector WorldCenter = GetWorldLocation(RoomCenter);  // Convert grid coordinates to world coordinates
+
+        // Assuming PlayerStart is an AActor class that you can place in the world
+        APlayerStart* PlayerStartActor = GetWorld()->SpawnActor<APlayerStart>(APlayerStart::StaticClass(), WorldCenter, FRotator(0.f, 0.f, 0.f));
+       APlayerController* PC = UGameplayStatics::GetPlayerController(this, 0);
+       
+        if (!PlayerStartActor)
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Failed to place PlayerStart at Room 0 center"));
+        }
+        
+         if (PC)
+            {
+                PC->GetPawn()->SetActorLocation(WorldCenter);
+            }
+    }
+}
+
+FVector ADungeonGenerator::GetWorldLocation(const FVector& GridLocation) const
+{
+    // Assuming each grid cell is 100 units wide
+    return GetActorLocation() + GridLocation * CellSize;
+}
+
+FVector ADungeonGenerator::GetWorldLocation(const FIntVector& GridLocation) const
+{
+    return GetWorldLocation(FVector(GridLocation));
+}
+
+FIntVector ADungeonGenerator::GetGridLocation(const FVector& WorldLocation) const
+{
+    const FVector GridLocation = (WorldLocation - GetActorLocation()) / CellSize;
+    return FIntVector(FMath::FloorToInt(GridLocation.X), FMath::FloorToInt(GridLocation.Y), FMath::FloorToInt(GridLocation.Z));
+}
+
+void ADungeonGenerator::GenerateDungeon()
+{
+
+    UE_LOG(LogTemp, Warning, TEXT("Generating Dungeon..."));
+    PickSeed();
+    GenerateLayout();
+
+    GenerationStage = EDungeonGenerationStage::Spawning;
+    SpawnDungeonEnvironment();  // Spawn the physical dungeon based on the grid
+    //SpawnRoomWalls();
+    FinishGeneration();
+}
+
+void ADungeonGenerator::ConfigureLayout(FDungeonLayout& OutLayout) const
+{
+    OutLayout.Width = Width;
+    OutLayout.Height = Height;
+    OutLayout.Length = Length;
+    OutLayout.minRoomsize = minRoomsize;
+    OutLayout.maxRoomsize = maxRoomsize;
+    OutLayout.NumofRoom = NumofRoom;
+    OutLayout.Seed = Seed;
+    OutLayout.RequiredRooms = RequiredRooms;
+    OutLayout.bParallelCorridorRouting = bParallelCorridorRouting;
+    OutLayout.bFloodCorridorRouting = bFloodCorridorRouting;
+    OutLayout.bHierarchicalPathfinding = bHierarchicalPathfinding;
+    OutLayout.HierarchicalClusterSize = HierarchicalClusterSize;
+    OutLayout.HierarchicalCorridorMargin = HierarchicalCorridorMargin;
+    OutLayout.HierarchicalCostTolerance = HierarchicalCostTolerance;
+}
+
+void ADungeonGenerator::PickSeed()
+{
+    if (bRandomizeSeed)
+    {
+        Seed = FMath::Rand();
+    }
+}
+
+void ADungeonGenerator::GenerateLayout()
+{
+    UE_LOG(LogTemp, Log, TEXT("Generating dungeon layout with seed %d"), Seed);
+    ConfigureLayout(Layout);
+
+    const double StartTime = FPlatformTime::Seconds();
+    const bool bCacheLayout = bUseLayoutCache && !bRandomizeSeed;
+    const FString CachePath = bCacheLayout ? Layout.GetLayoutCachePath() : FString();
+    if (bCacheLayout && Layout.LoadLayout(CachePath))
+    {
+        // A hit counts as a use for TrimLayoutCache
+        IFileManager::Get().SetTimeStamp(*CachePath, FDateTime::UtcNow());
+        const double LoadMs = (FPlatformTime::Seconds() - StartTime) * 1000.0;
+        UE_LOG(LogTemp, Log, TEXT("Dungeon layout loaded from cache in %.2f ms, generating it took %.2f ms"), LoadMs, Layout.LayoutGenerationMs);
+        Layout.BuildWallEdges();
+        return;
+    }
+
+    Layout.Generate(&GenerationStage);
+    if (bCacheLayout)
+    {
+        if (Layout.SaveLayout(CachePath))
+        {
+            TrimLayoutCache(CachePath);
+        }
+        else
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Failed to write the dungeon layout cache %s"), *CachePath);
+        }
+    }
+}
+
+void FDungeonLayout::Generate(std::atomic<EDungeonGenerationStage>* Stage)
+{
+    DUNGEON_SCOPE(STAT_DungeonGenerateLayout);
+    auto SetStage = [Stage](EDungeonGenerationStage NewStage)
+    {
+        if (Stage)
+        {
+            *Stage = NewStage;
+        }
+    };
+
+    const double StartTime = FPlatformTime::Seconds();
+    SetStage(EDungeonGenerationStage::InitializingGrid);
+    InitializeGrid();  // Set up the grid with default values
+    Rooms.Empty();
+    Stairs.Empty();
+
+    SetStage(EDungeonGenerationStage::PlacingRooms);
+    for (const FRoom& Room : RequiredRooms)
+    {
+        if (CanPlaceRoom(Room))
+        {
+            PlaceRoom(Room);
+        }
+        else
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Required room at (%d, %d, %d) doesn't fit the grid, skipped"), Room.StartX, Room.StartY, Room.StartZ);
+        }
+    }
+    PlaceMultipleRooms(NumofRoom);  // Place 10 rooms randomly
+
+    SetStage(EDungeonGenerationStage::BuildingConnections);
+    TArray<FRoomConnection> MST = KruskalsMST();  // Generate the MST to find optimal room connections
+
+    SetStage(EDungeonGenerationStage::RoutingCorridors);
+    ConnectRoomsUsingAStar(MST);  // Connect rooms using corridors defined by A*
+
+    UE_LOG(LogTemp, Log, TEXT("Dungeon grid: %d of %d chunks allocated, %.1f KB of cells"),
+        Cells.GetNumAllocatedChunks(), Cells.GetNumChunks(), Cells.GetAllocatedSize() / 1024.0);
+
+    BuildWallEdges();
+    LayoutGenerationMs = (FPlatformTime::Seconds() - StartTime) * 1000.0;
+    UE_LOG(LogTemp, Log, TEXT("Dungeon layout generated in %.2f ms"), LayoutGenerationMs);
+}
+
+namespace
+{
+    constexpr uint32 LayoutCacheMagic = 0x59414C44;  // "DLAY"
+
+    // Bump whenever the format changes, or generation starts producing a different layout for the same seed
+    constexpr uint32 LayoutCacheVersion = 2;
+
+    void SerializeRoom(FArchive& Ar, FRoom& Room)
+    {
+        Ar << Room.StartX << Room.StartY << Room.StartZ << Room.Width << Room.Height << Room.Length;
+        Ar << Room.EntryPoint << Room.ExitPoint;
+    }
+
+    void SerializeStair(FArchive& Ar, FStair& Stair)
+    {
+        Ar << Stair.StairCells << Stair.Direction << Stair.EndPoints;
+    }
+
+    void SerializeCorridor(FArchive& Ar, FDungeonCorridor& Corridor)
+    {
+        Ar << Corridor.RoomIndexA << Corridor.RoomIndexB << Corridor.Path << Corridor.StairIndices;
+    }
+}
+
+uint64 FDungeonLayout::GetLayoutCacheKey() const
+{
+    TArray<uint8> Bytes;
+    FMemoryWriter Writer(Bytes);
+
+    uint32 Version = LayoutCacheVersion;
+    int32 Values[] = { Seed, Width, Height, Length, minRoomsize, maxRoomsize, NumofRoom, HierarchicalClusterSize, HierarchicalCorridorMargin };
+    bool bHierarchical = bHierarchicalPathfinding;
+    bool bFlood = bFloodCorridorRouting;
+    float Tolerance = HierarchicalCostTolerance;
+    Writer << Version;
+    for (int32& Value : Values)
+    {
+        Writer << Value;
+    }
+    Writer << bHierarchical << Tolerance << bFlood;
+    for (FRoom Room : RequiredRooms)
+    {
+        SerializeRoom(Writer, Room);
+    }
+    return CityHash64(reinterpret_cast<const char*>(Bytes.GetData()), Bytes.Num());
+}
+
+FString FDungeonLayout::GetLayoutCachePath() const
+{
+    return FPaths::ProjectSavedDir() / TEXT("DungeonCache") / FString::Printf(TEXT("%016llx.dlay"), GetLayoutCacheKey());
+}
+
+bool FDungeonLayout::SaveLayout(const FString& Path) const
+{
+    DUNGEON_SCOPE(STAT_DungeonSaveLayout);
+    TArray<uint8> Data;
+    FMemoryWriter Writer(Data);
+
+    uint32 Magic = LayoutCacheMagic;
+    uint32 Version = LayoutCacheVersion;
+    uint64 Key = GetLayoutCacheKey();
+    FIntVector Size(Width, Height, Length);
+    float GenerationMs = LayoutGenerationMs;
+    Writer << Magic << Version << Key << Size << GenerationMs;
+
+    // Cells as (value, run length) pairs in index order. Unallocated chunks read as empty and merge into the runs around them
+    const int32 NumCells = GetNumCellIndices();
+    for (int32 Start = 0; Start < NumCells;)
+    {
+        uint8 Value = Cells.Get(Start);
+        int32 End = Start + 1;
+        while (End < NumCells && Cells.Get(End) == Value)
+        {
+            End++;
+        }
+        uint32 Run = End - Start;
+        Writer << Value;
+        Writer.SerializeIntPacked(Run);
+        Start = End;
+    }
+
+    int32 NumRooms = Rooms.Num();
+    Writer << NumRooms;
+    for (FRoom Room : Rooms)
+    {
+        SerializeRoom(Writer, Room);
+    }
+    int32 NumStairs = Stairs.Num();
+    Writer << NumStairs;
+    for (FStair Stair : Stairs)
+    {
+        SerializeStair(Writer, Stair);
+    }
+    int32 NumCorridors = Corridors.Num();
+    Writer << NumCorridors;
+    for (FDungeonCorridor Corridor : Corridors)
+    {
+        SerializeCorridor(Writer, Corridor);
+    }
+
+    if (!FFileHelper::SaveArrayToFile(Data, *Path))
+    {
+        return false;
+    }
+    UE_LOG(LogTemp, Log, TEXT("Dungeon layout saved to %s, %d bytes"), *Path, Data.Num());
+    return true;
+}
+
+void ADungeonGenerator::TrimLayoutCache(const FString& Path) const
+{
+    struct FCacheFile
+    {
+        FString Path;
+        FDateTime LastUsed;
+        int64 Size;
+    };
+    TArray<FCacheFile> Files;
+    int64 TotalSize = 0;
+    const FString Directory = FPaths::GetPath(Path);
+    IFileManager::Get().IterateDirectoryStat(*Directory, [&](const TCHAR* FilePath, const FFileStatData& Stat)
+    {
+        if (!Stat.bIsDirectory && FPaths::GetExtension(FilePath) == TEXT("dlay"))
+        {
+            Files.Add({ FilePath, Stat.ModificationTime, Stat.FileSize });
+            TotalSize += Stat.FileSize;
+        }
+        return true;
+    });
+
+    // Oldest first. Another generator may be trimming at the same time, a file it deleted first just fails to delete here
+    Files.Sort([](const FCacheFile& A, const FCacheFile& B) { return A.LastUsed < B.LastUsed; });
+    const int64 MaxSize = int64(LayoutCacheMaxMB) * 1024 * 1024;
+    int32 NumDeleted = 0;
+    for (int32 i = 0; i < Files.Num() && TotalSize > MaxSize; i++)
+    {
+        if (FPaths::IsSamePath(Files[i].Path, Path))
+        {
+            continue;
+        }
+        if (IFileManager::Get().Delete(*Files[i].Path, false, false, true))
+        {
+            TotalSize -= Files[i].Size;
+            NumDeleted++;
+        }
+    }
+    if (NumDeleted > 0)
+    {
+        UE_LOG(LogTemp, Log, TEXT("Dungeon layout cache over %d MB, deleted the %d least recently used layouts"), LayoutCacheMaxMB, NumDeleted);
+    }
+}
+
+bool FDungeonLayout::LoadLayout(const FString& Path)
+{
+    DUNGEON_SCOPE(STAT_DungeonLoadLayout);
+    TArray<uint8> Data;
+    if (!FFileHelper::LoadFileToArray(Data, *Path, FILEREAD_Silent))
+    {
+        return false;
+    }
+    FMemoryReader Reader(Data);
+
+    uint32 Magic = 0;
+    uint32 Version = 0;
+    uint64 Key = 0;
+    FIntVector Size;
+    float GenerationMs = 0.0f;
+    Reader << Magic << Version << Key << Size << GenerationMs;
+    if (Reader.IsError() || Magic != LayoutCacheMagic || Version != LayoutCacheVersion)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Dungeon layout cache %s is from another format version, ignored"), *Path);
+        return false;
+    }
+    if (Key != GetLayoutCacheKey() || Size != FIntVector(Width, Height, Length))
+    {
+        return false;
+    }
+
+    // Read everything before touching the layout, so a damaged file leaves the current one as it was
+    const int32 NumCells = TDungeonChunkedGrid<uint8>::GetNumIndicesFor(Width, Height, Length);
+    TArray<TPair<uint8, uint32>> Runs;
+    for (int32 Start = 0; Start < NumCells && !Reader.IsError();)
+    {
+        uint8 Value = 0;
+        uint32 Run = 0;
+        Reader << Value;
+        Reader.SerializeIntPacked(Run);
+        if (Run == 0 || Run > uint32(NumCells - Start))
+        {
+            Reader.SetError();
+            break;
+        }
+        Runs.Emplace(Value, Run);
+        Start += Run;
+    }
+
+    int32 NumRooms = 0;
+    Reader << NumRooms;
+    TArray<FRoom> LoadedRooms;
+    if (NumRooms >= 0 && NumRooms <= Data.Num())
+    {
+        LoadedRooms.SetNum(NumRooms);
+        for (FRoom& Room : LoadedRooms)
+        {
+            SerializeRoom(Reader, Room);
+        }
+    }
+    else
+    {
+        Reader.SetError();
+    }
+
+    int32 NumStairs = 0;
+    Reader << NumStairs;
+    TArray<FStair> LoadedStairs;
+    if (NumStairs >= 0 && NumStairs <= Data.Num())
+    {
+        LoadedStairs.SetNum(NumStairs);
+        for (FStair& Stair : LoadedStairs)
+        {
+            SerializeStair(Reader, Stair);
+        }
+    }
+    else
+    {
+        Reader.SetError();
+    }
+
+    int32 NumCorridors = 0;
+    Reader << NumCorridors;
+    TArray<FDungeonCorridor> LoadedCorridors;
+    if (NumCorridors >= 0 && NumCorridors <= Data.Num())
+    {
+        LoadedCorridors.SetNum(NumCorridors);
+        for (FDungeonCorridor& Corridor : LoadedCorridors)
+        {
+            SerializeCorridor(Reader, Corridor);
+            bool bValid = LoadedRooms.IsValidIndex(Corridor.RoomIndexA) && LoadedRooms.IsValidIndex(Corridor.RoomIndexB);
+            for (int32 StairIndex : Corridor.StairIndices)
+            {
+                bValid &= LoadedStairs.IsValidIndex(StairIndex);
+            }
+            for (const FIntVector& Cell : Corridor.Path)
+            {
+                bValid &= IsInGrid(Cell);
+            }
+            if (!bValid)
+            {
+                Reader.SetError();
+                break;
+            }
+        }
+    }
+    else
+    {
+        Reader.SetError();
+    }
+
+    if (Reader.IsError())
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Dungeon layout cache %s is damaged, ignored"), *Path);
+        return false;
+    }
+
+    InitializeGrid();
+    Rooms = MoveTemp(LoadedRooms);
+    Stairs = MoveTemp(LoadedStairs);
+    Corridors = MoveTemp(LoadedCorridors);
+    LayoutGenerationMs = GenerationMs;
+
+    int32 Index = 0;
+    for (const TPair<uint8, uint32>& Run : Runs)
+    {
+        if (Run.Key != static_cast<uint8>(EDungeonCell::Empty))
+        {
+            const bool bOccupied = (Run.Key & DungeonCellTypeMask) != static_cast<uint8>(EDungeonCell::Empty);
+            for (int32 i = Index; i < Index + int32(Run.Value); i++)
+            {
+                const FIntVector Position = GetPositionFromIndex(i);
+                if (IsInGrid(Position))
+                {
+                    Cells.Set(i, Run.Key);
+                    if (bOccupied)
+                    {
+                        Occupancy.Add(Position, 1);
+                    }
+                }
+            }
+        }
+        Index += Run.Value;
+    }
+
+    // Same writes as PlaceRoom and PlaceStaircase
+    for (int32 RoomId = 0; RoomId < Rooms.Num(); RoomId++)
+    {
+        const FRoom& Room = Rooms[RoomId];
+        for (int32 z = Room.StartZ; z < Room.StartZ + Room.Length; z++)
+        {
+            for (int32 y = Room.StartY; y < Room.StartY + Room.Height; y++)
+            {
+                for (int32 x = Room.StartX; x < Room.StartX + Room.Width; x++)
+                {
+                    if (IsInGrid(FIntVector(x, y, z)))
+                    {
+                        RoomIds.Set(GetIndex(x, y, z), RoomId);
+                    }
+                }
+            }
+        }
+    }
+    for (int32 StairIndex = 0; StairIndex < Stairs.Num(); StairIndex++)
+    {
+        for (const FIntVector& Cell : Stairs[StairIndex].StairCells)
+        {
+            if (IsInGrid(Cell) && StairIds.Get(GetIndex(Cell)) == INDEX_NONE)
+            {
+                StairIds.Set(GetIndex(Cell), StairIndex);
+            }
+        }
+    }
+    NumFailedConnections = 0;
+    StairUses.Init(0, Stairs.Num());
+    for (const FDungeonCorridor& Corridor : Corridors)
+    {
+        AddCorridorUses(Corridor.Path, 1);
+        NumFailedConnections += Corridor.Path.Num() == 0 ? 1 : 0;
+        for (int32 StairIndex : Corridor.StairIndices)
+        {
+            StairUses[StairIndex]++;
+        }
+    }
+    return true;
+}
+
+FDungeonBatchSummary ADungeonGenerator::GenerateLayoutBatch(int32 NumLayouts, TArray<FDungeonBatchLayoutStats>& OutStats,
+    TFunction<void(int32, const FDungeonLayout&)> OnLayout, bool bSingleThreaded)
+{
+    check(IsInGameThread());
+    OutStats.Reset();
+    OutStats.SetNum(FMath::Max(NumLayouts, 0));
+    FDungeonBatchSummary Summary;
+    Summary.NumLayouts = OutStats.Num();
+    if (OutStats.Num() == 0)
+    {
+        return Summary;
+    }
+
+    // One layout per batch, batches take every NumBatches-th job and reuse its grid allocations
+    const int32 NumBatches = bSingleThreaded ? 1 : FMath::Clamp(FTaskGraphInterface::Get().GetNumWorkerThreads() + 1, 1, NumLayouts);
+    TArray<TUniquePtr<FDungeonLayout>> Workers;
+    for (int32 Batch = 0; Batch < NumBatches; Batch++)
+    {
+        TUniquePtr<FDungeonLayout> Worker = MakeUnique<FDungeonLayout>();
+        ConfigureLayout(*Worker);
+        // The jobs already fill every core, nested parallel routing would only add contention
+        Worker->bParallelCorridorRouting = false;
+        Workers.Add(MoveTemp(Worker));
+    }
+
+    const double StartTime = FPlatformTime::Seconds();
+    ParallelFor(NumBatches, [&](int32 Batch)
+    {
+        FDungeonLayout* Worker = Workers[Batch].Get();
+        for (int32 Job = Batch; Job < NumLayouts; Job += NumBatches)
+        {
+            FDungeonBatchLayoutStats& Stats = OutStats[Job];
+            Stats.Seed = int32(FDungeonLayout::MixSeed(uint32(Seed), Job));
+            Worker->Seed = Stats.Seed;
+            Worker->TotalNodesExpanded = 0;
+
+            const double JobStartTime = FPlatformTime::Seconds();
+            Worker->Generate();
+            Stats.GenerationMs = (FPlatformTime::Seconds() - JobStartTime) * 1000.0;
+
+            Stats.NumRooms = Worker->Rooms.Num();
+            Stats.NumStairs = Worker->Stairs.Num();
+            Stats.NumFailedConnections = Worker->NumFailedConnections;
+            Stats.NodesExpanded = Worker->TotalNodesExpanded;
+            Stats.bSucceeded = Stats.NumFailedConnections == 0 && Stats.NumRooms >= NumofRoom + RequiredRooms.Num();
+            if (OnLayout)
+            {
+                OnLayout(Job, *Worker);
             }
         }
+    }, bSingleThreaded ? EParallelForFlags::ForceSingleThread : EParallelForFlags::Unbalanced);
+    Summary.WallSeconds = FPlatformTime::Seconds() - StartTime;
+
+    for (const FDungeonBatchLayoutStats& Stats : OutStats)
+    {
+        Summary.NumFailed += Stats.bSucceeded ? 0 : 1;
+        Summary.MeanGenerationMs += Stats.GenerationMs;
+        Summary.MaxGenerationMs = FMath::Max(Summary.MaxGenerationMs, Stats.GenerationMs);
+        Summary.NodesExpanded += Stats.NodesExpanded;
+    }
+    Summary.MeanGenerationMs /= Summary.NumLayouts;
+    Summary.LayoutsPerSecond = Summary.WallSeconds > 0.0 ? Summary.NumLayouts / Summary.WallSeconds : 0.0;
+    return Summary;
+}
+
+void ADungeonGenerator::BenchmarkLayoutBatch()
+{
+    const int32 NumLayouts = 256;
+    TArray<FDungeonBatchLayoutStats> Stats;
+
+    double SingleThreadedRate = 0.0;
+    for (bool bSingleThreaded : { true, false })
+    {
+        const FDungeonBatchSummary Summary = GenerateLayoutBatch(NumLayouts, Stats, nullptr, bSingleThreaded);
+        UE_LOG(LogTemp, Warning, TEXT("Layout batch benchmark [%s]: %d layouts in %.2f s, %.1f layouts/s, %.2f ms mean, %.2f ms max, %d failed, %lld nodes expanded%s"),
+            bSingleThreaded ? TEXT("1 thread") : TEXT("all threads"), Summary.NumLayouts, Summary.WallSeconds, Summary.LayoutsPerSecond,
+            Summary.MeanGenerationMs, Summary.MaxGenerationMs, Summary.NumFailed, Summary.NodesExpanded,
+            bSingleThreaded || SingleThreadedRate <= 0.0 ? TEXT("") : *FString::Printf(TEXT(", %.2fx over 1 thread with %d workers"),
+                Summary.LayoutsPerSecond / SingleThreadedRate, FTaskGraphInterface::Get().GetNumWorkerThreads() + 1));
+        if (bSingleThreaded)
+        {
+            SingleThreadedRate = Summary.LayoutsPerSecond;
+        }
+    }
+}
+
+void ADungeonGenerator::GenerateDungeonAsync()
+{
+    if (IsGenerating())
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Dungeon generation already in progress"));
+        return;
+    }
+
+    UE_LOG(LogTemp, Warning, TEXT("Generating Dungeon asynchronously..."));
+    GenerationStage = EDungeonGenerationStage::InitializingGrid;
+    // FMath::Rand shares one unsynchronized state, so the seed is picked here rather than on the task
+    PickSeed();
+
+    // Tick picks the result up and spawns it. EndPlay waits for the task, so this stays valid while it runs
+    LayoutTask = Async(EAsyncExecution::ThreadPool, [this]()
+    {
+        GenerateLayout();
+    });
+}
+
+void ADungeonGenerator::TickGeneration()
+{
+    if (LayoutTask.IsValid())
+    {
+        if (!LayoutTask.IsReady())
+        {
+            OnGenerationProgress.Broadcast(GetGenerationStage(), GetGenerationProgress());
+            return;
+        }
+        LayoutTask = TFuture<void>();
+        BeginSpawnEnvironment();
+        GenerationStage = EDungeonGenerationStage::Spawning;
+    }
+
+    if (GenerationStage == EDungeonGenerationStage::Spawning)
+    {
+        if (SpawnEnvironmentStep(SpawnBudgetMs / 1000.0))
+        {
+            FinishGeneration();
+        }
+        else
+        {
+            OnGenerationProgress.Broadcast(GetGenerationStage(), GetGenerationProgress());
+        }
+    }
+}
+
+void ADungeonGenerator::FinishGeneration()
+{
+    if (bDrawDebugGrid)
+    {
+        DrawDebugGrid();
+    }
+    if (bPlacePlayerStart)
+    {
+        PlacePlayerStart();
+    }
+
+    GenerationStage = EDungeonGenerationStage::Complete;
+    OnGenerationProgress.Broadcast(EDungeonGenerationStage::Complete, 1.0f);
+    OnDungeonGenerated.Broadcast();
+}
+
+bool ADungeonGenerator::IsGenerating() const
+{
+    const EDungeonGenerationStage Stage = GenerationStage;
+    return Stage != EDungeonGenerationStage::Idle && Stage != EDungeonGenerationStage::Complete;
+}
+
+float ADungeonGenerator::GetGenerationProgress() const
+{
+    // Rough share of the total time each stage takes, corridor routing and spawning dominate
+    switch (GenerationStage.load())
+    {
+    case EDungeonGenerationStage::PlacingRooms:
+        return 0.05f;
+    case EDungeonGenerationStage::BuildingConnections:
+        return 0.15f;
+    case EDungeonGenerationStage::RoutingCorridors:
+        return 0.2f;
+    case EDungeonGenerationStage::Spawning:
+    {
+        const int32 NumSteps = Layout.GetNumCellIndices() + Layout.WallEdges.Num() + Layout.Stairs.Num();
+        return 0.6f + 0.4f * (NumSteps > 0 ? float(SpawnCursor) / NumSteps : 1.0f);
+    }
+    case EDungeonGenerationStage::Complete:
+        return 1.0f;
+    default:
+        return 0.0f;
     }
 }
 
+void ADungeonGenerator::SpawnFloorTile(const FVector& Location)
+{
+    FActorSpawnParameters SpawnParams;
+    SpawnParams.Owner = this;
+    SpawnParams.Instigator = GetInstigator();
+    FVector AdjustedLocation = Location - FVector(CellSize/2, CellSize/2, CellSize/2);
+    if (RenderMode == EDungeonRenderMode::InstancedMeshes)
+    {
+        AddTileInstance(FloorInstanceMesh, FTransform(FRotator::ZeroRotator, AdjustedLocation), GetGridLocation(Location + FVector(CellSize/2)).Z);
+        return;
+    }
+    AActor* FloorActor = GetWorld()->SpawnActor<AActor>(FloorTileClass, AdjustedLocation, FRotator::ZeroRotator, SpawnParams);
+    if (!FloorActor)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Failed to spawn floor tile at Location: %s"), *Location.ToString());
+        return;
+    }
+    AddSpawnedTileActor(FloorActor);
+    INC_DWORD_STAT(STAT_DungeonActorsSpawned);
+}
 
-int32 ADungeonGenerator::Find(int32 i, TArray<int32>& Parent)
+void ADungeonGenerator::AddTileInstance(UStaticMesh* Mesh, const FTransform& Transform, int32 Level)
 {
-    while (Parent[i] != i)
+    if (!Mesh)
     {
-        Parent[i] = Parent[Parent[i]];  // Path compression
-        i = Parent[i];
+        return;  // Reported once per pass by WarnMissingInstanceMeshes
     }
-    return i;
+    PendingTileInstances.FindOrAdd(FDungeonInstanceKey{ Mesh, Level, SpawningChunk }).Add(Transform);
 }
 
-void ADungeonGenerator::Union(int32 a, int32 b, TArray<int32>& Parent, TArray<int32>& Rank)
+void ADungeonGenerator::WarnMissingInstanceMeshes() const
 {
-    int32 rootA = Find(a, Parent);
-    int32 rootB = Find(b, Parent);
-    if (rootA != rootB)
+    if (RenderMode != EDungeonRenderMode::InstancedMeshes)
     {
-        if (Rank[rootA] < Rank[rootB])
-        {
-            Parent[rootA] = rootB;
-        }
-        else if (Rank[rootA] > Rank[rootB])
-        {
-            Parent[rootB] = rootA;
-        }
-        else
+        return;
+    }
+    const TPair<const TCHAR*, UStaticMesh*> Slots[] = {
+        { TEXT("FloorInstanceMesh"), FloorInstanceMesh }, { TEXT("WallInstanceMesh"), WallInstanceMesh },
+        { TEXT("StairInstanceMesh"), StairInstanceMesh }, { TEXT("StairInstanceMesh2"), StairInstanceMesh2 } };
+    for (const TPair<const TCHAR*, UStaticMesh*>& Slot : Slots)
+    {
+        if (!Slot.Value)
         {
-            Parent[rootB] = rootA;
-            Rank[rootA]++;
+            UE_LOG(LogTemp, Warning, TEXT("%s isn't set, its tiles are skipped"), Slot.Key);
         }
     }
 }
 
-TArray<FRoomConnection> ADungeonGenerator::KruskalsMST()
+void ADungeonGenerator::FlushTileInstances()
 {
-    TArray<FRoomConnection> AllConnections;
-    GenerateAllRoomConnections(AllConnections);
+    USceneComponent* Root = GetRootComponent();
+    for (TPair<FDungeonInstanceKey, TArray<FTransform>>& Batch : PendingTileInstances)
+    {
+        // Always a new component, a pass clears the components of every chunk it spawns before it starts
+        const FName Name = MakeUniqueObjectName(this, UHierarchicalInstancedStaticMeshComponent::StaticClass(),
+            *FString::Printf(TEXT("%s_Level%d_Chunk%d"), *Batch.Key.Mesh->GetName(), Batch.Key.Level, Batch.Key.Chunk));
+        UHierarchicalInstancedStaticMeshComponent* Component = NewObject<UHierarchicalInstancedStaticMeshComponent>(this, Name);
+        Component->SetStaticMesh(Batch.Key.Mesh);
+        Component->SetMobility(Root ? Root->Mobility : EComponentMobility::Static);
+        Component->SetupAttachment(Root);
+        Component->RegisterComponent();
+        AddInstanceComponent(Component);
+
+        // Transforms are in world space, so the components work whether or not the generator has a root
+        Component->AddInstances(Batch.Value, false, true);
+        InstancedTileComponents.Add(Component);
+        InstancedTileKeys.Add(Batch.Key);
+        INC_DWORD_STAT_BY(STAT_DungeonInstancesSpawned, Batch.Value.Num());
+    }
+    PendingTileInstances.Reset();
+}
 
-    TArray<int32> Parent;
-    TArray<int32> Rank;
-    TArray<FRoomConnection> MST;
+void ADungeonGenerator::AddSpawnedTileActor(AActor* Actor)
+{
+    SpawnedTileActors.Add(Actor);
+    SpawnedTileActorChunks.Add(SpawningChunk);
+}
 
-    for (int32 i = 0; i < Rooms.Num(); i++)
+void ADungeonGenerator::ClearSpawnedEnvironment()
+{
+    for (AActor* Actor : SpawnedTileActors)
     {
-        Parent.Add(i);
-        Rank.Add(0);
+        if (IsValid(Actor))
+        {
+            Actor->Destroy();
+        }
     }
+    SpawnedTileActors.Reset();
+    SpawnedTileActorChunks.Reset();
 
-    for (const FRoomConnection& Conn : AllConnections)
+    for (UHierarchicalInstancedStaticMeshComponent* Component : InstancedTileComponents)
     {
-        if (Find(Conn.RoomIndexA, Parent) != Find(Conn.RoomIndexB, Parent))
+        if (IsValid(Component))
         {
-            MST.Add(Conn);
-            Union(Conn.RoomIndexA, Conn.RoomIndexB, Parent, Rank);
-            if (MST.Num() == Rooms.Num() - 1) break;
+            RemoveInstanceComponent(Component);
+            Component->DestroyComponent();
         }
     }
+    InstancedTileComponents.Reset();
+    InstancedTileKeys.Reset();
+    PendingTileInstances.Reset();
 
-    if (MST.Num() == 0)
+    for (UProceduralMeshComponent* Component : MergedMeshComponents)
     {
-        UE_LOG(LogTemp, Warning, TEXT("No corridors to connect: MST is empty"));
+        if (IsValid(Component))
+        {
+            RemoveInstanceComponent(Component);
+            Component->DestroyComponent();
+        }
     }
-	
-    return MST;
+    MergedMeshComponents.Reset();
+    MergedMeshChunks.Reset();
 }
 
-// Sets default values
-ADungeonGenerator::ADungeonGenerator()
+void ADungeonGenerator::BenchmarkSpawning()
 {
- 	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
-	PrimaryActorTick.bCanEverTick = true;
-	
-    static ConstructorHelpers::FClassFinder<AActor> WallBPClass(TEXT("/Game/PathToBP_Wall.BP_Wall_C"));
-    if (WallBPClass.Class != NULL)
+    // On a copy, so this generator's layout and tiles stay as they are
+    ADungeonGenerator* Scratch = SpawnScratchGenerator();
+    if (!Scratch)
     {
-        WallClass = WallBPClass.Class;
+        UE_LOG(LogTemp, Error, TEXT("Failed to spawn a copy of the generator for the spawn benchmark"));
+        return;
+    }
+    Scratch->GenerateLayout();
+
+    // Same layout for every mode, so only the spawn path differs
+    for (EDungeonRenderMode Mode : { EDungeonRenderMode::Actors, EDungeonRenderMode::InstancedMeshes, EDungeonRenderMode::MergedMeshes })
+    {
+        Scratch->RenderMode = Mode;
+        const double StartTime = FPlatformTime::Seconds();
+        Scratch->SpawnDungeonEnvironment();
+        const double Elapsed = FPlatformTime::Seconds() - StartTime;
+
+        int32 NumComponents = Scratch->InstancedTileComponents.Num() + Scratch->MergedMeshComponents.Num();
+        int32 NumInstances = 0;
+        int64 NumTriangles = 0;
+        int32 NumBodies = 0;
+        for (const AActor* Actor : Scratch->SpawnedTileActors)
+        {
+            NumComponents += Actor->GetComponents().Num();
+            for (UActorComponent* Component : Actor->GetComponents())
+            {
+                CountRenderCost(Component, NumTriangles, NumBodies);
+            }
+        }
+        for (UHierarchicalInstancedStaticMeshComponent* Component : Scratch->InstancedTileComponents)
+        {
+            NumInstances += Component->GetInstanceCount();
+            CountRenderCost(Component, NumTriangles, NumBodies);
+        }
+        for (UProceduralMeshComponent* Component : Scratch->MergedMeshComponents)
+        {
+            CountRenderCost(Component, NumTriangles, NumBodies);
+        }
+        const TCHAR* ModeName = Mode == EDungeonRenderMode::Actors ? TEXT("actors")
+            : Mode == EDungeonRenderMode::InstancedMeshes ? TEXT("instanced meshes") : TEXT("merged meshes");
+        UE_LOG(LogTemp, Warning, TEXT("Spawn benchmark [%s]: %.3f ms, %d actors, %d components, %d instances, %lld triangles, %d physics bodies"),
+            ModeName, Elapsed * 1000.0, Scratch->SpawnedTileActors.Num(), NumComponents, NumInstances, NumTriangles, NumBodies);
     }
 
+    Scratch->ClearSpawnedEnvironment();
+    Scratch->Destroy();
 }
-void ADungeonGenerator::GenerateAllRoomConnections(TArray<FRoomConnection>& OutConnections)
+
+ADungeonGenerator* ADungeonGenerator::SpawnScratchGenerator()
 {
-    OutConnections.Empty();
-    for (int32 i = 0; i < Rooms.Num(); i++)
+    ADungeonGenerator* Scratch = GetWorld()->SpawnActorDeferred<ADungeonGenerator>(GetClass(), GetActorTransform(), this);
+    if (!Scratch)
     {
-        for (int32 j = i + 1; j < Rooms.Num(); j++)
+        return nullptr;
+    }
+    // Every setting a designer can edit, tile classes, meshes and materials included. The layout and the spawned
+    // tiles aren't editable, so the copy starts out without any
+    for (TFieldIterator<FProperty> It(GetClass()); It; ++It)
+    {
+        if (It->GetOwnerClass()->IsChildOf(ADungeonGenerator::StaticClass()) && It->HasAnyPropertyFlags(CPF_Edit)
+            && !It->HasAnyPropertyFlags(CPF_EditConst))
         {
-            const FRoom& RoomA = Rooms[i];
-            const FRoom& RoomB = Rooms[j];
-            FVector CenterA(RoomA.StartX + RoomA.Width / 2.0f, RoomA.StartY + RoomA.Height / 2.0f, RoomA.StartZ + RoomA.Length / 2.0f);
-            FVector CenterB(RoomB.StartX + RoomB.Width / 2.0f, RoomB.StartY + RoomB.Height / 2.0f, RoomA.StartZ + RoomA.Length / 2.0f);
-            float Distance = FVector::Dist(CenterA, CenterB);
-            OutConnections.Add(FRoomConnection(i, j, Distance));
+            It->CopyCompleteValue_InContainer(Scratch, this);
         }
     }
+    Scratch->bRandomizeSeed = false;
+    Scratch->bUseLayoutCache = false;
+    Scratch->bDrawDebugGrid = false;
+    Scratch->bPlacePlayerStart = false;
+    Scratch->bScratchCopy = true;
+    Scratch->FinishSpawning(GetActorTransform());
+    return Scratch;
+}
 
-    // Sort connections by distance
-    OutConnections.Sort();
+void ADungeonGenerator::SpawnDungeonEnvironment()
+{
+    BeginSpawnEnvironment();
+    SpawnEnvironmentStep(MAX_dbl);
 }
 
-// Called when the game starts or when spawned
-void ADungeonGenerator::BeginPlay()
+void ADungeonGenerator::BeginSpawnEnvironment()
 {
-	Super::BeginPlay();
-	 GenerateDungeon();
+    ClearSpawnedEnvironment();
+    if (!Layout.AreWallEdgesCurrent())
+    {
+        Layout.BuildWallEdges();
+    }
+    SpawnCursor = 0;
+    SpawningChunk = INDEX_NONE;
+    WarnMissingInstanceMeshes();
 }
 
-// Called every frame
-void ADungeonGenerator::Tick(float DeltaTime)
+bool ADungeonGenerator::SpawnEnvironmentStep(double BudgetSeconds)
 {
-	Super::Tick(DeltaTime);
-	 static int FrameCounter = 0;
-    FrameCounter++;
-    if (FrameCounter >= 400)
+    DUNGEON_SCOPE(STAT_DungeonSpawnEnvironment);
+    const double EndTime = FPlatformTime::Seconds() + BudgetSeconds;
+
+    // Cells in index order, then the wall edges and the staircases. Chunks that were never written hold only empty
+    // cells and are skipped whole
+    const int32 NumCells = Layout.GetNumCellIndices();
+    const int32 NumWalls = NumCells + Layout.WallEdges.Num();
+    const int32 NumSteps = NumWalls + Layout.Stairs.Num();
+    while (SpawnCursor < NumSteps)
     {
-        //DrawDebugGrid();
-		
-        FrameCounter = 0;  // reset counter after updating
+        if (SpawnCursor < NumCells)
+        {
+            const int32 Chunk = SpawnCursor >> TDungeonChunkedGrid<uint8>::ChunkCellBits;
+            if (!Layout.Cells.IsChunkAllocated(Chunk))
+            {
+                SpawnCursor = (Chunk + 1) << TDungeonChunkedGrid<uint8>::ChunkCellBits;
+                continue;
+            }
+            SpawningChunk = Chunk;
+            if (RenderMode == EDungeonRenderMode::MergedMeshes)
+            {
+                // A chunk per step, merging needs all of its cells at once
+                SpawnMergedChunk(Chunk);
+                SpawnCursor = (Chunk + 1) << TDungeonChunkedGrid<uint8>::ChunkCellBits;
+            }
+            else
+            {
+                const FIntVector Cell = Layout.GetPositionFromIndex(SpawnCursor);
+                if (Layout.IsInGrid(Cell))
+                {
+                    SpawnCell(Cell);
+                }
+                SpawnCursor++;
+            }
+        }
+        else if (SpawnCursor < NumWalls)
+        {
+            // Merged chunks already hold their walls
+            if (RenderMode == EDungeonRenderMode::MergedMeshes)
+            {
+                SpawnCursor = NumWalls;
+                continue;
+            }
+            const int32 Edge = SpawnCursor - NumCells;
+            SpawningChunk = Layout.GetWallEdgeChunk(Edge);
+            SpawnWallEdge(Layout.WallEdges[Edge]);
+            SpawnCursor++;
+        }
+        else
+        {
+            // Staircases are still tile actors in MergedMeshes mode
+            const FStair& Stair = Layout.Stairs[SpawnCursor - NumWalls];
+            SpawningChunk = Layout.GetIndex(Stair.StairCells[0]) >> TDungeonChunkedGrid<uint8>::ChunkCellBits;
+            SpawnStair(Stair);
+            SpawnCursor++;
+        }
+
+        if (FPlatformTime::Seconds() >= EndTime && SpawnCursor < NumSteps)
+        {
+            return false;
+        }
     }
-	
+
+    FlushTileInstances();
+    SpawningChunk = INDEX_NONE;
+    return true;
 }
 
-void ADungeonGenerator::PlacePlayerStart()
+void ADungeonGenerator::RespawnChunks(const TArray<int32>& Chunks)
 {
-    if (Rooms.Num() > 0)  // Check if there are any rooms defined
+    DUNGEON_SCOPE(STAT_DungeonSpawnEnvironment);
+    TBitArray<> DirtyChunks(false, Layout.Cells.GetNumChunks());
+    for (int32 Chunk : Chunks)
     {
-        FRoom& FirstRoom = Rooms[0];  // Reference to the first room
-        FVector RoomCenter = FirstRoom.GetCenter();  // Get the center point of the first room
-        FVector WorldCenter = GetWorldLocation(RoomCenter);  // Convert grid coordinates to world coordinates
+        DirtyChunks[Chunk] = true;
+    }
+    auto IsDirty = [&DirtyChunks](int32 Chunk) { return Chunk != INDEX_NONE && DirtyChunks[Chunk]; };
 
-        // Assuming PlayerStart is an AActor class that you can place in the world
-        APlayerStart* PlayerStartActor = GetWorld()->SpawnActor<APlayerStart>(APlayerStart::StaticClass(), WorldCenter, FRotator(0.f, 0.f, 0.f));
-       APlayerController* PC = UGameplayStatics::GetPlayerController(this, 0);
-       
-        if (!PlayerStartActor)
+    for (int32 i = SpawnedTileActors.Num() - 1; i >= 0; i--)
+    {
+        if (IsDirty(SpawnedTileActorChunks[i]))
         {
-            UE_LOG(LogTemp, Warning, TEXT("Failed to place PlayerStart at Room 0 center"));
+            if (IsValid(SpawnedTileActors[i]))
+            {
+                SpawnedTileActors[i]->Destroy();
+            }
+            SpawnedTileActors.RemoveAtSwap(i);
+            SpawnedTileActorChunks.RemoveAtSwap(i);
         }
-        
-         if (PC)
+    }
+
+    // Components hold the tiles of one chunk, so the other chunks' instances are never touched
+    for (int32 i = InstancedTileComponents.Num() - 1; i >= 0; i--)
+    {
+        if (IsDirty(InstancedTileKeys[i].Chunk))
+        {
+            if (IsValid(InstancedTileComponents[i]))
             {
-                PC->GetPawn()->SetActorLocation(WorldCenter);
+                RemoveInstanceComponent(InstancedTileComponents[i]);
+                InstancedTileComponents[i]->DestroyComponent();
+            }
+            InstancedTileComponents.RemoveAtSwap(i);
+            InstancedTileKeys.RemoveAtSwap(i);
+        }
+    }
+
+    for (int32 i = MergedMeshComponents.Num() - 1; i >= 0; i--)
+    {
+        if (IsDirty(MergedMeshChunks[i]))
+        {
+            if (IsValid(MergedMeshComponents[i]))
+            {
+                RemoveInstanceComponent(MergedMeshComponents[i]);
+                MergedMeshComponents[i]->DestroyComponent();
             }
+            MergedMeshComponents.RemoveAtSwap(i);
+            MergedMeshChunks.RemoveAtSwap(i);
+        }
+    }
+
+    WarnMissingInstanceMeshes();
+    for (int32 Chunk : Chunks)
+    {
+        SpawnChunk(Chunk);
+    }
+    for (const FStair& Stair : Layout.Stairs)
+    {
+        const int32 Chunk = Layout.GetIndex(Stair.StairCells[0]) >> TDungeonChunkedGrid<uint8>::ChunkCellBits;
+        if (DirtyChunks[Chunk])
+        {
+            SpawningChunk = Chunk;
+            SpawnStair(Stair);
+        }
     }
+    FlushTileInstances();
+    SpawningChunk = INDEX_NONE;
 }
 
-FVector ADungeonGenerator::GetWorldLocation(const FVector& GridLocation)
+void ADungeonGenerator::SpawnChunk(int32 Chunk)
 {
-    // Assuming each grid cell is 100 units wide
-    return GetActorLocation() + GridLocation * CellSize;
+    SpawningChunk = Chunk;
+    if (!Layout.Cells.IsChunkAllocated(Chunk))
+    {
+        return;
+    }
+    if (RenderMode == EDungeonRenderMode::MergedMeshes)
+    {
+        SpawnMergedChunk(Chunk);
+        return;
+    }
+
+    const int32 First = Chunk << TDungeonChunkedGrid<uint8>::ChunkCellBits;
+    for (int32 Index = First; Index < First + TDungeonChunkedGrid<uint8>::ChunkCells; Index++)
+    {
+        const FIntVector Cell = Layout.GetPositionFromIndex(Index);
+        if (Layout.IsInGrid(Cell))
+        {
+            SpawnCell(Cell);
+        }
+    }
+    for (int32 LocalZ = 0; LocalZ < TDungeonChunkedGrid<uint8>::ChunkSize; LocalZ++)
+    {
+        for (const FDungeonWallEdge& Edge : Layout.GetWallEdges(Chunk, LocalZ))
+        {
+            SpawnWallEdge(Edge);
+        }
+    }
 }
 
-void ADungeonGenerator::GenerateDungeon()
+void ADungeonGenerator::SpawnCell(const FIntVector& Cell)
 {
+    int32 Index = Layout.GetIndex(Cell);
+    FVector CellLocation = GetWorldLocation(Cell);
 
-    UE_LOG(LogTemp, Warning, TEXT("Generating Dungeon..."));
-  	 InitializeGrid();  // Set up the grid with default values
-    PlaceMultipleRooms(NumofRoom);  // Place 10 rooms randomly
+    const EDungeonCell Type = Layout.GetCell(Index);
+    if (Type == EDungeonCell::Room)  // Room
+    {
+        SpawnFloorTile(CellLocation);
+    }
+    else if (Type == EDungeonCell::Corridor)  // Corridors, their walls come from WallEdges
+    {
+        //SpawnCorridorTile(CellLocation, Type);
+        SpawnFloorTile(CellLocation);
+    }
+    else  // Walls/empty space
+    {
+        //SpawnWallTile(CellLocation);
+    }
+}
 
-    TArray<FRoomConnection> MST = KruskalsMST();  // Generate the MST to find optimal room connections
-    ConnectRoomsUsingAStar(MST);  // Connect rooms using corridors defined by A*
 
-    SpawnDungeonEnvironment();  // Spawn the physical dungeon based on the grid
-    //SpawnRoomWalls();
-    DrawDebugGrid();
-    PlacePlayerStart();
-}
 
-void ADungeonGenerator::SpawnFloorTile(const FVector& Location)
+void ADungeonGenerator::SpawnMergedChunk(int32 Chunk)
 {
-    FActorSpawnParameters SpawnParams;
-    SpawnParams.Owner = this;
-    SpawnParams.Instigator = GetInstigator();
-    FVector AdjustedLocation = Location - FVector(CellSize/2, CellSize/2, CellSize/2);
-    AActor* FloorActor = GetWorld()->SpawnActor<AActor>(FloorTileClass, AdjustedLocation, FRotator::ZeroRotator, SpawnParams);
-    if (!FloorActor)
+    constexpr int32 ChunkSize = TDungeonChunkedGrid<uint8>::ChunkSize;
+    const FIntVector ChunkOrigin = Layout.GetPositionFromIndex(Chunk << TDungeonChunkedGrid<uint8>::ChunkCellBits);
+    const float Half = CellSize / 2;
+
+    UProceduralMeshComponent* Component = nullptr;
+    int32 NumSections = 0;
+    FMergedMeshSection Floors, Walls;
+    TArray<TArray<FVector>> Collision;
+
+    // Positions are relative to the actor location, the same frame the tiles are spawned in
+    auto AddQuad = [&](FMergedMeshSection& Section, const FVector& Origin, const FVector& U, const FVector& V, const FVector& Normal)
     {
-        UE_LOG(LogTemp, Error, TEXT("Failed to spawn floor tile at Location: %s"), *Location.ToString());
+        Section.AddQuad(Origin, U, V, Normal, CellSize);
+        if (MergedCollisionThickness > 0)
+        {
+            Collision.Add(MakeQuadCollision(Origin, U, V, Normal, MergedCollisionThickness));
+        }
+        INC_DWORD_STAT(STAT_DungeonMergedQuadsSpawned);
+    };
+
+    auto FlushSection = [&](FMergedMeshSection& Section, UMaterialInterface* Material)
+    {
+        if (Section.Vertices.Num() == 0)
+        {
+            return;
+        }
+        if (!Component)
+        {
+            const FName Name = MakeUniqueObjectName(this, UProceduralMeshComponent::StaticClass(), *FString::Printf(TEXT("MergedChunk%d"), Chunk));
+            Component = NewObject<UProceduralMeshComponent>(this, Name);
+        }
+        Component->CreateMeshSection(NumSections, Section.Vertices, Section.Triangles, Section.Normals, Section.UVs,
+            TArray<FColor>(), Section.Tangents, false);
+        Component->SetMaterial(NumSections, Material);
+        NumSections++;
+        Section.Reset();
+    };
+
+    for (int32 LocalZ = 0; LocalZ < ChunkSize && ChunkOrigin.Z + LocalZ < Layout.Length; LocalZ++)
+    {
+        const int32 Z = ChunkOrigin.Z + LocalZ;
+
+        // Floor masks have a row per y and a bit per x
+        uint32 FloorRows[ChunkSize] = {};
+        for (int32 LocalY = 0; LocalY < ChunkSize && ChunkOrigin.Y + LocalY < Layout.Height; LocalY++)
+        {
+            for (int32 LocalX = 0; LocalX < ChunkSize && ChunkOrigin.X + LocalX < Layout.Width; LocalX++)
+            {
+                const EDungeonCell Type = Layout.GetCell(FIntVector(ChunkOrigin.X + LocalX, ChunkOrigin.Y + LocalY, Z));
+                if (Type == EDungeonCell::Room || Type == EDungeonCell::Corridor)
+                {
+                    FloorRows[LocalY] |= 1u << LocalX;
+                }
+            }
+        }
+
+        // Wall masks have a row per face plane across their axis, one more than the chunk has cells since edges on
+        // the chunk's low border start one cell outside it, and a bit per cell along the plane. Seen from the
+        // negative side the face points to -X or -Y, from the positive side to +X or +Y
+        uint32 NegativeXRows[ChunkSize + 1] = {}, PositiveXRows[ChunkSize + 1] = {};
+        uint32 NegativeYRows[ChunkSize + 1] = {}, PositiveYRows[ChunkSize + 1] = {};
+        for (const FDungeonWallEdge& Edge : Layout.GetWallEdges(Chunk, LocalZ))
+        {
+            const int32 LocalX = Edge.X - ChunkOrigin.X;
+            const int32 LocalY = Edge.Y - ChunkOrigin.Y;
+            const bool bNegative = EnumHasAnyFlags(Edge.Sides, EDungeonWallSides::Negative);
+            const bool bPositive = EnumHasAnyFlags(Edge.Sides, EDungeonWallSides::Positive);
+            if (Edge.Axis == EDungeonWallAxis::X)
+            {
+                NegativeXRows[LocalX + 1] |= uint32(bNegative) << LocalY;
+                PositiveXRows[LocalX + 1] |= uint32(bPositive) << LocalY;
+            }
+            else
+            {
+                NegativeYRows[LocalY + 1] |= uint32(bNegative) << LocalX;
+                PositiveYRows[LocalY + 1] |= uint32(bPositive) << LocalX;
+            }
+        }
+
+        const float Bottom = Z * CellSize - Half;
+        ForEachMergedRect(FloorRows, true, [&](int32 X, int32 Y, int32 SizeX, int32 SizeY)
+        {
+            AddQuad(Floors, FVector((ChunkOrigin.X + X) * CellSize - Half, (ChunkOrigin.Y + Y) * CellSize - Half, Bottom),
+                FVector(SizeX * CellSize, 0, 0), FVector(0, SizeY * CellSize, 0), FVector::UpVector);
+        });
+
+        // Walls only merge along their row, the rows of one mask are different planes. Plane P lies on the +X or +Y
+        // face of the cells at local P - 1
+        const FVector WallUp(0, 0, CellSize);
+        auto AddWallsX = [&](uint32 (&Rows)[ChunkSize + 1], const FVector& Normal)
+        {
+            ForEachMergedRect(Rows, false, [&](int32 Y, int32 Plane, int32 SizeY, int32)
+            {
+                AddQuad(Walls, FVector((ChunkOrigin.X + Plane - 1) * CellSize + Half, (ChunkOrigin.Y + Y) * CellSize - Half, Bottom),
+                    FVector(0, SizeY * CellSize, 0), WallUp, Normal);
+            });
+        };
+        auto AddWallsY = [&](uint32 (&Rows)[ChunkSize + 1], const FVector& Normal)
+        {
+            ForEachMergedRect(Rows, false, [&](int32 X, int32 Plane, int32 SizeX, int32)
+            {
+                AddQuad(Walls, FVector((ChunkOrigin.X + X) * CellSize - Half, (ChunkOrigin.Y + Plane - 1) * CellSize + Half, Bottom),
+                    FVector(SizeX * CellSize, 0, 0), WallUp, Normal);
+            });
+        };
+        AddWallsX(NegativeXRows, FVector::BackwardVector);
+        AddWallsX(PositiveXRows, FVector::ForwardVector);
+        AddWallsY(NegativeYRows, FVector::LeftVector);
+        AddWallsY(PositiveYRows, FVector::RightVector);
+
+        // A floor and a wall section per z-level, so levels can still be culled apart
+        FlushSection(Floors, MergedFloorMaterial);
+        FlushSection(Walls, MergedWallMaterial);
     }
-}
 
-void ADungeonGenerator::SpawnDungeonEnvironment()
-{
+    if (!Component)
+    {
+        return;
+    }
 
-    float Elevation = 100.0f;
-    for (int32 z = 0; z < Length; z++)
-    for (int32 y = 0; y < Height; y++)
+    // One convex box per quad instead of a body per tile
+    if (Collision.Num() > 0)
     {
-        for (int32 x = 0; x < Width; x++)
-        {
-            
-               int32 Index = GetIndex(x, y, z);
-                FVector CellLocation = GetActorLocation() + FVector(x * CellSize, y * CellSize, z * CellSize);
-                
-                if (Grid[Index] == 1)  // Room
-                {
-                    SpawnFloorTile(CellLocation);
-                }
-                else if (Grid[Index] == 2)  // Corridors
-                {
-                    //SpawnCorridorTile(CellLocation, Grid[Index]);
-                    SpawnCorridorWalls(x, y, z, Grid[Index]);
-                }
-                else  // Walls/empty space
-                {
-                    //SpawnWallTile(CellLocation);
-            
-                 }
-        }
+        Component->bUseComplexAsSimpleCollision = false;
+        Component->SetCollisionConvexMeshes(Collision);
+        Component->SetCollisionProfileName(UCollisionProfile::BlockAll_ProfileName);
+    }
+    else
+    {
+        Component->SetCollisionEnabled(ECollisionEnabled::NoCollision);
     }
 
-    SpawnStairs();
+    USceneComponent* Root = GetRootComponent();
+    Component->SetMobility(Root ? Root->Mobility : EComponentMobility::Static);
+    Component->SetupAttachment(Root);
+    // Tiles ignore the actor's rotation and scale, so do the merged meshes
+    Component->SetWorldTransform(FTransform(GetActorLocation()));
+    Component->RegisterComponent();
+    AddInstanceComponent(Component);
+    MergedMeshComponents.Add(Component);
+    MergedMeshChunks.Add(Chunk);
 }
 
-
+bool FDungeonLayout::HasCorridorWall(const FIntVector& Cell, const FIntVector& Side) const
+{
+    const FIntVector Neighbor = Cell + Side;
+    return !IsInGrid(Neighbor) || GetCell(Neighbor) == EDungeonCell::Empty;
+}
 
 void ADungeonGenerator::SpawnWallTile(const FVector& Location, const FRotator& Rotation)
 {
+    if (RenderMode == EDungeonRenderMode::InstancedMeshes)
+    {
+        const FVector InstanceLocation = Location + FVector(CellSize/2, CellSize/2, -CellSize/2);
+        AddTileInstance(WallInstanceMesh, FTransform(Rotation, InstanceLocation), GetGridLocation(Location + FVector(CellSize/2)).Z);
+        return;
+    }
+
     // Assuming WallClass is a UClass* that points to BP_Wall
     if (!WallClass)
     {
@@ -747,145 +3384,276 @@ void ADungeonGenerator::SpawnWallTile(const FVector& Location, const FRotator& R
     if (!WallActor)
     {
         UE_LOG(LogTemp, Error, TEXT("Failed to spawn wall at Location: %s"), *Location.ToString());
+        return;
     }
+    AddSpawnedTileActor(WallActor);
+    INC_DWORD_STAT(STAT_DungeonActorsSpawned);
 }
 
 
 void ADungeonGenerator::SpawnStairs()
 {
+    for(const FStair& Stair:Layout.Stairs)
+    {
+        SpawnStair(Stair);
+    }
+}
 
+void ADungeonGenerator::SpawnStair(const FStair& Stair)
+{
     FVector BaseLocation = GetActorLocation();
-    for(const FStair& Stair:Stairs)
-    {
-        
-            // Assume the first cell is the base of the staircase
-            UE_LOG(LogTemp, Warning, TEXT("Staircase at Location: %s"), *Stair.StairCells[0].ToString());
-            FVector CellLocation = BaseLocation + FVector(Stair.StairCells[0].X * CellSize, Stair.StairCells[0].Y * CellSize, Stair.StairCells[0].Z*CellSize);
-              FVector Direction = Stair.Direction;
 
-            
-            
-            if(Direction.Z==1)
-            {
-                   //Normalize direction to ignore the Z component for the rotator
-                int temp=Direction.Z;
-                Direction.Z = 0;
-                Direction.Normalize();
+    // Assume the first cell is the base of the staircase
+    UE_LOG(LogTemp, Verbose, TEXT("Staircase at Location: %s"), *Stair.StairCells[0].ToString());
+    FVector CellLocation = GetWorldLocation(Stair.StairCells[0]);
+    FVector Direction(Stair.Direction);
 
-                FRotator Rotation = FRotationMatrix::MakeFromX(Direction).Rotator();
+    if(Direction.Z==1)
+    {
+        //Normalize direction to ignore the Z component for the rotator
+        int temp=Direction.Z;
+        Direction.Z = 0;
+        Direction.Normalize();
 
-                CellLocation = CellLocation - FVector(Direction.X*CellSize/2, Direction.Y*CellSize/2,temp*CellSize/2 );  // Adjust the location to the top of the staircase
-                // Spawn the staircase blueprint at the base location with the calculated rotation
+        FRotator Rotation = FRotationMatrix::MakeFromX(Direction).Rotator();
 
-                AActor* SpawnedStair = GetWorld()->SpawnActor<AActor>(StairBlueprint, CellLocation, Rotation);
+        CellLocation = CellLocation - FVector(Direction.X*CellSize/2, Direction.Y*CellSize/2,temp*CellSize/2 );  // Adjust the location to the top of the staircase
+        if (RenderMode == EDungeonRenderMode::InstancedMeshes)
+        {
+            AddTileInstance(StairInstanceMesh, FTransform(Rotation, CellLocation), Stair.StairCells[0].Z);
+            return;
+        }
+        // Spawn the staircase blueprint at the base location with the calculated rotation
 
-                if (!SpawnedStair)
-                {
-                    UE_LOG(LogTemp, Warning, TEXT("Failed to spawn staircase at Location: %s"), *BaseLocation.ToString());
-                }
-            }
-            else
-            {
-                //Normalize direction to ignore the Z component for the rotator
-                int temp=Direction.Z;
-                Direction.Z = 0;
-                Direction.Normalize();
+        AActor* SpawnedStair = GetWorld()->SpawnActor<AActor>(StairBlueprint, CellLocation, Rotation);
 
-                FRotator Rotation = FRotationMatrix::MakeFromX(Direction).Rotator();
+        if (!SpawnedStair)
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Failed to spawn staircase at Location: %s"), *BaseLocation.ToString());
+        }
+        else
+        {
+            AddSpawnedTileActor(SpawnedStair);
+            INC_DWORD_STAT(STAT_DungeonActorsSpawned);
+        }
+    }
+    else
+    {
+        //Normalize direction to ignore the Z component for the rotator
+        int temp=Direction.Z;
+        Direction.Z = 0;
+        Direction.Normalize();
 
-                CellLocation = CellLocation + FVector(Direction.X*CellSize, Direction.Y*CellSize,temp*CellSize );  // Adjust the location to the top of the staircase
-                // Spawn the staircase blueprint at the base location with the calculated rotation
-                 CellLocation = CellLocation + FVector(Direction.X*CellSize/2, Direction.Y*CellSize/2,temp*CellSize/2 ); 
-                AActor* SpawnedStair = GetWorld()->SpawnActor<AActor>(StairBlueprint2, CellLocation, Rotation);
+        FRotator Rotation = FRotationMatrix::MakeFromX(Direction).Rotator();
 
-                if (!SpawnedStair)
-                {
-                    UE_LOG(LogTemp, Warning, TEXT("Failed to spawn staircase at Location: %s"), *BaseLocation.ToString());
-                }
-            }
+        CellLocation = CellLocation + FVector(Direction.X*CellSize, Direction.Y*CellSize,temp*CellSize );  // Adjust the location to the top of the staircase
+        // Spawn the staircase blueprint at the base location with the calculated rotation
+        CellLocation = CellLocation + FVector(Direction.X*CellSize/2, Direction.Y*CellSize/2,temp*CellSize/2 );
+        if (RenderMode == EDungeonRenderMode::InstancedMeshes)
+        {
+            AddTileInstance(StairInstanceMesh2, FTransform(Rotation, CellLocation), Stair.StairCells[0].Z);
+            return;
+        }
+        AActor* SpawnedStair = GetWorld()->SpawnActor<AActor>(StairBlueprint2, CellLocation, Rotation);
 
-           
-            
-          
-        
+        if (!SpawnedStair)
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Failed to spawn staircase at Location: %s"), *BaseLocation.ToString());
+        }
+        else
+        {
+            AddSpawnedTileActor(SpawnedStair);
+            INC_DWORD_STAT(STAT_DungeonActorsSpawned);
+        }
     }
 }
 
-void ADungeonGenerator::SpawnCorridorWalls(int x, int y, int z, int32 CorridorType)
+void ADungeonGenerator::SpawnWallEdge(const FDungeonWallEdge& Edge)
 {
-    FVector BaseLocation = GetActorLocation();
-    FVector CellLocation = BaseLocation + FVector(x * CellSize, y * CellSize, z*CellSize);
-    bool shouldSpawnEastWall = true, shouldSpawnWestWall = true, shouldSpawnNorthWall = true, shouldSpawnSouthWall = true;
-
-
-    FRotator r1(0.0f, -180.0f, 0.0f);  // Vertical walls, faces East/West
-    FRotator r2(0.0f, -90.0f, 0.0f);  
-     FRotator r3(0.0f, -180.0f, 0.0f);  
-     FRotator r4(0.0f, -90.0f, 0.0f);  
-    // Check the grid boundaries and neighboring cells
-     TArray<FVector> Directions = {
-        FVector(1, 0, 0), FVector(-1, 0, 0),   // East, West
-        FVector(0, 1, 0), FVector(0, -1, 0),  // North, South
-    };
-
-
+    // Same placement the per-cell walls had: the tile sits at the cell on the negative side, turned to the face
+    const FRotator Rotation = Edge.Axis == EDungeonWallAxis::X ? FRotator(0.0f, -90.0f, 0.0f) : FRotator(0.0f, -180.0f, 0.0f);
+    SpawnWallTile(GetWorldLocation(Edge.GetCell()), Rotation);
+}
 
+void FDungeonLayout::BuildWallEdges()
+{
+    DUNGEON_SCOPE(STAT_DungeonBuildWallEdges);
+    NeighborMasks.Build(Cells, DungeonCellTypeMask);
+    WallEdges.Reset();
+    WallEdgeOffsets.Reset(Cells.GetNumChunks() * TDungeonChunkedGrid<uint8>::ChunkSize + 1);
 
-    if (x > 0) // Check West
-    {
-        int32 WestIndex = GetIndex(x - 1, y, z);
-        shouldSpawnWestWall = (Grid[WestIndex] == 0 ); // Empty or door
-    }
-    if (x < Width - 1) // Check East
+    for (int32 Chunk = 0; Chunk < Cells.GetNumChunks(); Chunk++)
     {
-        int32 EastIndex = GetIndex(x + 1, y, z);
-       
-        shouldSpawnEastWall = (Grid[EastIndex] == 0 ); // Empty or door
-    }
-    if (y > 0) // Check North
-    {
-        int32 NorthIndex = GetIndex(x, y - 1, z);
-        shouldSpawnNorthWall = (Grid[NorthIndex] == 0 ); // Empty or door
+        AppendChunkWallEdges(Chunk);
     }
-    if (y < Height - 1) // Check South
+    WallEdgeOffsets.Add(WallEdges.Num());
+    bWallEdgesDirty = false;
+    SET_DWORD_STAT(STAT_DungeonWallEdges, WallEdges.Num());
+}
+
+void FDungeonLayout::UpdateWallEdges(const TArray<int32>& Chunks)
+{
+    DUNGEON_SCOPE(STAT_DungeonBuildWallEdges);
+    constexpr int32 ChunkSize = TDungeonChunkedGrid<uint8>::ChunkSize;
+    NeighborMasks.UpdateChunks(Cells, DungeonCellTypeMask, Chunks);
+
+    // Only the changed chunks look at cells, the edges of the others are copied over as they were
+    const TArray<FDungeonWallEdge> OldEdges = MoveTemp(WallEdges);
+    const TArray<int32> OldOffsets = MoveTemp(WallEdgeOffsets);
+    WallEdges.Reset(OldEdges.Num());
+    WallEdgeOffsets.Reset(OldOffsets.Num());
+
+    int32 NextChanged = 0;
+    for (int32 Chunk = 0; Chunk < Cells.GetNumChunks(); Chunk++)
     {
-        int32 SouthIndex = GetIndex(x, y + 1, z);
-        shouldSpawnSouthWall = (Grid[SouthIndex] == 0 ); // Empty or door
+        if (NextChanged < Chunks.Num() && Chunks[NextChanged] == Chunk)
+        {
+            AppendChunkWallEdges(Chunk);
+            NextChanged++;
+            continue;
+        }
+        const int32 First = OldOffsets[Chunk * ChunkSize];
+        const int32 Shift = WallEdges.Num() - First;
+        for (int32 LocalZ = 0; LocalZ < ChunkSize; LocalZ++)
+        {
+            WallEdgeOffsets.Add(OldOffsets[Chunk * ChunkSize + LocalZ] + Shift);
+        }
+        WallEdges.Append(OldEdges.GetData() + First, OldOffsets[(Chunk + 1) * ChunkSize] - First);
     }
+    WallEdgeOffsets.Add(WallEdges.Num());
+    bWallEdgesDirty = false;
+    SET_DWORD_STAT(STAT_DungeonWallEdges, WallEdges.Num());
+}
 
-    // Spawn walls where needed
-    if (shouldSpawnEastWall)//done
+void FDungeonLayout::AppendChunkWallEdges(int32 Chunk)
+{
+    constexpr int32 LevelCells = TDungeonChunkedGrid<uint8>::ChunkSize * TDungeonChunkedGrid<uint8>::ChunkSize;
+    const FIntVector StepX(1, 0, 0);
+    const FIntVector StepY(0, 1, 0);
+
+    if (!Cells.IsChunkAllocated(Chunk))
     {
-        FVector WallLocation = CellLocation;
-        SpawnWallTile(WallLocation,r4);
+        // All empty, no corridor to want a wall
+        for (int32 LocalZ = 0; LocalZ < TDungeonChunkedGrid<uint8>::ChunkSize; LocalZ++)
+        {
+            WallEdgeOffsets.Add(WallEdges.Num());
+        }
+        return;
     }
-    if (shouldSpawnWestWall)//done
+
+    const int32 First = Chunk << TDungeonChunkedGrid<uint8>::ChunkCellBits;
+    const uint8* ChunkCells = Cells.GetChunkData(Chunk);
+    for (int32 Local = 0; Local < TDungeonChunkedGrid<uint8>::ChunkCells; Local++)
     {
-        FVector WallLocation = CellLocation + FVector(-CellSize, 0, 0);
-        SpawnWallTile(WallLocation,r2);
+        if (Local % LevelCells == 0)
+        {
+            WallEdgeOffsets.Add(WallEdges.Num());
+        }
+        if (static_cast<EDungeonCell>(ChunkCells[Local] & DungeonCellTypeMask) != EDungeonCell::Corridor)
+        {
+            continue;
+        }
+
+        // Corridor sides with nothing next to them. The other side of such a face is empty and never asks for
+        // it, so every face comes up once, keyed by the cell on its negative side
+        const EDungeonNeighbor Open = ~NeighborMasks.Get(First + Local) & EDungeonNeighbor::Horizontal;
+        if (Open == EDungeonNeighbor::None)
+        {
+            continue;
+        }
+        const FIntVector Cell = GetPositionFromIndex(First + Local);
+        if (EnumHasAnyFlags(Open, EDungeonNeighbor::PosX))
+        {
+            WallEdges.Emplace(Cell, EDungeonWallAxis::X, EDungeonWallSides::Negative);
+        }
+        if (EnumHasAnyFlags(Open, EDungeonNeighbor::NegX))
+        {
+            WallEdges.Emplace(Cell - StepX, EDungeonWallAxis::X, EDungeonWallSides::Positive);
+        }
+        if (EnumHasAnyFlags(Open, EDungeonNeighbor::PosY))
+        {
+            WallEdges.Emplace(Cell, EDungeonWallAxis::Y, EDungeonWallSides::Negative);
+        }
+        if (EnumHasAnyFlags(Open, EDungeonNeighbor::NegY))
+        {
+            WallEdges.Emplace(Cell - StepY, EDungeonWallAxis::Y, EDungeonWallSides::Positive);
+        }
     }
-    if (shouldSpawnNorthWall)//done
+}
+
+void ADungeonGenerator::BenchmarkWallExtraction()
+{
+    // On a copy, so this layout and what it spawned stay in sync
+    FDungeonLayout Scratch;
+    ConfigureLayout(Scratch);
+    Scratch.Generate();
+
+    // Same cells for both, only allocated chunks can hold corridors
+    const int32 NumRuns = 20;
+    int32 NumScanWalls = 0;
+    double StartTime = FPlatformTime::Seconds();
+    for (int32 Run = 0; Run < NumRuns; Run++)
     {
-        FVector WallLocation = CellLocation + FVector(0, -CellSize, 0);
-        SpawnWallTile(WallLocation,r3);
+        NumScanWalls = 0;
+        for (int32 Index = 0; Index < Scratch.GetNumCellIndices(); Index++)
+        {
+            if (!Scratch.Cells.IsChunkAllocated(Index >> TDungeonChunkedGrid<uint8>::ChunkCellBits))
+            {
+                Index += TDungeonChunkedGrid<uint8>::ChunkCells - 1;
+                continue;
+            }
+            if (Scratch.GetCell(Index) != EDungeonCell::Corridor)
+            {
+                continue;
+            }
+            const FIntVector Cell = Scratch.GetPositionFromIndex(Index);
+            for (const FIntVector& Direction : FlatDirections)
+            {
+                NumScanWalls += Scratch.HasCorridorWall(Cell, Direction) ? 1 : 0;
+            }
+        }
     }
-    if (shouldSpawnSouthWall)
+    const double ScanTime = (FPlatformTime::Seconds() - StartTime) / NumRuns;
+
+    StartTime = FPlatformTime::Seconds();
+    for (int32 Run = 0; Run < NumRuns; Run++)
     {
-        FVector WallLocation = CellLocation;
-        SpawnWallTile(WallLocation,r1);
+        Scratch.BuildWallEdges();
     }
+    const double MaskTime = (FPlatformTime::Seconds() - StartTime) / NumRuns;
 
-    SpawnFloorTile(CellLocation);
+    UE_LOG(LogTemp, Warning, TEXT("Wall extraction benchmark (%d of %d chunks allocated): per-cell tests %.3f ms, neighbor masks %.3f ms (%.1f KB), %d walls%s"),
+        Scratch.Cells.GetNumAllocatedChunks(), Scratch.Cells.GetNumChunks(), ScanTime * 1000.0, MaskTime * 1000.0,
+        Scratch.NeighborMasks.GetAllocatedSize() / 1024.0, Scratch.WallEdges.Num(),
+        NumScanWalls == Scratch.WallEdges.Num() ? TEXT("") : TEXT(", MISMATCH with per-cell tests"));
 }
 
+TArrayView<const FDungeonWallEdge> FDungeonLayout::GetWallEdges(int32 Chunk, int32 LocalZ) const
+{
+    const int32 Bucket = Chunk * TDungeonChunkedGrid<uint8>::ChunkSize + LocalZ;
+    return TArrayView<const FDungeonWallEdge>(WallEdges.GetData() + WallEdgeOffsets[Bucket], WallEdgeOffsets[Bucket + 1] - WallEdgeOffsets[Bucket]);
+}
 
-void ADungeonGenerator::InitializeGrid()
+int32 FDungeonLayout::GetWallEdgeChunk(int32 Edge) const
 {
-    Grid.SetNum(Width * Height*Length);
-    for (int32& Cell : Grid)
-    {
-        Cell = 0; // Initialize all grid cells to 0
-    }
+    // Edges belong to the chunk of the offset bucket holding them
+    return (Algo::UpperBound(WallEdgeOffsets, Edge) - 1) / TDungeonChunkedGrid<uint8>::ChunkSize;
+}
+
+
+void FDungeonLayout::InitializeGrid()
+{
+    DUNGEON_SCOPE(STAT_DungeonInitializeGrid);
+    // Every cell reads as empty without allocating anything, chunks appear as cells get written
+    Cells.Init(Width, Height, Length, static_cast<uint8>(EDungeonCell::Empty));
+    RoomIds.Init(Width, Height, Length, INDEX_NONE);
+    StairIds.Init(Width, Height, Length, INDEX_NONE);
+    CorridorUses.Init(Width, Height, Length, 0);
+    Corridors.Reset();
+    StairUses.Reset();
+    Occupancy.Reset(Width, Height, Length);
+    ClusterGraph.Reset();
+    bWallEdgesDirty = true;
 }
 
 void ADungeonGenerator::PlaceMeshes()
@@ -893,16 +3661,16 @@ void ADungeonGenerator::PlaceMeshes()
     FVector Origin = GetActorLocation();
     float TileSize = 100.0f;  // Assuming each tile is 100x100 units
 
-    for (int32 Y = 0; Y < Height; Y++)
+    for (int32 Y = 0; Y < Layout.Height; Y++)
     {
-        for (int32 X = 0; X < Width; X++)
+        for (int32 X = 0; X < Layout.Width; X++)
         {
-            int32 Index = Y * Width + X;
+            int32 Index = Layout.GetIndex(X, Y, 0);
             FVector Location = Origin + FVector(X * TileSize, Y * TileSize, 0);
             FRotator Rotation = FRotator(0, 0, 0);
             FActorSpawnParameters SpawnParams;
 
-          if (Grid[Index] == 1 && RoomMesh)  // Check if the grid cell is a room
+          if (Layout.GetCell(Index) == EDungeonCell::Room && RoomMesh)  // Check if the grid cell is a room
 				{
 					AStaticMeshActor* RoomActor = GetWorld()->SpawnActor<AStaticMeshActor>(Location, Rotation, SpawnParams);
 					if (RoomActor)
@@ -910,7 +3678,7 @@ void ADungeonGenerator::PlaceMeshes()
 						RoomActor->GetStaticMeshComponent()->SetStaticMesh(RoomMesh);
 					}
 				}
-				else if (Grid[Index] == 2 && CorridorMesh)  // Check if the grid cell is a corridor
+				else if (Layout.GetCell(Index) == EDungeonCell::Corridor && CorridorMesh)  // Check if the grid cell is a corridor
 				{
 					AStaticMeshActor* CorridorActor = GetWorld()->SpawnActor<AStaticMeshActor>(Location, Rotation, SpawnParams);
 					if (CorridorActor)
@@ -924,7 +3692,7 @@ void ADungeonGenerator::PlaceMeshes()
 
 void ADungeonGenerator::SpawnRoomWalls()
 {
-    for (const FRoom& Room : Rooms)
+    for (const FRoom& Room : Layout.Rooms)
     {
         // Calculate bounds for easier looping
         int32 MinX = Room.StartX;
@@ -943,11 +3711,11 @@ void ADungeonGenerator::SpawnRoomWalls()
                 {
                     if (x == MinX || x == MaxX || y == MinY || y == MaxY)
                     {
-                        FVector WallLocation(x, y, z);
+                        FIntVector WallLocation(x, y, z);
                         SpawnWallAt(WallLocation, true);  
                         // Don't spawn floor/ceiling walls unless it's the first/last layer
 
-                        UE_LOG(LogTemp, Warning, TEXT("Wall at Location: %s"), *WallLocation.ToString());
+                        UE_LOG(LogTemp, Verbose, TEXT("Wall at Location: %s"), *WallLocation.ToString());
                     }
                 }
             }
@@ -955,12 +3723,12 @@ void ADungeonGenerator::SpawnRoomWalls()
     }
 }
 
-void ADungeonGenerator::SpawnWallAt(const FVector& Location, bool bSpawnVerticalWalls)
+void ADungeonGenerator::SpawnWallAt(const FIntVector& Location, bool bSpawnVerticalWalls)
 {
     if (bSpawnVerticalWalls)
     {
         // Check if there's no room cell at this location (empty or corridor)
-        int32 Index = GetIndex(Location.X, Location.Y, Location.Z);
+        int32 Index = Layout.GetIndex(Location);
         
             FVector WorldLocation = GetWorldLocation(Location);
             // Assuming WallBlueprint is a UProperty that points to the wall's blueprint class
@@ -978,45 +3746,56 @@ void ADungeonGenerator::DrawDebugGrid()
     FVector BaseLocation = GetActorLocation(); // Base location of the dungeon generator actor // Size of each cell in units
     float Elevation = 400.0f;  // Height of one floor above another
 
-    for (int32 z = 0; z < Length; z++)
+    // Only chunks that were written to can hold anything worth drawing
+    for (int32 Chunk = 0; Chunk < Layout.Cells.GetNumChunks(); Chunk++)
     {
-        for (int32 y = 0; y < Height; y++)
+        if (!Layout.Cells.IsChunkAllocated(Chunk))
         {
-            for (int32 x = 0; x < Width; x++)
+            continue;
+        }
+        for (int32 Local = 0; Local < TDungeonChunkedGrid<uint8>::ChunkCells; Local++)
+        {
+            const int32 Index = (Chunk << TDungeonChunkedGrid<uint8>::ChunkCellBits) | Local;
+            const FIntVector Position = Layout.GetPositionFromIndex(Index);
+            const int32 x = Position.X, y = Position.Y, z = Position.Z;
+            if (!Layout.IsInGrid(Position))
             {
-                int32 Index = GetIndex(x, y, z);
-                FVector CellLocation = BaseLocation + FVector(x * CellSize, y * CellSize, z * Elevation);
-                FString IndexString = FString::Printf(TEXT("%d"), Index);
-                FString In= FString::Printf(TEXT("%d"), GetStairIndex(FVector(x,y,z)));  
+                continue;
+            }
 
-                if (Grid[Index] == 1)  // Room
-                {
-                    DrawDebugBox(GetWorld(), CellLocation, FVector(CellSize/2, CellSize/2, Elevation/2), FColor::Turquoise, true, -1.0f, 0, 5);
-                }
-                else if (Grid[Index] >= 2 && Grid[Index] <= 5)  // Corridor
-                {
-                    DrawDebugBox(GetWorld(), CellLocation, FVector(CellSize/2, CellSize/2, Elevation/2), FColor::Yellow, true, -1.0f, 0, 5);
-                    DrawDebugString(GetWorld(), CellLocation + FVector(0, 0, Elevation/2 + 10), IndexString, nullptr, FColor::White, -1.0f, true);
-                }
-                else if (Grid[Index] == 6)  // stairs
-                {
-                     FVector Direction = GetStaircaseDirectionFromIndex(FVector(x,y,z)); // Assume a helper function to get direction
-                        FVector ArrowHeadLocation = CellLocation + Direction*50.0f;  // Calculate where the arrow should point
-                          DrawDebugString(GetWorld(), CellLocation + FVector(0, 0, Elevation/2 + 10), In, nullptr, FColor::White, -1.0f, true);
-                        DrawDebugDirectionalArrow(GetWorld(), CellLocation + FVector(0, 0, Elevation), ArrowHeadLocation, -1.0f, FColor::Red, true, -1.0f, 0, 5);
+            FVector CellLocation = BaseLocation + FVector(x * CellSize, y * CellSize, z * Elevation);
+            FString IndexString = FString::Printf(TEXT("%d"), Index);
+            FString In= FString::Printf(TEXT("%d"), Layout.GetStairIndex(FIntVector(x,y,z)));  
 
-                     DrawDebugBox(GetWorld(), CellLocation, FVector(CellSize/2, CellSize/2, Elevation/2), FColor::Blue, true, -1, 0, 5);
-                       // Adjusted duration
-                }
+            const EDungeonCell Type = Layout.GetCell(Index);
+            if (Type == EDungeonCell::Room)  // Room
+            {
+                DrawDebugBox(GetWorld(), CellLocation, FVector(CellSize/2, CellSize/2, Elevation/2), FColor::Turquoise, true, -1.0f, 0, 5);
+                DrawDebugString(GetWorld(), CellLocation + FVector(0, 0, Elevation/2 + 10), FString::Printf(TEXT("R%d"), Layout.RoomIds.Get(Index)), nullptr, FColor::Turquoise, -1.0f, true);
+            }
+            else if (Type == EDungeonCell::Corridor || Type == EDungeonCell::Door || Type == EDungeonCell::Exit)  // Corridor
+            {
+                DrawDebugBox(GetWorld(), CellLocation, FVector(CellSize/2, CellSize/2, Elevation/2), FColor::Yellow, true, -1.0f, 0, 5);
+                DrawDebugString(GetWorld(), CellLocation + FVector(0, 0, Elevation/2 + 10), IndexString, nullptr, FColor::White, -1.0f, true);
+            }
+            else if (Type == EDungeonCell::Stair)  // stairs
+            {
+                 FVector Direction(Layout.GetStaircaseDirectionFromIndex(FIntVector(x,y,z))); // Assume a helper function to get direction
+                    FVector ArrowHeadLocation = CellLocation + Direction*50.0f;  // Calculate where the arrow should point
+                      DrawDebugString(GetWorld(), CellLocation + FVector(0, 0, Elevation/2 + 10), In, nullptr, FColor::White, -1.0f, true);
+                    DrawDebugDirectionalArrow(GetWorld(), CellLocation + FVector(0, 0, Elevation), ArrowHeadLocation, -1.0f, FColor::Red, true, -1.0f, 0, 5);
+
+                 DrawDebugBox(GetWorld(), CellLocation, FVector(CellSize/2, CellSize/2, Elevation/2), FColor::Blue, true, -1, 0, 5);
+                   // Adjusted duration
             }
         }
     }
 
     // Optionally draw labels for direction indicators at grid edges
-    FVector NorthLabelLocation = BaseLocation + FVector(Width * CellSize / 2, -CellSize, Length * Elevation / 2);
-    FVector SouthLabelLocation = BaseLocation + FVector(Width * CellSize / 2, Height * CellSize + CellSize, Length * Elevation / 2);
-    FVector EastLabelLocation  = BaseLocation + FVector(Width * CellSize + CellSize, Height * CellSize / 2, Length * Elevation / 2);
-    FVector WestLabelLocation  = BaseLocation + FVector(-CellSize, Height * CellSize / 2, Length * Elevation / 2);
+    FVector NorthLabelLocation = BaseLocation + FVector(Layout.Width * CellSize / 2, -CellSize, Layout.Length * Elevation / 2);
+    FVector SouthLabelLocation = BaseLocation + FVector(Layout.Width * CellSize / 2, Layout.Height * CellSize + CellSize, Layout.Length * Elevation / 2);
+    FVector EastLabelLocation  = BaseLocation + FVector(Layout.Width * CellSize + CellSize, Layout.Height * CellSize / 2, Layout.Length * Elevation / 2);
+    FVector WestLabelLocation  = BaseLocation + FVector(-CellSize, Layout.Height * CellSize / 2, Layout.Length * Elevation / 2);
 
     DrawDebugString(GetWorld(), NorthLabelLocation, "N", nullptr, FColor::Red, -1.0f, true);
     DrawDebugString(GetWorld(), SouthLabelLocation, "S", nullptr, FColor::Red, -1.0f, true);
@@ -1024,20 +3803,15 @@ void ADungeonGenerator::DrawDebugGrid()
     DrawDebugString(GetWorld(), WestLabelLocation, "W", nullptr, FColor::Red, -1.0f, true);
 }
 
-void ADungeonGenerator::PlaceMultipleRooms(int32 NumberOfRooms)
+void FDungeonLayout::PlaceMultipleRooms(int32 NumberOfRooms)
 {
+    DUNGEON_SCOPE(STAT_DungeonPlaceRooms);
+    FRandomStream Random = MakeRandomStream(EDungeonRandomStream::Rooms);
     int32 Attempts = 0;
     int32 PlacedRooms = 0;
 
     while (PlacedRooms < NumberOfRooms && Attempts < NumberOfRooms * 10) {
-        FRoom NewRoom;
-        NewRoom.Width = FMath::RandRange(minRoomsize, maxRoomsize);
-        NewRoom.Height = FMath::RandRange(minRoomsize, minRoomsize);
-        NewRoom.Length = FMath::RandRange(1, 1);  // Rooms can span between 1 and 3 levels
-
-        NewRoom.StartX = FMath::RandRange(0, Width - NewRoom.Width);
-        NewRoom.StartY = FMath::RandRange(0, Height - NewRoom.Height);
-        NewRoom.StartZ = FMath::RandRange(0, Length - NewRoom.Length);
+        FRoom NewRoom = MakeRandomRoom(Random);
 
         if (CanPlaceRoom(NewRoom)) {
             PlaceRoom(NewRoom);
@@ -1046,12 +3820,108 @@ void ADungeonGenerator::PlaceMultipleRooms(int32 NumberOfRooms)
         Attempts++;
     }
 }
-int32 ADungeonGenerator::GetIndex(int32 x, int32 y, int32 z)
+
+FRoom FDungeonLayout::MakeRandomRoom(FRandomStream& Random) const
+{
+    FRoom NewRoom;
+    NewRoom.Width = Random.RandRange(minRoomsize, maxRoomsize);
+    NewRoom.Height = Random.RandRange(minRoomsize, minRoomsize);
+    NewRoom.Length = Random.RandRange(1, 1);  // Rooms can span between 1 and 3 levels
+
+    NewRoom.StartX = Random.RandRange(0, Width - NewRoom.Width);
+    NewRoom.StartY = Random.RandRange(0, Height - NewRoom.Height);
+    NewRoom.StartZ = Random.RandRange(0, Length - NewRoom.Length);
+    return NewRoom;
+}
+
+FRandomStream FDungeonLayout::MakeRandomStream(EDungeonRandomStream Stream, int32 Item) const
+{
+    return FRandomStream(int32(MixSeed(MixSeed(uint32(Seed), int32(Stream)), Item)));
+}
+
+uint32 FDungeonLayout::MixSeed(uint32 InSeed, int32 Value)
+{
+    uint32 Hash = InSeed ^ (uint32(Value) * 0x9E3779B9u);
+    Hash ^= Hash >> 16;
+    Hash *= 0x85EBCA6Bu;
+    Hash ^= Hash >> 13;
+    Hash *= 0xC2B2AE35u;
+    Hash ^= Hash >> 16;
+    return Hash;
+}
+void FDungeonLayout::SetCell(int32 Index, EDungeonCell Type)
+{
+    const EDungeonCell Previous = GetCell(Index);
+    if (Previous == EDungeonCell::Empty && Type != EDungeonCell::Empty)
+    {
+        Occupancy.Add(GetPositionFromIndex(Index), 1);
+    }
+    else if (Previous != EDungeonCell::Empty && Type == EDungeonCell::Empty)
+    {
+        Occupancy.Add(GetPositionFromIndex(Index), -1);
+    }
+
+    EDungeonCellFlags Flags = GetCellFlags(Index);
+    switch (Type)
+    {
+    case EDungeonCell::Corridor: Flags |= EDungeonCellFlags::Corridor; break;
+    case EDungeonCell::Door: Flags |= EDungeonCellFlags::Door; break;
+    case EDungeonCell::Stair: Flags |= EDungeonCellFlags::Stair; break;
+    default: break;
+    }
+    Cells.Set(Index, static_cast<uint8>(Flags) | static_cast<uint8>(Type));
+    bWallEdgesDirty = true;
+}
+
+EDungeonCell FDungeonLayout::GetCellAt(const FIntVector& GridPosition) const
+{
+    if (!IsInGrid(GridPosition) || !IsGridInitialized())
+    {
+        return EDungeonCell::Empty;
+    }
+    return GetCell(GridPosition);
+}
+
+TArray<int32> FDungeonLayout::GetGrid() const
+{
+    // The old array was laid out x fastest, then y, then z
+    TArray<int32> Grid;
+    if (!IsGridInitialized())
+    {
+        return Grid;
+    }
+    Grid.Reserve(Width * Height * Length);
+    for (int32 z = 0; z < Length; z++)
+    {
+        for (int32 y = 0; y < Height; y++)
+        {
+            for (int32 x = 0; x < Width; x++)
+            {
+                Grid.Add(static_cast<int32>(GetCell(GetIndex(x, y, z))));
+            }
+        }
+    }
+    return Grid;
+}
+
+bool FDungeonLayout::CanPlaceRoom(const FRoom& Room) 
 {
-    return x + y * Width + z * Width * Height;
+    if (Room.Width <= 0 || Room.Height <= 0 || Room.Length <= 0)
+    {
+        return true;  // No cells to check
+    }
+
+    const FIntVector Min(Room.StartX, Room.StartY, Room.StartZ);
+    const FIntVector Max(Room.StartX + Room.Width, Room.StartY + Room.Height, Room.StartZ + Room.Length);
+    if (!IsInGrid(Min) || !IsInGrid(Max - FIntVector(1, 1, 1)) || Occupancy.CountInBox(Min, Max) != 0)
+    {
+        INC_DWORD_STAT(STAT_DungeonRoomsRejected);
+        return false;  // Out of the grid bounds or overlapping something
+    }
+    return true;
 }
 
-bool ADungeonGenerator::CanPlaceRoom(const FRoom& Room) 
+bool FDungeonLayout::CanPlaceRoomByScan(const FRoom& Room) const
 {
     for (int z = Room.StartZ; z < Room.StartZ + Room.Length; ++z) {
         for (int y = Room.StartY; y < Room.StartY + Room.Height; ++y) {
@@ -1061,7 +3931,7 @@ bool ADungeonGenerator::CanPlaceRoom(const FRoom& Room)
                 }
                 int32 Index = GetIndex(x, y, z);
               
-                if (Grid[Index] != 0) {
+                if (GetCell(Index) != EDungeonCell::Empty) {
                     return false;  // Check if the cell is already occupied
                 }
             }
@@ -1070,13 +3940,153 @@ bool ADungeonGenerator::CanPlaceRoom(const FRoom& Room)
     return true;
 }
 
-void ADungeonGenerator::PlaceRoom(const FRoom& Room)
+void FDungeonOccupancy::Reset(int32 InWidth, int32 InHeight, int32 InLength)
+{
+    ChunksX = FMath::DivideAndRoundUp(InWidth, ChunkSize);
+    ChunksY = FMath::DivideAndRoundUp(InHeight, ChunkSize);
+    Chunks.Empty();
+    Chunks.SetNum(ChunksX * ChunksY * FMath::DivideAndRoundUp(InLength, ChunkSize));
+}
+
+void FDungeonOccupancy::Add(const FIntVector& Cell, int32 Delta)
+{
+    TUniquePtr<FChunkTree>& Tree = Chunks[(Cell.X >> ChunkSizeBits) + ((Cell.Y >> ChunkSizeBits) + (Cell.Z >> ChunkSizeBits) * ChunksY) * ChunksX];
+    if (!Tree.IsValid())
+    {
+        Tree = MakeUnique<FChunkTree>();
+    }
+
+    // Counts wrap like any uint16, but every node ends up holding a real count between 0 and 4096
+    for (int32 X = (Cell.X & (ChunkSize - 1)) + 1; X < TreeSize; X += X & -X)
+    {
+        for (int32 Y = (Cell.Y & (ChunkSize - 1)) + 1; Y < TreeSize; Y += Y & -Y)
+        {
+            for (int32 Z = (Cell.Z & (ChunkSize - 1)) + 1; Z < TreeSize; Z += Z & -Z)
+            {
+                Tree->Counts[X + (Y + Z * TreeSize) * TreeSize] += Delta;
+            }
+        }
+    }
+}
+
+int32 FDungeonOccupancy::Prefix(const FChunkTree& Tree, int32 X, int32 Y, int32 Z)
+{
+    int32 Sum = 0;
+    for (int32 IX = X; IX > 0; IX -= IX & -IX)
+    {
+        for (int32 IY = Y; IY > 0; IY -= IY & -IY)
+        {
+            for (int32 IZ = Z; IZ > 0; IZ -= IZ & -IZ)
+            {
+                Sum += Tree.Counts[IX + (IY + IZ * TreeSize) * TreeSize];
+            }
+        }
+    }
+    return Sum;
+}
+
+int32 FDungeonOccupancy::CountInBox(const FIntVector& Min, const FIntVector& Max) const
+{
+    int32 Count = 0;
+    const FIntVector MinChunk(Min.X >> ChunkSizeBits, Min.Y >> ChunkSizeBits, Min.Z >> ChunkSizeBits);
+    const FIntVector MaxChunk((Max.X - 1) >> ChunkSizeBits, (Max.Y - 1) >> ChunkSizeBits, (Max.Z - 1) >> ChunkSizeBits);
+    for (int32 CZ = MinChunk.Z; CZ <= MaxChunk.Z; CZ++)
+    {
+        for (int32 CY = MinChunk.Y; CY <= MaxChunk.Y; CY++)
+        {
+            for (int32 CX = MinChunk.X; CX <= MaxChunk.X; CX++)
+            {
+                const FChunkTree* Tree = Chunks[CX + (CY + CZ * ChunksY) * ChunksX].Get();
+                if (!Tree)
+                {
+                    continue;  // Nothing was ever placed in this chunk
+                }
+
+                // The part of the box inside this chunk, in chunk coordinates
+                const FIntVector Origin = FIntVector(CX, CY, CZ) * ChunkSize;
+                const FIntVector Lo(FMath::Max(Min.X - Origin.X, 0), FMath::Max(Min.Y - Origin.Y, 0), FMath::Max(Min.Z - Origin.Z, 0));
+                const FIntVector Hi(FMath::Min(Max.X - Origin.X, ChunkSize), FMath::Min(Max.Y - Origin.Y, ChunkSize), FMath::Min(Max.Z - Origin.Z, ChunkSize));
+
+                // Inclusion-exclusion over the 8 corners
+                Count += Prefix(*Tree, Hi.X, Hi.Y, Hi.Z)
+                    - Prefix(*Tree, Lo.X, Hi.Y, Hi.Z) - Prefix(*Tree, Hi.X, Lo.Y, Hi.Z) - Prefix(*Tree, Hi.X, Hi.Y, Lo.Z)
+                    + Prefix(*Tree, Lo.X, Lo.Y, Hi.Z) + Prefix(*Tree, Lo.X, Hi.Y, Lo.Z) + Prefix(*Tree, Hi.X, Lo.Y, Lo.Z)
+                    - Prefix(*Tree, Lo.X, Lo.Y, Lo.Z);
+            }
+        }
+    }
+    return Count;
+}
+
+void ADungeonGenerator::BenchmarkRoomPlacement()
+{
+    const float FillRatios[] = { 0.1f, 0.25f, 0.5f, 0.75f };
+    const int32 NumTests = 100000;
+
+    // On a copy, so this layout and what it spawned stay in sync
+    FDungeonLayout Scratch;
+    ConfigureLayout(Scratch);
+
+    // Same rooms and tests every run for the current Seed, so runs on different builds compare directly
+    FRandomStream Random = Scratch.MakeRandomStream(EDungeonRandomStream::Rooms);
+
+    for (float FillRatio : FillRatios)
+    {
+        Scratch.InitializeGrid();
+        Scratch.Rooms.Empty();
+        Scratch.Stairs.Empty();
+
+        // Place rooms until the target share of cells is taken or attempts run out
+        int32 FilledCells = 0;
+        for (int32 Attempt = 0; Attempt < NumTests && FilledCells < FillRatio * Scratch.Width * Scratch.Height * Scratch.Length; Attempt++)
+        {
+            const FRoom Room = Scratch.MakeRandomRoom(Random);
+            if (Scratch.CanPlaceRoom(Room))
+            {
+                Scratch.PlaceRoom(Room);
+                FilledCells += Room.Width * Room.Height * Room.Length;
+            }
+        }
+
+        TArray<FRoom> TestRooms;
+        TestRooms.Reserve(NumTests);
+        for (int32 i = 0; i < NumTests; i++)
+        {
+            TestRooms.Add(Scratch.MakeRandomRoom(Random));
+        }
+
+        int32 NumFree = 0;
+        double StartTime = FPlatformTime::Seconds();
+        for (const FRoom& Room : TestRooms)
+        {
+            NumFree += Scratch.CanPlaceRoomByScan(Room) ? 1 : 0;
+        }
+        const double ScanTime = FPlatformTime::Seconds() - StartTime;
+
+        int32 NumFreeTable = 0;
+        StartTime = FPlatformTime::Seconds();
+        for (const FRoom& Room : TestRooms)
+        {
+            NumFreeTable += Scratch.CanPlaceRoom(Room) ? 1 : 0;
+        }
+        const double TableTime = FPlatformTime::Seconds() - StartTime;
+
+        UE_LOG(LogTemp, Warning, TEXT("Room placement benchmark at %.0f%% fill (%.1f%% reached, %d rooms): cell scan %.0f tests/s, occupancy table %.0f tests/s, %d of %d fit%s"),
+            FillRatio * 100.0f, 100.0f * FilledCells / (Scratch.Width * Scratch.Height * Scratch.Length), Scratch.Rooms.Num(),
+            ScanTime > 0.0 ? NumTests / ScanTime : 0.0, TableTime > 0.0 ? NumTests / TableTime : 0.0,
+            NumFreeTable, NumTests, NumFree == NumFreeTable ? TEXT("") : TEXT(", MISMATCH with cell scan"));
+    }
+}
+
+void FDungeonLayout::PlaceRoom(const FRoom& Room)
 {
+    const int32 RoomId = Rooms.Num();
     for (int z = Room.StartZ; z < Room.StartZ + Room.Length; ++z) {
         for (int y = Room.StartY; y < Room.StartY + Room.Height; ++y) {
             for (int x = Room.StartX; x < Room.StartX + Room.Width; ++x) {
                 int32 Index = GetIndex(x, y, z);
-                Grid[Index] = 1;  // Assume '1' marks cells occupied by rooms
+                SetCell(Index, EDungeonCell::Room);
+                RoomIds.Set(Index, RoomId);
             }
         }
     }
@@ -1084,22 +4094,23 @@ void ADungeonGenerator::PlaceRoom(const FRoom& Room)
 }
 
 
-void ADungeonGenerator::FinalizeDungeon()
+void FDungeonLayout::FinalizeDungeon()
 {
     // Set the entry point
-    Grid[0] = 3;  // 3 could signify an entry point
+    SetCell(GetIndex(0, 0, 0), EDungeonCell::Door);  // Door could signify an entry point
 
     // Set the exit point
-    Grid[Width * Height - 1] = 4;  // 4 could signify an exit point
+    SetCell(GetIndex(Width - 1, Height - 1, 0), EDungeonCell::Exit);
 
     // Potentially place other elements like traps (5) and treasure (6)
+    FRandomStream Random = MakeRandomStream(EDungeonRandomStream::Finalize);
     for (const FRoom& Room : Rooms)
     {
-        if (FMath::RandBool())  // Random chance to place a treasure
+        if (Random.RandRange(0, 1) == 1)  // Random chance to place a treasure
         {
-            int32 TreasureX = FMath::RandRange(Room.StartX, Room.StartX + Room.Width - 1);
-            int32 TreasureY = FMath::RandRange(Room.StartY, Room.StartY + Room.Height - 1);
-            Grid[TreasureY * Width + TreasureX] = 6;
+            int32 TreasureX = Random.RandRange(Room.StartX, Room.StartX + Room.Width - 1);
+            int32 TreasureY = Random.RandRange(Room.StartY, Room.StartY + Room.Height - 1);
+            SetCell(GetIndex(TreasureX, TreasureY, 0), EDungeonCell::Stair);
         }
     }
 }
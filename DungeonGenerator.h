@@ -4,29 +4,306 @@
 
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
+#include "DungeonClusterGraph.h"
+#include "DungeonChunkedGrid.h"
+#include "DungeonNeighborMasks.h"
+#include "Async/Future.h"
+#include "Stats/Stats.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include <atomic>
 #include "DungeonGenerator.generated.h"
 
+// stat DungeonGen: generation stages, searches and what they cost
+DECLARE_STATS_GROUP(TEXT("DungeonGen"), STATGROUP_DungeonGen, STATCAT_Advanced);
 
-struct FAStarNode
+// Cycle stat for stat DungeonGen plus a named event for Unreal Insights, which shows up whether or not stats are compiled in
+#define DUNGEON_SCOPE(Stat) SCOPE_CYCLE_COUNTER(Stat); TRACE_CPUPROFILER_EVENT_SCOPE(Stat)
+
+class UStaticMesh;
+class UHierarchicalInstancedStaticMeshComponent;
+class UProceduralMeshComponent;
+class UMaterialInterface;
+
+// What a grid cell holds. The values are the ones the int32 grid used
+UENUM(BlueprintType)
+enum class EDungeonCell : uint8
+{
+    Empty = 0,
+    Room = 1,
+    Corridor = 2,
+    Door = 3,
+    Exit = 4,
+    Stair = 6,
+};
+
+// Bits above the cell type in each cell byte of FDungeonLayout::Cells. They remember every role a cell has had
+// since InitializeGrid, so a staircase or door cell still shows it was part of a corridor
+enum class EDungeonCellFlags : uint8
+{
+    None = 0,
+    Door = 1 << 4,
+    Stair = 1 << 5,
+    Corridor = 1 << 6,
+};
+ENUM_CLASS_FLAGS(EDungeonCellFlags);
+
+// Low bits of a cell byte, the EDungeonCell value
+constexpr uint8 DungeonCellTypeMask = 0x0F;
+
+UENUM(BlueprintType)
+enum class EDungeonGenerationStage : uint8
+{
+    Idle,
+    InitializingGrid,
+    PlacingRooms,
+    BuildingConnections,
+    RoutingCorridors,
+    Spawning,
+    Complete
+};
+
+// Independent random sequences of one generation. Each is seeded from FDungeonLayout::Seed and its own value,
+// so extra draws in one stage never shift what another stage gets
+enum class EDungeonRandomStream : uint8
+{
+    Rooms,
+    Finalize,
+};
+
+DECLARE_DYNAMIC_MULTICAST_DELEGATE(FOnDungeonGenerated);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FOnDungeonGenerationProgress, EDungeonGenerationStage, Stage, float, Progress);
+
+// How SpawnDungeonEnvironment turns the grid into geometry
+UENUM(BlueprintType)
+enum class EDungeonRenderMode : uint8
+{
+    // One actor per floor, wall and stair tile from FloorTileClass, WallClass and StairBlueprint/StairBlueprint2
+    Actors,
+    // Instances on hierarchical instanced static mesh components owned by the generator, one per mesh, z-level and grid chunk
+    InstancedMeshes,
+    // Room and corridor floors and corridor walls greedily merged into large quads, one procedural mesh component
+    // per grid chunk with a floor and a wall section per z-level and box collision per quad. Stairs stay actors
+    MergedMeshes
+};
+
+
+// Per-search A* bookkeeping indexed by grid cell (GetIndex), stored in pages that line up with the grid chunks
+// and are only allocated once the search reaches them. A cell only holds data for the current search when its
+// Stamp matches Generation, so a new search is a counter bump instead of clearing pages or hashing positions.
+struct FDungeonSearchState
+{
+    enum : uint8
+    {
+        Flag_Stair = 1 << 0,          // Reached by climbing a staircase
+        Flag_StairCorridor = 1 << 1,  // Landing cell right after a staircase, part of the staircase
+        DirectionShift = 2,           // Bits above this hold the stair direction code
+    };
+
+    // Starts a new search over cell indices below NumCells
+    void Begin(int32 NumCells);
+
+    // Frees the pages, the next searches reallocate them
+    void Empty();
+
+    bool IsVisited(int32 Cell) const
+    {
+        const FPage* Page = Pages[Cell >> PageBits].Get();
+        return Page && Page->Stamp[Cell & PageMask] == Generation;
+    }
+
+    // First time a cell is reached in the current search
+    void Visit(int32 Cell, float G, float H, int32 ParentCell, uint8 CellFlags);
+
+    // Only valid for visited cells
+    float GetGCost(int32 Cell) const { return GetPage(Cell).GCost[Cell & PageMask]; }
+    int32 GetParent(int32 Cell) const { return GetPage(Cell).Parent[Cell & PageMask]; }
+
+    // Cheaper path to an already visited cell
+    void Reparent(int32 Cell, int32 ParentCell, float G)
+    {
+        FPage& Page = GetPage(Cell);
+        Page.Parent[Cell & PageMask] = ParentCell;
+        Page.GCost[Cell & PageMask] = G;
+    }
+
+    bool IsStair(int32 Cell) const { return (GetPage(Cell).Flags[Cell & PageMask] & Flag_Stair) != 0; }
+    bool IsStairCorridor(int32 Cell) const { return (GetPage(Cell).Flags[Cell & PageMask] & Flag_StairCorridor) != 0; }
+    FIntVector GetStairDirection(int32 Cell) const { return DecodeDirection(GetPage(Cell).Flags[Cell & PageMask] >> DirectionShift); }
+
+    // Packs one of the stair or step directions FindPath records into a small code
+    static uint8 EncodeDirection(const FIntVector& Direction);
+    static FIntVector DecodeDirection(uint8 Code);
+
+    // Open set: indexed binary min-heap on FCost, then HCost, then insertion order
+    void PushOpen(int32 Cell);
+    int32 PopOpen();
+    // Call after lowering the cell's GCost, only re-prioritizes cells still in the open set
+    void DecreaseKey(int32 Cell);
+    int32 NumOpen() const { return Heap.Num(); }
+
+    // Re-sort the whole open set on every pop like the original implementation, only used as a benchmark baseline
+    bool bSortedArrayBaseline = false;
+
+    // Nodes popped from the open set by the current search
+    int32 NodesExpanded = 0;
+
+    // Largest the open set got during the current search
+    int32 PeakOpen = 0;
+
+    // Neighbors the current search checked against their visited state and cost
+    int32 NeighborTests = 0;
+
+    // When set, neighbors outside the mask are skipped. Used to refine a hierarchical path inside its clusters
+    const TBitArray<>* AllowedCells = nullptr;
+
+    // Lowest FCost of a neighbor skipped because of AllowedCells. Any path leaving the mask costs at least this much
+    float MinPrunedFCost = MAX_flt;
+
+private:
+    static constexpr int32 PageBits = TDungeonChunkedGrid<uint8>::ChunkCellBits;
+    static constexpr int32 PageCells = 1 << PageBits;
+    static constexpr int32 PageMask = PageCells - 1;
+
+    struct FPage
+    {
+        uint32 Stamp[PageCells];
+        float GCost[PageCells];
+        float HCost[PageCells];
+        int32 Parent[PageCells];
+        int32 HeapIndex[PageCells];
+        uint8 Flags[PageCells];
+    };
+
+    FPage& GetPage(int32 Cell) const { return *Pages[Cell >> PageBits]; }
+
+    struct FOpenEntry
+    {
+        float FCost;
+        float HCost;
+        uint32 Sequence;
+        int32 Cell;
+    };
+
+    static bool Less(const FOpenEntry& A, const FOpenEntry& B)
+    {
+        if (A.FCost != B.FCost) return A.FCost < B.FCost;
+        if (A.HCost != B.HCost) return A.HCost < B.HCost;
+        return A.Sequence < B.Sequence;
+    }
+
+    void SiftUp(int32 Index);
+    void SiftDown(int32 Index);
+    void Place(const FOpenEntry& Entry, int32 Index);
+
+    TArray<TUniquePtr<FPage>> Pages;
+    TArray<FOpenEntry> Heap;
+    uint32 Generation = 0;
+    uint32 NextSequence = 0;
+};
+
+// Count of occupied (non-empty) grid cells per box. Every grid chunk holding an occupied cell gets a 16^3 Fenwick
+// tree, a summed-volume table that takes O(log^3 16) per changed cell instead of a rebuild. A box query adds up the
+// chunks it overlaps and skips the ones that were never occupied
+struct FDungeonOccupancy
+{
+    void Reset(int32 InWidth, int32 InHeight, int32 InLength);
+
+    // Delta is +1 when a cell becomes occupied, -1 when it is cleared
+    void Add(const FIntVector& Cell, int32 Delta);
+
+    // Occupied cells in [Min, Max), both corners inside the grid
+    int32 CountInBox(const FIntVector& Min, const FIntVector& Max) const;
+
+private:
+    static constexpr int32 ChunkSizeBits = TDungeonChunkedGrid<uint8>::ChunkSizeBits;
+    static constexpr int32 ChunkSize = TDungeonChunkedGrid<uint8>::ChunkSize;
+    static constexpr int32 TreeSize = ChunkSize + 1;
+
+    // 1-based Fenwick tree over one chunk. Node sums never exceed the 4096 cells of a chunk
+    struct FChunkTree
+    {
+        uint16 Counts[TreeSize * TreeSize * TreeSize];
+    };
+
+    // Occupied cells in [0, X) x [0, Y) x [0, Z) of one chunk
+    static int32 Prefix(const FChunkTree& Tree, int32 X, int32 Y, int32 Z);
+
+    TArray<TUniquePtr<FChunkTree>> Chunks;
+    int32 ChunksX = 0;
+    int32 ChunksY = 0;
+};
+
+// Corridor searched ahead of placement, together with what it needs to check it is still valid
+struct FDungeonRoute
+{
+    TArray<FIntVector> Path;
+
+    // Cells expanded by the search. The result only depends on grid values next to these
+    TArray<int32> ExpandedCells;
+};
+
+// Corridor placed for one MST edge. Kept after routing so FDungeonLayout::UpdateRoom can take it out of the
+// grid and route it again without touching the other corridors
+struct FDungeonCorridor
+{
+    int32 RoomIndexA = INDEX_NONE;
+    int32 RoomIndexB = INDEX_NONE;
+
+    // FindPath result, empty when no path was found
+    TArray<FIntVector> Path;
+
+    // Indices into Stairs of the staircases the path placed
+    TArray<int32> StairIndices;
+};
+
+// Mesh, z-level and grid chunk of one instanced component. Per chunk, so a respawned chunk replaces its own
+// components and leaves the instances of every other chunk alone
+struct FDungeonInstanceKey
 {
-    FVector Position;  // Using FVector for grid positions
-    float GCost;       // Cost from start node to this node
-    float HCost;       // Heuristic cost from this node to end node
-    float FCost() const { return GCost + HCost; }  // Total cost
-    FAStarNode* CameFrom;  // Parent node in the path
-
-    bool Istair = false;
-    bool IsStaircorridor = false;//Corridor that is part of the a staircase
-    FVector StairDirection;
-    // Constructors
-    FAStarNode(FVector Pos = FVector::ZeroVector, float G = FLT_MAX, float H = FLT_MAX, FAStarNode* Parent = nullptr)
-        : Position(Pos), GCost(G), HCost(H), CameFrom(Parent) {}
-
-    // Needed for sorting TArray
-    bool operator<(const FAStarNode& Other) const
+    UStaticMesh* Mesh = nullptr;
+    int32 Level = 0;
+    int32 Chunk = INDEX_NONE;
+
+    bool operator==(const FDungeonInstanceKey& Other) const
     {
-        return FCost() < Other.FCost();
+        return Mesh == Other.Mesh && Level == Other.Level && Chunk == Other.Chunk;
     }
+
+    friend uint32 GetTypeHash(const FDungeonInstanceKey& Key)
+    {
+        return HashCombine(HashCombine(GetTypeHash(Key.Mesh), GetTypeHash(Key.Level)), GetTypeHash(Key.Chunk));
+    }
+};
+
+// One layout of ADungeonGenerator::GenerateLayoutBatch
+struct FDungeonBatchLayoutStats
+{
+    // Seed the layout was generated with, set it on a generator with the same settings to get the layout again
+    int32 Seed = 0;
+
+    double GenerationMs = 0.0;
+    int32 NumRooms = 0;
+    int32 NumStairs = 0;
+
+    // MST edges no corridor could be found for
+    int32 NumFailedConnections = 0;
+
+    int64 NodesExpanded = 0;
+
+    // Every requested room placed and every MST edge routed
+    bool bSucceeded = false;
+};
+
+// Totals over one ADungeonGenerator::GenerateLayoutBatch
+struct FDungeonBatchSummary
+{
+    int32 NumLayouts = 0;
+    int32 NumFailed = 0;
+    double WallSeconds = 0.0;
+    double LayoutsPerSecond = 0.0;
+    double MeanGenerationMs = 0.0;
+    double MaxGenerationMs = 0.0;
+    int64 NodesExpanded = 0;
 };
 
 USTRUCT()
@@ -46,11 +323,16 @@ public:
     UPROPERTY()
     float Distance;
 
+    // Exact squared Distance in half cells, what connections are ordered by so float rounding can't reorder them
+    int64 DistanceKey = 0;
+
     FRoomConnection(int32 a = 0, int32 b = 0, float dist = 0.0f) : RoomIndexA(a), RoomIndexB(b), Distance(dist) {}
 
+    // Total order: distance, then room indices. Kruskal on any edge set containing the MST picks the same edges in the same order
     bool operator<(const FRoomConnection& Other) const {
-        return Distance < Other.Distance;
-        
+        if (DistanceKey != Other.DistanceKey) return DistanceKey < Other.DistanceKey;
+        if (RoomIndexA != Other.RoomIndexA) return RoomIndexA < Other.RoomIndexA;
+        return RoomIndexB < Other.RoomIndexB;
     }
 
       
@@ -58,6 +340,48 @@ public:
 
 
 
+// Axis a wall edge's face is perpendicular to
+enum class EDungeonWallAxis : uint8
+{
+    // Between a cell and the cell at +X
+    X,
+    // Between a cell and the cell at +Y
+    Y
+};
+
+// Sides of a wall edge that need a wall, the corridor cells facing it
+enum class EDungeonWallSides : uint8
+{
+    None = 0,
+    Negative = 1 << 0,
+    Positive = 1 << 1,
+    Both = Negative | Positive
+};
+ENUM_CLASS_FLAGS(EDungeonWallSides);
+
+// One wall face between two horizontally adjacent cells, keyed by the cell on its negative side so a face shared
+// by two cells is a single edge. That cell may be one step outside the grid for walls on its -X or -Y border
+struct FDungeonWallEdge
+{
+    int16 X = 0;
+    int16 Y = 0;
+    int16 Z = 0;
+    EDungeonWallAxis Axis = EDungeonWallAxis::X;
+    EDungeonWallSides Sides = EDungeonWallSides::None;
+
+    FDungeonWallEdge() {}
+
+    FDungeonWallEdge(const FIntVector& InCell, EDungeonWallAxis InAxis, EDungeonWallSides InSides)
+        : X(int16(InCell.X)), Y(int16(InCell.Y)), Z(int16(InCell.Z)), Axis(InAxis), Sides(InSides)
+    {
+    }
+
+    FIntVector GetCell() const { return FIntVector(X, Y, Z); }
+
+    // Step from GetCell to the cell on the positive side of the face
+    FIntVector GetStep() const { return Axis == EDungeonWallAxis::X ? FIntVector(1, 0, 0) : FIntVector(0, 1, 0); }
+};
+
 USTRUCT(BlueprintType)
 struct FStair
 {
@@ -65,19 +389,19 @@ struct FStair
 
 public:
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Stair")
-    TArray<FVector> StairCells;  // Locations of the stair cells that make up the staircase
+    TArray<FIntVector> StairCells;  // Grid cells that make up the staircase
       UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Stair")
-    FVector Direction;  // Direction of the staircase
+    FIntVector Direction = FIntVector::ZeroValue;  // Direction of the staircase, (+-2, 0, +-1) or (0, +-2, +-1)
 
      UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Stair")
-      TArray<FVector> EndPoints;  
+      TArray<FIntVector> EndPoints;  
 
     FStair() {}
 
     // Helper function to add cells to the staircase
     void AddStairCell(int32 X, int32 Y, int32 Z)
     {
-        StairCells.Add(FVector(X, Y, Z));
+        StairCells.Add(FIntVector(X, Y, Z));
     }
 };
 
@@ -118,13 +442,310 @@ public:
     }
 
     FRoom(int32 x = 0, int32 y = 0, int32 w = 1, int32 h = 1) 
-        : StartX(x), StartY(y), Width(w), Height(h), 
+        : StartX(x), StartY(y), StartZ(0), Width(w), Height(h), Length(1), 
           EntryPoint(FVector((x + (w - 1)/2), (y + (h-1)/2), 0)),  // Midpoint of the left wall
           ExitPoint(FVector((x + (w - 1)/2), (y + (h-1)/2), 0)) {}  // Midpoint of the right wall
 
           
 };
 
+// Everything one generated layout is made of: the grid, rooms, staircases and corridors, with the settings they
+// were generated for and the search and wall edge state derived from them. No world, actor or UObject involved,
+// so any number of layouts can be generated at once on any thread, each one only touching its own state.
+// ADungeonGenerator owns the layout it spawns and copies its settings in with ConfigureLayout
+struct REALONE_API FDungeonLayout
+{
+    // Settings, the same as the ADungeonGenerator properties of the same names
+    int32 Width = 30;
+    int32 Height = 30;
+    int32 Length = 30;
+    int32 minRoomsize = 4;
+    int32 maxRoomsize = 6;
+    int32 NumofRoom = 10;
+
+    // Every random draw of a generation derives from this, the same seed and settings give the same layout
+    int32 Seed = 0;
+
+    // Rooms Generate places before the NumofRoom random ones and connects like any other room
+    TArray<FRoom> RequiredRooms;
+
+    bool bParallelCorridorRouting = true;
+    bool bFloodCorridorRouting = false;
+    bool bHierarchicalPathfinding = false;
+    int32 HierarchicalClusterSize = 16;
+    int32 HierarchicalCorridorMargin = 1;
+    float HierarchicalCostTolerance = 0.1f;
+
+    bool bUseSortedOpenSetBaseline = false;
+
+    // Grid, rooms, MST and corridors for the current settings. Stage, if given, is set as each stage starts
+    void Generate(std::atomic<EDungeonGenerationStage>* Stage = nullptr);
+
+    // Stream for one stage of the generation. Work split into independent items, like anything run in parallel,
+    // takes one stream per Item so the result doesn't depend on the order the items run in
+    FRandomStream MakeRandomStream(EDungeonRandomStream Stream, int32 Item = 0) const;
+
+    // Integer hash step for deriving seeds, stable across engine versions unlike GetTypeHash
+    static uint32 MixSeed(uint32 InSeed, int32 Value);
+
+    // One byte per cell, indexed by GetIndex: the EDungeonCell in the low bits and EDungeonCellFlags above.
+    // Chunked, so only the parts of the volume that were written to take memory. Go through GetCell and SetCell
+    TDungeonChunkedGrid<uint8> Cells;
+
+    EDungeonCell GetCell(int32 Index) const { return static_cast<EDungeonCell>(Cells.Get(Index) & DungeonCellTypeMask); }
+
+    EDungeonCell GetCell(const FIntVector& Cell) const { return GetCell(GetIndex(Cell)); }
+
+    EDungeonCellFlags GetCellFlags(int32 Index) const { return static_cast<EDungeonCellFlags>(Cells.Get(Index) & ~DungeonCellTypeMask); }
+
+    // Changes the cell type, adds the matching flag and keeps Occupancy in sync
+    void SetCell(int32 Index, EDungeonCell Type);
+
+    // Size of the cell index space, for arrays indexed by GetIndex. Includes the padding of the edge chunks
+    int32 GetNumCellIndices() const { return Cells.GetNumIndices(); }
+
+    // Whether Cells, RoomIds and StairIds were initialized for the current Width, Height and Length
+    bool IsGridInitialized() const { return Cells.GetSize() == FIntVector(Width, Height, Length); }
+
+    // Cell type at a grid position, Empty outside the grid
+    EDungeonCell GetCellAt(const FIntVector& GridPosition) const;
+
+    // Every cell as the int32 values of the former Grid array, same layout
+    TArray<int32> GetGrid() const;
+
+    TArray<FRoom> Rooms;
+
+    TArray<FStair> Stairs;
+
+    // Same layout as Cells, index into Rooms of the room owning each cell or INDEX_NONE. Filled by PlaceRoom
+    TDungeonChunkedGrid<int32> RoomIds;
+
+    // Same layout as Cells, index into Stairs of the staircase covering each cell or INDEX_NONE. Filled by PlaceStaircase
+    TDungeonChunkedGrid<int32> StairIds;
+
+    void InitializeGrid();
+
+    void PlaceMultipleRooms(int32 NumberOfRooms);
+
+    bool CanPlaceRoom(const FRoom& Room);
+
+    // CanPlaceRoom by visiting every cell of the room, the baseline for ADungeonGenerator::BenchmarkRoomPlacement
+    bool CanPlaceRoomByScan(const FRoom& Room) const;
+
+    // Random size and position the way PlaceMultipleRooms picks them
+    FRoom MakeRandomRoom(FRandomStream& Random) const;
+
+    // Non-empty cells, kept in sync by SetCell
+    FDungeonOccupancy Occupancy;
+
+    int32 GetIndex(int32 X, int32 Y, int32 Z) const { return Cells.GetIndex(X, Y, Z); }
+
+    int32 GetIndex(const FIntVector& Cell) const { return GetIndex(Cell.X, Cell.Y, Cell.Z); }
+
+    bool IsInGrid(const FIntVector& Cell) const
+    {
+        return Cell.X >= 0 && Cell.X < Width && Cell.Y >= 0 && Cell.Y < Height && Cell.Z >= 0 && Cell.Z < Length;
+    }
+
+    // Inverse of GetIndex
+    FIntVector GetPositionFromIndex(int32 Index) const { return Cells.GetPosition(Index); }
+
+    // Straight line distance between two cells, the step cost and heuristic of FindPath
+    static float GridDistance(const FIntVector& A, const FIntVector& B);
+
+    void PlaceRoom(const FRoom& Room);
+
+    // Direction of the staircase covering a cell, zero when there is none
+    FIntVector GetStaircaseDirectionFromIndex(const FIntVector& Location) const;
+
+    void FinalizeDungeon();
+
+    void PlaceDoors();
+
+    void GenerateAllRoomConnections(TArray<FRoomConnection>& OutConnections);
+
+    // O(n) sorted candidate edges that contain the MST of GenerateAllRoomConnections: for every room, the nearest
+    // room in each of 8 45 degree cones around it (a Yao graph), found over a bucket grid. Candidates that don't end
+    // up in the MST are short local edges, good for adding loops
+    void GenerateCandidateRoomConnections(TArray<FRoomConnection>& OutConnections);
+
+    // Connection between two rooms, A < B
+    FRoomConnection MakeRoomConnection(int32 RoomIndexA, int32 RoomIndexB) const;
+
+    TArray<FRoomConnection> KruskalsMST();
+
+    // Kruskal over connections already sorted with FRoomConnection::operator<
+    TArray<FRoomConnection> BuildMST(const TArray<FRoomConnection>& SortedConnections);
+
+    int32 Find(int32 Index, TArray<int32>& Parent);
+
+    void Union(int32 IndexA, int32 IndexB, TArray<int32>& Parent, TArray<int32>& Rank);
+
+    void ConnectRoomsUsingAStar(const TArray<FRoomConnection>& MST);
+
+    // bFloodCorridorRouting: a room with several MST edges left is routed with one flood from it, the busiest room
+    // first, until no room has two. The edges left over get a FindPath each
+    void ConnectRoomsUsingFloods(const TArray<FRoomConnection>& MST);
+
+    // Dijkstra from StartPos that stops once it has reached a cell of every room in TargetRoomIds. OutPaths gets
+    // one path per target, from StartPos to the first cell of that room, read off the shared parent field. Empty
+    // for rooms that can't be reached. Target room cells end a path and are never walked through
+    void FindPathsToRooms(const FIntVector& StartPos, const TArray<int32>& TargetRoomIds, TArray<TArray<FIntVector>>& OutPaths);
+
+    // Whether every step of a path found earlier is still open on the grid as it is now. Staircases the path
+    // shares with one already placed count as open
+    bool IsPathPlaceable(const TArray<FIntVector>& Path, int32 StartRoomId, int32 TargetRoomId) const;
+
+    // Index into Stairs of the staircase from StartPosition along Direction, INDEX_NONE when there is none
+    int32 FindStaircase(const FIntVector& StartPosition, const FIntVector& Direction) const;
+
+    // Adds the index of every staircase a placed path climbs, once each, and counts the new ones in StairUses
+    void AddPathStairs(const TArray<FIntVector>& Path, TArray<int32>& OutStairIndices);
+
+    // MST edges the last ConnectRoomsUsingAStar found no corridor for
+    int32 NumFailedConnections = 0;
+
+    // Every corridor ConnectRoomsUsingAStar placed since InitializeGrid, in MST order
+    TArray<FDungeonCorridor> Corridors;
+
+    // Same layout as Cells, how many Corridors run through each corridor cell. A cell goes back to empty when
+    // the last corridor through it is taken out
+    TDungeonChunkedGrid<uint16> CorridorUses;
+
+    // Same indices as Stairs, how many Corridors list each staircase in StairIndices. A staircase is taken out
+    // with the last corridor that uses it
+    TArray<int32> StairUses;
+
+    // Moves or resizes one room. Only the corridors ending at the room or crossing its new cells are taken out and
+    // routed again, in their MST order, and only the wall edges of the grid chunks whose cells changed are rebuilt.
+    // The MST is kept as it was. OutDirtyChunks gets those chunks, sorted. Returns false without changing anything
+    // when the room would leave the grid or overlap another room
+    bool UpdateRoom(int32 RoomIndex, const FRoom& NewRoom, TArray<int32>& OutDirtyChunks);
+
+    // Returns the cells from start to goal, empty if the rooms can't be connected
+    TArray<FIntVector> FindPath(const FIntVector& Start, const FIntVector& Goal);
+
+    // Same search on caller owned scratch state so several can run at once. Only reads the grid.
+    // OutExpandedCells, if given, receives every cell popped from the open set in order
+    TArray<FIntVector> FindPath(const FIntVector& Start, const FIntVector& Goal, FDungeonSearchState& State, TArray<int32>* OutExpandedCells) const;
+
+    // Searches every MST edge concurrently against the grid as it is now, one FDungeonRoute per edge
+    void RouteConnectionsInParallel(const TArray<FRoomConnection>& MST, TArray<FDungeonRoute>& OutRoutes) const;
+
+    // Plans over ClusterGraph first, then runs the exact search only inside the clusters of the abstract path.
+    // Falls back to the full FindPath when the corridor can't bound its result within HierarchicalCostTolerance
+    TArray<FIntVector> FindPathHierarchical(const FIntVector& Start, const FIntVector& Goal);
+
+    // Writes a FindPath result into the grid as corridor and staircase cells. OutChangedCells gets every cell whose value changed
+    void PlacePath(const TArray<FIntVector>& Path, TArray<int32>* OutChangedCells = nullptr);
+
+    // Abstract graph for bHierarchicalPathfinding, kept in sync by PlaceCorridor and PlaceStaircase
+    FDungeonClusterGraph ClusterGraph;
+
+    // Scratch arrays for FindPath, reused by every search and emptied once all corridors are placed
+    FDungeonSearchState SearchState;
+
+    // Nodes popped from the open set by the last FindPath call
+    int32 LastSearchNodesExpanded = 0;
+
+    // Nodes popped by every search since it was last reset, parallel searches included
+    mutable std::atomic<int64> TotalNodesExpanded{0};
+
+    // StartRoomId/TargetRoomId are the rooms being connected, their cells are walkable for this search
+    bool IsWalkable(const FIntVector& Position, int32 StartRoomId, int32 TargetRoomId) const;
+
+    FRoom GetRoomFromPosition(const FIntVector& Position);
+
+    // Index into Rooms of the room covering a grid cell, INDEX_NONE for corridors and empty space
+    int32 GetRoomIdAt(const FIntVector& GridPosition) const;
+
+    FIntVector RoomCenter(const FRoom& Room) const;
+
+    TArray<FIntVector, TInlineAllocator<8>> GetNeighbors(const FIntVector& NodePosition, int32 StartRoomId, int32 TargetRoomId, bool IsStairCase, const FIntVector& StairDirection) const;
+
+    bool IsStaircaseWalkable(const FIntVector& StartPos, const FIntVector& Direction) const;
+
+    // The four cells a staircase from StartPosition along Direction occupies
+    static void GetStaircaseCells(const FIntVector& StartPosition, const FIntVector& Direction, TArray<FIntVector, TInlineAllocator<4>>& OutCells);
+
+    bool IsInRoom(const FIntVector& Position, const FRoom& Room);
+
+    EDungeonCell GetCorridorType(const FIntVector& Direction);
+
+    void PlaceCorridor(const FIntVector& Position, EDungeonCell Type);
+
+    void PlaceStaircase(const FIntVector& StartPosition, const FIntVector& Direction);
+
+    // Index into Stairs of the staircase covering a cell, INDEX_NONE when there is none
+    int32 GetStairIndex(const FIntVector& Position) const;
+
+    TArray<FIntVector, TInlineAllocator<8>> GetStairNeighbors (const FIntVector& NodePosition, int32 StartRoomId, bool IsStairCase,const FIntVector& Direction,bool IsStairCorridor,const FIntVector& ParentPosition) const;
+
+    bool checkpath(const TArray<FIntVector>& Path);
+
+    // Whether a corridor cell wants a wall on its Side (a unit step): the neighbor there is empty or outside the grid.
+    // The per-cell test NeighborMasks replaces, the baseline for ADungeonGenerator::BenchmarkWallExtraction
+    bool HasCorridorWall(const FIntVector& Cell, const FIntVector& Side) const;
+
+    // Every unique wall face of the current cells, from the NeighborMasks of the corridor cells. Run at the end of
+    // Generate, and before spawning when cells changed since
+    void BuildWallEdges();
+
+    // Whether WallEdges still match the cells
+    bool AreWallEdgesCurrent() const { return !bWallEdgesDirty; }
+
+    // Occupied neighbors of every cell, rebuilt with WallEdges
+    FDungeonNeighborMasks NeighborMasks;
+
+    // Wall edges found from the cells of one z-level of a grid chunk. LocalZ is the level inside the chunk
+    TArrayView<const FDungeonWallEdge> GetWallEdges(int32 Chunk, int32 LocalZ) const;
+
+    // Grid chunk WallEdges[Edge] belongs to
+    int32 GetWallEdgeChunk(int32 Edge) const;
+
+    // Walls of the layout, grouped by grid chunk and then by z-level inside the chunk
+    TArray<FDungeonWallEdge> WallEdges;
+
+    // Time the current layout took to generate, in ms. Saved with the layout, so it is still known after a cache load
+    float LayoutGenerationMs = 0.0f;
+
+    // Hash of Seed and every setting the layout depends on
+    uint64 GetLayoutCacheKey() const;
+
+    // Cache file for the current key, under Saved/DungeonCache
+    FString GetLayoutCachePath() const;
+
+    // Writes Cells, Rooms, Stairs and Corridors in the versioned binary cache format, cells run-length encoded
+    bool SaveLayout(const FString& Path) const;
+
+    // Replaces the layout with one written by SaveLayout and rebuilds RoomIds, StairIds, CorridorUses, StairUses and Occupancy from it.
+    // Returns false without touching the layout when the file is missing, damaged, from another format version
+    // or saved for another key
+    bool LoadLayout(const FString& Path);
+
+private:
+    // Adds Delta to CorridorUses along the cells of Path that hold a corridor
+    void AddCorridorUses(const TArray<FIntVector>& Path, int32 Delta);
+
+    // Takes a placed corridor and its staircases out of the grid, leaving cells other corridors still use
+    void RemoveCorridor(FDungeonCorridor& Corridor, TArray<int32>& OutChangedCells);
+
+    // Clears a staircase's cells and removes it from Stairs, the last staircase takes its index
+    void RemoveStair(int32 StairIndex, TArray<int32>& OutChangedCells);
+
+    // Rebuilds the wall edges of Chunks, sorted, and keeps the ones of every other chunk
+    void UpdateWallEdges(const TArray<int32>& Chunks);
+
+    // Wall edges of one chunk appended to WallEdges, one offset per z-level. NeighborMasks must be current
+    void AppendChunkWallEdges(int32 Chunk);
+
+    // Start of the WallEdges of every chunk and z-level inside it, then the number of edges
+    TArray<int32> WallEdgeOffsets;
+
+    // Set by every cell write, WallEdges no longer match the cells
+    bool bWallEdgesDirty = true;
+};
+
 UCLASS()
 class REALONE_API ADungeonGenerator : public AActor
 {
@@ -138,6 +759,8 @@ protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
 public:	
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
@@ -175,15 +798,47 @@ public:
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon")
     int32 NumofRoom = 10;
 
+    // Every random draw of a generation derives from this, the same seed and settings give the same layout
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon")
-    TArray<int32> Grid;
-    
+    int32 Seed = 0;
 
-	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category="Dungeon")
-	TArray<FRoom> Rooms;
+    // Pick a new Seed at the start of every generation. The one used is left in Seed so the layout can be reproduced
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon")
+    bool bRandomizeSeed = true;
 
-    UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category="Dungeon")
-    TArray<FStair> Stairs;
+    // Rooms GenerateLayout places before the NumofRoom random ones and connects like any other room. ADungeonStreamer
+    // uses them for the cells where corridors cross into the neighboring chunks
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon")
+    TArray<FRoom> RequiredRooms;
+
+    // Whether finishing a generation moves the player into room 0
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon")
+    bool bPlacePlayerStart = true;
+
+    // Whether finishing a generation draws the persistent debug grid
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Debug")
+    bool bDrawDebugGrid = true;
+
+    // The current layout, what SpawnDungeonEnvironment turns into geometry. Only read it while no generation is running
+    FDungeonLayout Layout;
+
+    // Copies Width, Height, Length, the room, seed and routing settings into a layout, leaving its cells and rooms as they are
+    void ConfigureLayout(FDungeonLayout& OutLayout) const;
+
+    // Cell type at a grid position, Empty outside the grid
+    UFUNCTION(BlueprintPure, Category="Dungeon")
+    EDungeonCell GetCellAt(const FIntVector& GridPosition) const;
+
+    // Every cell as the int32 values of the former Grid array, same layout
+    UFUNCTION(BlueprintPure, Category="Dungeon")
+    TArray<int32> GetGrid() const;
+
+    // Rooms and staircases of the current layout
+    UFUNCTION(BlueprintPure, Category="Dungeon")
+    const TArray<FRoom>& GetRooms() const { return Layout.Rooms; }
+
+    UFUNCTION(BlueprintPure, Category="Dungeon")
+    const TArray<FStair>& GetStairs() const { return Layout.Stairs; }
 	
 
 	UPROPERTY(EditAnywhere, Category="Dungeon|Meshes")
@@ -195,89 +850,301 @@ public:
     UPROPERTY(EditAnywhere, Category="Dungeon|Meshes")
     UStaticMesh* DoorMesh;
 
-    // Function to initialize the grid
-    void InitializeGrid();
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Rendering")
+    EDungeonRenderMode RenderMode = EDungeonRenderMode::Actors;
+
+    // Meshes used in place of FloorTileClass, WallClass, StairBlueprint and StairBlueprint2 when instancing.
+    // Their pivots are expected to match the root of the corresponding tile actor
+    UPROPERTY(EditAnywhere, Category="Dungeon|Rendering", meta=(EditCondition="RenderMode==EDungeonRenderMode::InstancedMeshes"))
+    UStaticMesh* FloorInstanceMesh = nullptr;
+
+    UPROPERTY(EditAnywhere, Category="Dungeon|Rendering", meta=(EditCondition="RenderMode==EDungeonRenderMode::InstancedMeshes"))
+    UStaticMesh* WallInstanceMesh = nullptr;
+
+    UPROPERTY(EditAnywhere, Category="Dungeon|Rendering", meta=(EditCondition="RenderMode==EDungeonRenderMode::InstancedMeshes"))
+    UStaticMesh* StairInstanceMesh = nullptr;
+
+    UPROPERTY(EditAnywhere, Category="Dungeon|Rendering", meta=(EditCondition="RenderMode==EDungeonRenderMode::InstancedMeshes"))
+    UStaticMesh* StairInstanceMesh2 = nullptr;
+
+    UPROPERTY(EditAnywhere, Category="Dungeon|Rendering", meta=(EditCondition="RenderMode==EDungeonRenderMode::MergedMeshes"))
+    UMaterialInterface* MergedFloorMaterial = nullptr;
+
+    UPROPERTY(EditAnywhere, Category="Dungeon|Rendering", meta=(EditCondition="RenderMode==EDungeonRenderMode::MergedMeshes"))
+    UMaterialInterface* MergedWallMaterial = nullptr;
+
+    // Depth of the collision box behind every merged quad, 0 turns merged collision off
+    UPROPERTY(EditAnywhere, Category="Dungeon|Rendering", meta=(ClampMin="0.0", EditCondition="RenderMode==EDungeonRenderMode::MergedMeshes"))
+    float MergedCollisionThickness = 10.0f;
+
+    // Tile actors spawned by the last SpawnDungeonEnvironment in Actors mode
+    UPROPERTY(Transient)
+    TArray<AActor*> SpawnedTileActors;
+
+    // Components created by the last SpawnDungeonEnvironment in InstancedMeshes mode
+    UPROPERTY(Transient)
+    TArray<UHierarchicalInstancedStaticMeshComponent*> InstancedTileComponents;
+
+    // Components created by the last SpawnDungeonEnvironment in MergedMeshes mode
+    UPROPERTY(Transient)
+    TArray<UProceduralMeshComponent*> MergedMeshComponents;
+
+    // Grid chunk every entry of SpawnedTileActors and MergedMeshComponents was spawned for, INDEX_NONE for tiles
+    // spawned outside a chunk. UpdateRoom respawns chunks by these
+    TArray<int32> SpawnedTileActorChunks;
+    TArray<int32> MergedMeshChunks;
+
+    // Mesh, z-level and chunk of every entry of InstancedTileComponents
+    TArray<FDungeonInstanceKey> InstancedTileKeys;
+
+    // Instance transforms collected during a spawn pass, turned into a component per key by FlushTileInstances
+    TMap<FDungeonInstanceKey, TArray<FTransform>> PendingTileInstances;
 
     // Function to place the initial room
     void PlaceInitialRoom();
 
 	void DrawDebugGrid();
 
-	void PlaceMultipleRooms(int32 NumberOfRooms);
+    // Fills a transient layout with rooms to several fill ratios and logs CanPlaceRoom tests per second with the occupancy table and the cell scan
+    UFUNCTION(CallInEditor, Category="Dungeon|Debug")
+    void BenchmarkRoomPlacement();
 
-	bool CanPlaceRoom(const FRoom& Room);
+	int32 GetRoomIndex(int32 X, int32 Y);
 
-    int32 GetIndex(int32 X, int32 Y,int32 z);
+	void GenerateDungeon();
 
-	void PlaceRoom(const FRoom& Room);
+    // With bRandomizeSeed, replaces Seed with a new random one. Game thread only, GenerateDungeon and
+    // GenerateDungeonAsync call it before the layout is generated
+    void PickSeed();
 
-	int32 GetRoomIndex(int32 X, int32 Y);
+    // Data stages of GenerateDungeon: grid, rooms, MST and corridors for the current Seed. Doesn't touch the world, so it can
+    // run off the game thread. With bUseLayoutCache, a layout saved earlier for the same seed and settings is loaded instead
+    void GenerateLayout();
 
-    FVector GetStaircaseDirectionFromIndex(const FVector& Location);
+    // Load the layout from the cache when there is one for GetLayoutCacheKey, and save freshly generated layouts to it.
+    // Ignored with bRandomizeSeed, a random seed practically never comes back
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Cache")
+    bool bUseLayoutCache = false;
 
-	void FinalizeDungeon();
+    // Size Saved/DungeonCache is kept under, the least recently used layouts are deleted past it
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Cache", meta=(ClampMin="1", EditCondition="bUseLayoutCache"))
+    int32 LayoutCacheMaxMB = 64;
 
-	void GenerateDungeon();
+    // Deletes the least recently saved or loaded layouts in Path's directory until it fits LayoutCacheMaxMB, keeping Path
+    void TrimLayoutCache(const FString& Path) const;
 
-	void PlaceDoors();
+    // Generates NumLayouts independent layouts with this generator's settings, spread over all cores with ParallelFor.
+    // Layout i uses the seed FDungeonLayout::MixSeed(Seed, i). Every batch generates into its own FDungeonLayout,
+    // so there is no world, actor or component involved, and nothing of this generator's layout or spawned tiles
+    // is touched. OnLayout, if set, is called on the worker thread once a layout is done, to validate or
+    // SaveLayout it before the batch moves on to its next job. Call from the game thread
+    FDungeonBatchSummary GenerateLayoutBatch(int32 NumLayouts, TArray<FDungeonBatchLayoutStats>& OutStats,
+        TFunction<void(int32, const FDungeonLayout&)> OnLayout = nullptr, bool bSingleThreaded = false);
 
-	void PlaceMeshes();
+    // Runs the same GenerateLayoutBatch on one thread and on all of them and logs layouts per second for both
+    UFUNCTION(CallInEditor, Category="Dungeon|Debug")
+    void BenchmarkLayoutBatch();
 
-	void GenerateAllRoomConnections(TArray<FRoomConnection>& OutConnections);
+    // GenerateLayout on a background task, then the spawn stage on the game thread across frames within SpawnBudgetMs.
+    // Layout must not be read until OnDungeonGenerated fires
+    UFUNCTION(BlueprintCallable, Category="Dungeon|Async")
+    void GenerateDungeonAsync();
 
-	void GenerateMinimumSpanningTree(TArray<FRoomConnection>& Connections, TArray<FRoomConnection>& OutMST);
+    UFUNCTION(BlueprintPure, Category="Dungeon|Async")
+    bool IsGenerating() const;
+
+    UFUNCTION(BlueprintPure, Category="Dungeon|Async")
+    EDungeonGenerationStage GetGenerationStage() const { return GenerationStage; }
 
-	TArray<FRoomConnection> KruskalsMST();
+    // Estimated fraction of the whole generation done, 0 to 1
+    UFUNCTION(BlueprintPure, Category="Dungeon|Async")
+    float GetGenerationProgress() const;
 
-	 int32 Find(int32 Index, TArray<int32>& Parent);
+    // BeginPlay uses GenerateDungeonAsync instead of GenerateDungeon
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Async")
+    bool bGenerateAsync = true;
 
-	 void Union(int32 IndexA, int32 IndexB, TArray<int32>& Parent, TArray<int32>& Rank);
+    // Game thread time the spawn stage may take per frame
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Async", meta=(ClampMin="0.1"))
+    float SpawnBudgetMs = 4.0f;
 
-	 void ConnectRoomsUsingAStar(const TArray<FRoomConnection>& MST);
+    // Fires on the game thread once the dungeon is spawned and the player start placed, for either generation path
+    UPROPERTY(BlueprintAssignable, Category="Dungeon|Async")
+    FOnDungeonGenerated OnDungeonGenerated;
+
+    // Fires every frame while GenerateDungeonAsync is running
+    UPROPERTY(BlueprintAssignable, Category="Dungeon|Async")
+    FOnDungeonGenerationProgress OnGenerationProgress;
+
+	void PlaceMeshes();
+
+	void GenerateMinimumSpanningTree(TArray<FRoomConnection>& Connections, TArray<FRoomConnection>& OutMST);
+
+    // Builds the MST from all pairs and from the candidate graph for the current rooms, logs both timings and whether they match
+    UFUNCTION(CallInEditor, Category="Dungeon|Debug")
+    void ValidateCandidateConnections();
+
+    // Moves or resizes one room of the current layout with FDungeonLayout::UpdateRoom, then respawns only the grid
+    // chunks whose cells changed, so the cost follows the size of the edit rather than of the dungeon. Returns
+    // false without changing anything when the room would leave the grid or overlap another room, or while a
+    // generation is running
+    UFUNCTION(BlueprintCallable, Category="Dungeon|Editing")
+    bool UpdateRoom(int32 RoomIndex, const FRoom& NewRoom);
+
+    // Generates and spawns the layout of the current Seed on a copy of the generator, then moves every room by one cell
+    // with UpdateRoom and logs the average update time against the full generation. This generator is left as it is
+    UFUNCTION(CallInEditor, Category="Dungeon|Debug")
+    void BenchmarkRoomUpdate();
 	
-	TArray<FAStarNode*> FindPath(const FVector& Start, const FVector& Goal);
+    // Search corridors for all MST edges in parallel, then place them in MST order. Edges whose search read
+    // a cell changed by an earlier corridor are searched again, so the layout matches serial routing exactly
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon")
+    bool bParallelCorridorRouting = true;
 
-	bool IsWalkable(const FVector& Position, const FVector& StartPos, const FVector& TargetPos);
+    // Generates this seed with serial and with parallel routing on transient layouts, compares their cells, stairs
+    // and corridors and logs the first difference
+    UFUNCTION(CallInEditor, Category="Dungeon|Debug")
+    void ValidateParallelRouting();
 
-    FRoom GetRoomFromPosition(const FVector& Position);
+    // Route all MST edges of a room with one Dijkstra flood from it instead of an A* search per edge. Corridors
+    // from one flood share the region around the room, so it is expanded once, and they branch off one shortest
+    // path tree, sharing staircases where they run together. Pays off when rooms have several MST neighbors.
+    // bParallelCorridorRouting is ignored in this mode, bHierarchicalPathfinding takes precedence
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon")
+    bool bFloodCorridorRouting = false;
 
-    FVector RoomCenter(const FRoom& Room);
+    // Routes the same rooms and MST per edge with serial and parallel A* and with floods, and logs nodes expanded and time for each.
+    // Runs on transient layouts, this layout is left as it is
+    UFUNCTION(CallInEditor, Category="Dungeon|Debug")
+    void BenchmarkFloodRouting();
 
-	TArray<FVector> GetNeighbors(const FVector& NodePosition, const FVector& StartPos, const FVector& TargetPos, bool IsStairCase, FVector StairDirection);
+    // Route corridors with HPA* over ClusterGraph, meant for very large grids. Corridors are placed one at a time
+    // in this mode since each one updates the cluster graph, so bParallelCorridorRouting is ignored
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Hierarchical")
+    bool bHierarchicalPathfinding = false;
 
-	void DrawDebugRoomPoints();
-    
-    bool IsStaircaseWalkable(const FVector& StartPos, const FVector& EndPos);
+    // Cells per side of a cluster on each level
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Hierarchical", meta=(ClampMin="2", EditCondition="bHierarchicalPathfinding"))
+    int32 HierarchicalClusterSize = 16;
 
-    bool IsInRoom(const FVector& Position, const FRoom& Room);
+    // Extra clusters around the abstract path the refining search may use
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Hierarchical", meta=(ClampMin="0", EditCondition="bHierarchicalPathfinding"))
+    int32 HierarchicalCorridorMargin = 1;
 
-    int32 GetCorridorType(const FVector& Direction);
+    // Accepted extra corridor length over the full grid search, 0.1 allows corridors up to 10% longer. Measured
+    // against FindPath, which isn't guaranteed shortest once stairs are involved, not against the shortest corridor
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Hierarchical", meta=(ClampMin="0.0", EditCondition="bHierarchicalPathfinding"))
+    float HierarchicalCostTolerance = 0.1f;
 
-    void PlaceCorridor(const FVector& Position, int32 Type);
+    // Runs FindPath for every MST edge of a transient layout with the heap and the old sorted-array open set and logs expanded nodes per second.
+    // This layout is left as it is
+    UFUNCTION(CallInEditor, Category="Dungeon|Debug")
+    void BenchmarkPathfinding();
+
+    // Index into the layout's Rooms of the room covering a grid cell, INDEX_NONE for corridors and empty space
+    UFUNCTION(BlueprintPure, Category="Dungeon")
+    int32 GetRoomIdAt(const FIntVector& GridPosition) const;
+
+    UFUNCTION(BlueprintPure, Category="Dungeon")
+    int32 GetRoomIdAtWorldLocation(const FVector& WorldLocation) const;
+
+	void DrawDebugRoomPoints();
 
     void SpawnDungeonEnvironment();
 
-    void SpawnCorridorWalls(int x, int y, int z, int32 CorridorType);
+    // Resumable SpawnDungeonEnvironment. Step spawns until BudgetSeconds is used up and returns true once everything is spawned
+    void BeginSpawnEnvironment();
+
+    bool SpawnEnvironmentStep(double BudgetSeconds);
+
+    void SpawnCell(const FIntVector& Cell);
+
+    // MergedMeshes mode: greedy merges the floors and wall edges of one grid chunk, level by level, into one component
+    void SpawnMergedChunk(int32 Chunk);
+
+    // One wall tile per edge, however many of its sides need it
+    void SpawnWallEdge(const FDungeonWallEdge& Edge);
+
+    // Times FDungeonLayout::BuildWallEdges against testing the four neighbors of every corridor cell one by one, on
+    // a transient layout that generates this seed
+    UFUNCTION(CallInEditor, Category="Dungeon|Debug")
+    void BenchmarkWallExtraction();
 
     void SpawnWallTile(const FVector& Location, const FRotator& Rotation);
 
     void SpawnFloorTile(const FVector& Location);
 
-    void PlaceStaircase(const FVector& StartPosition, const FVector& Direction);
-    
-    int32 GetStairIndex(const FVector& Position);
+    // Queues one instance of Mesh on z-level Level, for the chunk being spawned, for FlushTileInstances. Tiles of an unset mesh are dropped
+    void AddTileInstance(UStaticMesh* Mesh, const FTransform& Transform, int32 Level);
 
-    TArray<FVector> GetStairNeighbors (const FVector& NodePosition, const FVector& StartPos, const FVector& TargetPos, bool IsStairCase,FVector Direction,bool IsStairCorridor,FAStarNode* node);
+    // Warns once for every instance mesh slot left unset, before a pass in InstancedMeshes mode drops their tiles
+    void WarnMissingInstanceMeshes() const;
 
-    bool checkpath(TArray<FAStarNode*> Path);
+    // Adds the queued instances in a single batch per mesh, z-level and chunk, each on a component of its own
+    void FlushTileInstances();
+
+    // Destroys everything the last SpawnDungeonEnvironment created, in either render mode
+    void ClearSpawnedEnvironment();
+
+    // Generates the layout of this seed on a copy of the generator and spawns it in every render mode, logging spawn
+    // time, actors, components and instances. Only logs, so it also runs in a -nullrhi session
+    UFUNCTION(CallInEditor, Category="Dungeon|Debug")
+    void BenchmarkSpawning();
+
+    // For gameplay: whether a world position is on a staircase, and which one and which way it goes
+    UFUNCTION(BlueprintPure, Category="Dungeon")
+    bool GetStairAtWorldLocation(const FVector& WorldLocation, int32& OutStairIndex, FIntVector& OutDirection) const;
 
     void SpawnStairs();
 
+    void SpawnStair(const FStair& Stair);
+
     void PlacePlayerStart();
 
-    FVector GetWorldLocation(const FVector& GridLocation);
+    // Grid to world space, the only place generation data turns into world positions
+    FVector GetWorldLocation(const FVector& GridLocation) const;
+
+    FVector GetWorldLocation(const FIntVector& GridLocation) const;
+
+    // Cell containing a world position, may be outside the grid
+    FIntVector GetGridLocation(const FVector& WorldLocation) const;
 
     void SpawnRoomWalls();
 
-    void SpawnWallAt(const FVector& Location, bool bSpawnVerticalWalls);
+    void SpawnWallAt(const FIntVector& Location, bool bSpawnVerticalWalls);
+
+private:
+    // Advances an async generation, called from Tick
+    void TickGeneration();
+
+    // Debug draw, player start and completion delegates, shared by both generation paths
+    void FinishGeneration();
+
+    TFuture<void> LayoutTask;
+
+    // Written by the layout task, read by the game thread for progress
+    std::atomic<EDungeonGenerationStage> GenerationStage{EDungeonGenerationStage::Idle};
+
+    // Next step of the resumable spawn, a cell index, then a wall edge and a staircase index past the end of the grid
+    int32 SpawnCursor = 0;
+
+    // Grid chunk the tiles being spawned belong to
+    int32 SpawningChunk = INDEX_NONE;
+
+    // Tracks the chunk of an actor spawned for SpawningChunk
+    void AddSpawnedTileActor(AActor* Actor);
+
+    // Destroys the geometry of Chunks, sorted, and spawns it again from the current cells, wall edges and stairs
+    void RespawnChunks(const TArray<int32>& Chunks);
+
+    // Cells and wall edges of one chunk in the current render mode
+    void SpawnChunk(int32 Chunk);
+
+    // Copy of this generator at the same transform with all of its editable settings and a pinned Seed, for debug
+    // tools that spawn tiles without touching this generator's layout or tiles. Call ClearSpawnedEnvironment and
+    // Destroy on it when done
+    ADungeonGenerator* SpawnScratchGenerator();
+
+    // Set on copies made by SpawnScratchGenerator, they don't generate on BeginPlay
+    bool bScratchCopy = false;
 };
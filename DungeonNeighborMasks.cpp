@@ -0,0 +1,189 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "DungeonNeighborMasks.h"
+
+#if PLATFORM_CPU_X86_FAMILY
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    using FCellGrid = TDungeonChunkedGrid<uint8>;
+
+    constexpr int32 RowsPerChunk = FCellGrid::ChunkSize * FCellGrid::ChunkSize;
+
+#if !PLATFORM_CPU_X86_FAMILY
+    // Bit i set when byte i of the little endian Word has any bit of Mask
+    uint32 GetOccupiedBits8(uint64 Word, uint64 Mask)
+    {
+        Word &= Mask;
+
+        // High bit of every byte that isn't zero, without carries between bytes
+        Word = (((Word & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | Word) & 0x8080808080808080ull;
+
+        // The multiply moves the eight high bits next to each other in the top byte
+        return uint32(((Word >> 7) * 0x0102040810204080ull) >> 56);
+    }
+#endif
+
+    // Bit i set when byte i of the 16 at Data has any bit of TypeMask
+    uint16 GetOccupiedBits(const uint8* Data, uint8 TypeMask)
+    {
+#if PLATFORM_CPU_X86_FAMILY
+        const __m128i Row = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(Data)), _mm_set1_epi8(char(TypeMask)));
+        return uint16(~_mm_movemask_epi8(_mm_cmpeq_epi8(Row, _mm_setzero_si128())));
+#else
+        uint64 Words[2];
+        FMemory::Memcpy(Words, Data, sizeof(Words));
+        const uint64 Mask = TypeMask * 0x0101010101010101ull;
+        return uint16(GetOccupiedBits8(Words[0], Mask) | (GetOccupiedBits8(Words[1], Mask) << 8));
+#endif
+    }
+
+    // Out[i] gets bit D of the mask from bit i of Directions[D], for the 16 cells of a row
+    void WriteRowMasks(uint8* Out, const uint16 (&Directions)[6])
+    {
+#if PLATFORM_CPU_X86_FAMILY
+        const __m128i Selectors = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, char(128), 1, 2, 4, 8, 16, 32, 64, char(128));
+        __m128i Result = _mm_setzero_si128();
+        for (int32 Direction = 0; Direction < 6; Direction++)
+        {
+            // Low byte of the word in the low eight lanes, high byte in the high ones, then one lane per bit
+            const uint16 Bits = Directions[Direction];
+            __m128i Spread = _mm_unpacklo_epi64(_mm_set1_epi8(char(Bits & 0xFF)), _mm_set1_epi8(char(Bits >> 8)));
+            Spread = _mm_cmpeq_epi8(_mm_and_si128(Spread, Selectors), Selectors);
+            Result = _mm_or_si128(Result, _mm_and_si128(Spread, _mm_set1_epi8(char(1 << Direction))));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(Out), Result);
+#else
+        for (int32 X = 0; X < FCellGrid::ChunkSize; X++)
+        {
+            uint8 Mask = 0;
+            for (int32 Direction = 0; Direction < 6; Direction++)
+            {
+                Mask |= uint8((Directions[Direction] >> X) & 1) << Direction;
+            }
+            Out[X] = Mask;
+        }
+#endif
+    }
+}
+
+void FDungeonNeighborMasks::Build(const TDungeonChunkedGrid<uint8>& Cells, uint8 TypeMask)
+{
+    const int32 NumChunks = Cells.GetNumChunks();
+
+    // Occupancy words of every allocated chunk, the others hold only empty cells
+    OccupiedRows.Reset();
+    OccupiedRows.SetNumZeroed(NumChunks * RowsPerChunk);
+    ChunkSlots.Init(INDEX_NONE, NumChunks);
+    Masks.Reset();
+    for (int32 Chunk = 0; Chunk < NumChunks; Chunk++)
+    {
+        if (Cells.IsChunkAllocated(Chunk))
+        {
+            BuildChunkRows(Cells, TypeMask, Chunk);
+        }
+    }
+
+    for (int32 Chunk = 0; Chunk < NumChunks; Chunk++)
+    {
+        if (ChunkSlots[Chunk] != INDEX_NONE)
+        {
+            BuildChunkMasks(Cells, Chunk);
+        }
+    }
+}
+
+void FDungeonNeighborMasks::UpdateChunks(const TDungeonChunkedGrid<uint8>& Cells, uint8 TypeMask, const TArray<int32>& Chunks)
+{
+    if (ChunkSlots.Num() != Cells.GetNumChunks())
+    {
+        Build(Cells, TypeMask);
+        return;
+    }
+
+    // Every word first, the masks of one changed chunk read the words of the others
+    for (int32 Chunk : Chunks)
+    {
+        if (Cells.IsChunkAllocated(Chunk))
+        {
+            BuildChunkRows(Cells, TypeMask, Chunk);
+        }
+    }
+    for (int32 Chunk : Chunks)
+    {
+        if (ChunkSlots[Chunk] != INDEX_NONE)
+        {
+            BuildChunkMasks(Cells, Chunk);
+        }
+    }
+}
+
+void FDungeonNeighborMasks::BuildChunkRows(const TDungeonChunkedGrid<uint8>& Cells, uint8 TypeMask, int32 Chunk)
+{
+    if (ChunkSlots[Chunk] == INDEX_NONE)
+    {
+        ChunkSlots[Chunk] = Masks.Num() / FCellGrid::ChunkCells;
+        Masks.AddUninitialized(FCellGrid::ChunkCells);
+    }
+    const uint8* Data = Cells.GetChunkData(Chunk);
+    uint16* Rows = &OccupiedRows[Chunk * RowsPerChunk];
+    for (int32 Row = 0; Row < RowsPerChunk; Row++)
+    {
+        Rows[Row] = GetOccupiedBits(Data + Row * FCellGrid::ChunkSize, TypeMask);
+    }
+}
+
+void FDungeonNeighborMasks::BuildChunkMasks(const TDungeonChunkedGrid<uint8>& Cells, int32 Chunk)
+{
+    const int32 ChunksX = Cells.GetNumChunksX();
+    const int32 ChunksY = Cells.GetNumChunksY();
+    const int32 ChunksZ = Cells.GetNumChunks() / (ChunksX * ChunksY);
+    const int32 ChunkX = Chunk % ChunksX;
+    const int32 ChunkY = (Chunk / ChunksX) % ChunksY;
+    const int32 ChunkZ = Chunk / (ChunksX * ChunksY);
+
+    // Rows of the six chunks around, null past the border of the grid where everything reads as empty
+    auto GetChunkRows = [this, Chunk](bool bInGrid, int32 Offset) -> const uint16*
+    {
+        return bInGrid ? &OccupiedRows[(Chunk + Offset) * RowsPerChunk] : nullptr;
+    };
+    const uint16* Rows = &OccupiedRows[Chunk * RowsPerChunk];
+    const uint16* PosXRows = GetChunkRows(ChunkX + 1 < ChunksX, 1);
+    const uint16* NegXRows = GetChunkRows(ChunkX > 0, -1);
+    const uint16* PosYRows = GetChunkRows(ChunkY + 1 < ChunksY, ChunksX);
+    const uint16* NegYRows = GetChunkRows(ChunkY > 0, -ChunksX);
+    const uint16* PosZRows = GetChunkRows(ChunkZ + 1 < ChunksZ, ChunksX * ChunksY);
+    const uint16* NegZRows = GetChunkRows(ChunkZ > 0, -ChunksX * ChunksY);
+
+    // Row Y + Z * ChunkSize holds the cells at that Y and Z, so the neighbors along Y and Z are whole rows and the
+    // ones along X are the bits next to each one
+    constexpr int32 Last = FCellGrid::ChunkSize - 1;
+    uint8* Out = &Masks[ChunkSlots[Chunk] * FCellGrid::ChunkCells];
+    for (int32 Z = 0; Z < FCellGrid::ChunkSize; Z++)
+    {
+        for (int32 Y = 0; Y < FCellGrid::ChunkSize; Y++)
+        {
+            const int32 Row = Y + Z * FCellGrid::ChunkSize;
+            const uint16 Bits = Rows[Row];
+            const uint16 Directions[6] = {
+                uint16((Bits >> 1) | (PosXRows ? PosXRows[Row] << Last : 0)),
+                uint16((Bits << 1) | (NegXRows ? NegXRows[Row] >> Last : 0)),
+                Y < Last ? Rows[Row + 1] : (PosYRows ? PosYRows[Row - Last] : uint16(0)),
+                Y > 0 ? Rows[Row - 1] : (NegYRows ? NegYRows[Row + Last] : uint16(0)),
+                Z < Last ? Rows[Row + FCellGrid::ChunkSize] : (PosZRows ? PosZRows[Y] : uint16(0)),
+                Z > 0 ? Rows[Row - FCellGrid::ChunkSize] : (NegZRows ? NegZRows[Y + Last * FCellGrid::ChunkSize] : uint16(0)),
+            };
+            WriteRowMasks(Out + Row * FCellGrid::ChunkSize, Directions);
+        }
+    }
+}
+
+void FDungeonNeighborMasks::Empty()
+{
+    OccupiedRows.Empty();
+    ChunkSlots.Empty();
+    Masks.Empty();
+}
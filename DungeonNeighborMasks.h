@@ -0,0 +1,70 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DungeonChunkedGrid.h"
+
+// Bits of a neighbor mask, set when the cell on that side is inside the grid and occupied
+enum class EDungeonNeighbor : uint8
+{
+    None = 0,
+    PosX = 1 << 0,
+    NegX = 1 << 1,
+    PosY = 1 << 2,
+    NegY = 1 << 3,
+    PosZ = 1 << 4,
+    NegZ = 1 << 5,
+    Horizontal = PosX | NegX | PosY | NegY,
+};
+ENUM_CLASS_FLAGS(EDungeonNeighbor);
+
+// Which of its six neighbors are occupied, for every cell of a chunked grid of cell bytes. Built in two streaming
+// passes over the allocated chunks rather than six random reads per cell. The first turns every row of 16 cells
+// along X into a 16 bit occupancy word, 16 bytes at a time (SSE2 on x86, 64 bit words elsewhere). The second
+// shifts the word of a row against the words of the rows around it, so all six masks of a row come out of a
+// handful of integer operations, and spreads them back to a byte per cell.
+class FDungeonNeighborMasks
+{
+public:
+    // A cell is occupied when any bit of TypeMask is set in its byte
+    void Build(const TDungeonChunkedGrid<uint8>& Cells, uint8 TypeMask);
+
+    // Refreshes the masks of Chunks after only their cells changed. A change on a chunk's face also changes the
+    // masks of the chunk behind it, which has to be in Chunks too. Builds everything if the grid was resized
+    void UpdateChunks(const TDungeonChunkedGrid<uint8>& Cells, uint8 TypeMask, const TArray<int32>& Chunks);
+
+    void Empty();
+
+    // Mask of a cell index of the grid it was built from. Cells of chunks that weren't allocated read None, they
+    // are all empty so nothing needs their masks
+    EDungeonNeighbor Get(int32 Index) const
+    {
+        const int32 Slot = ChunkSlots[Index >> TDungeonChunkedGrid<uint8>::ChunkCellBits];
+        return Slot == INDEX_NONE ? EDungeonNeighbor::None
+            : static_cast<EDungeonNeighbor>(Masks[(Slot << TDungeonChunkedGrid<uint8>::ChunkCellBits) | (Index & (TDungeonChunkedGrid<uint8>::ChunkCells - 1))]);
+    }
+
+    // Occupancy of the row of cells starting at Row << ChunkSizeBits, bit X for the cell at X inside the chunk
+    uint16 GetOccupiedRow(int32 Row) const { return OccupiedRows[Row]; }
+
+    SIZE_T GetAllocatedSize() const
+    {
+        return OccupiedRows.GetAllocatedSize() + ChunkSlots.GetAllocatedSize() + Masks.GetAllocatedSize();
+    }
+
+private:
+    // Occupancy words of one allocated chunk, giving it a slot in Masks the first time
+    void BuildChunkRows(const TDungeonChunkedGrid<uint8>& Cells, uint8 TypeMask, int32 Chunk);
+
+    // Masks of one chunk with a slot, from its words and the words of the chunks around it
+    void BuildChunkMasks(const TDungeonChunkedGrid<uint8>& Cells, int32 Chunk);
+
+    // One word per row of every chunk, zero in chunks that weren't allocated
+    TArray<uint16> OccupiedRows;
+
+    // Per chunk, where its masks start in Masks in chunks, INDEX_NONE when it wasn't allocated
+    TArray<int32> ChunkSlots;
+
+    TArray<uint8> Masks;
+};
@@ -0,0 +1,217 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "DungeonStreamer.h"
+#include "DungeonGenerator.h"
+#include "Kismet/GameplayStatics.h"
+
+namespace
+{
+    FRoom MakeBorderRoom(int32 X, int32 Y, int32 Z)
+    {
+        FRoom Room(X, Y, 1, 1);
+        Room.StartZ = Z;
+        Room.Length = 1;
+        return Room;
+    }
+}
+
+ADungeonStreamer::ADungeonStreamer()
+{
+	PrimaryActorTick.bCanEverTick = true;
+}
+
+void ADungeonStreamer::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+    // On a level change the chunks go away with the world, only take them down with an explicitly destroyed streamer
+    if (EndPlayReason == EEndPlayReason::Destroyed)
+    {
+        UnloadAllChunks();
+    }
+    Super::EndPlay(EndPlayReason);
+}
+
+void ADungeonStreamer::Tick(float DeltaTime)
+{
+	Super::Tick(DeltaTime);
+    const APawn* Pawn = UGameplayStatics::GetPlayerPawn(this, 0);
+    UpdateStreaming(Pawn ? Pawn->GetActorLocation() : GetActorLocation());
+}
+
+FIntVector ADungeonStreamer::GetChunkSize() const
+{
+    const ADungeonGenerator* Defaults = ChunkGeneratorClass->GetDefaultObject<ADungeonGenerator>();
+    return FIntVector(Defaults->Width, Defaults->Height, Defaults->Length);
+}
+
+FVector ADungeonStreamer::GetChunkOrigin(const FIntPoint& Chunk) const
+{
+    const FIntVector Size = GetChunkSize();
+    const float CellSize = ChunkGeneratorClass->GetDefaultObject<ADungeonGenerator>()->CellSize;
+    return GetActorLocation() + FVector(Chunk.X * Size.X, Chunk.Y * Size.Y, 0) * CellSize;
+}
+
+FIntPoint ADungeonStreamer::GetChunkAt(const FVector& WorldLocation) const
+{
+    if (!ChunkGeneratorClass)
+    {
+        return FIntPoint::ZeroValue;
+    }
+    const FIntVector Size = GetChunkSize();
+    const float CellSize = ChunkGeneratorClass->GetDefaultObject<ADungeonGenerator>()->CellSize;
+    const FVector Local = (WorldLocation - GetActorLocation()) / CellSize;
+    return FIntPoint(FMath::FloorToInt(Local.X / Size.X), FMath::FloorToInt(Local.Y / Size.Y));
+}
+
+ADungeonGenerator* ADungeonStreamer::GetChunkGenerator(const FIntPoint& Chunk) const
+{
+    ADungeonGenerator* const* Generator = LoadedChunks.Find(Chunk);
+    return Generator ? *Generator : nullptr;
+}
+
+void ADungeonStreamer::UpdateStreaming(const FVector& WorldLocation)
+{
+    if (!ChunkGeneratorClass)
+    {
+        return;
+    }
+
+    const FIntPoint Center = GetChunkAt(WorldLocation);
+    const int32 KeepRadius = FMath::Max(UnloadRadius, LoadRadius);
+
+    // Unload first, so the new chunks never come on top of the ones being dropped
+    TArray<FIntPoint> ChunksToUnload;
+    int32 NumGenerating = 0;
+    for (const TPair<FIntPoint, ADungeonGenerator*>& Loaded : LoadedChunks)
+    {
+        if (!IsValid(Loaded.Value))
+        {
+            ChunksToUnload.Add(Loaded.Key);
+            continue;
+        }
+        if (Loaded.Value->IsGenerating())
+        {
+            // Its layout task is still writing to it, it goes once it is done if the player didn't come back
+            NumGenerating++;
+            continue;
+        }
+        const FIntPoint Offset = Loaded.Key - Center;
+        if (FMath::Max(FMath::Abs(Offset.X), FMath::Abs(Offset.Y)) > KeepRadius)
+        {
+            ChunksToUnload.Add(Loaded.Key);
+        }
+    }
+    for (const FIntPoint& Chunk : ChunksToUnload)
+    {
+        UnloadChunk(Chunk);
+    }
+
+    if (NumGenerating >= MaxConcurrentGenerations)
+    {
+        return;
+    }
+
+    // Missing chunks in range, closest to the player first
+    TArray<FIntPoint> ChunksToLoad;
+    for (int32 DY = -LoadRadius; DY <= LoadRadius; DY++)
+    {
+        for (int32 DX = -LoadRadius; DX <= LoadRadius; DX++)
+        {
+            const FIntPoint Chunk = Center + FIntPoint(DX, DY);
+            if (!LoadedChunks.Contains(Chunk))
+            {
+                ChunksToLoad.Add(Chunk);
+            }
+        }
+    }
+    ChunksToLoad.Sort([&Center](const FIntPoint& A, const FIntPoint& B)
+    {
+        return (A - Center).SizeSquared() < (B - Center).SizeSquared();
+    });
+
+    for (int32 i = 0; i < ChunksToLoad.Num() && NumGenerating < MaxConcurrentGenerations; i++)
+    {
+        LoadChunk(ChunksToLoad[i]);
+        NumGenerating++;
+    }
+}
+
+void ADungeonStreamer::LoadChunk(const FIntPoint& Chunk)
+{
+    const FTransform Transform(GetChunkOrigin(Chunk));
+    ADungeonGenerator* Generator = GetWorld()->SpawnActorDeferred<ADungeonGenerator>(ChunkGeneratorClass, Transform, this);
+    if (!Generator)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Failed to spawn the generator of dungeon chunk (%d, %d)"), Chunk.X, Chunk.Y);
+        return;
+    }
+
+    // Set before FinishSpawning, BeginPlay starts the generation
+    GetBorderRooms(Chunk, Generator->RequiredRooms);
+    Generator->Seed = int32(FDungeonLayout::MixSeed(GetChunkSeed(Chunk), 2));
+    Generator->bRandomizeSeed = false;
+    Generator->bGenerateAsync = true;
+    Generator->bDrawDebugGrid = false;
+    Generator->bPlacePlayerStart = bPlacePlayerInOriginChunk && !bPlayerPlaced && Chunk == FIntPoint::ZeroValue;
+    bPlayerPlaced |= Generator->bPlacePlayerStart;
+    Generator->FinishSpawning(Transform);
+
+    LoadedChunks.Add(Chunk, Generator);
+    UE_LOG(LogTemp, Log, TEXT("Dungeon chunk (%d, %d) loading, %d chunks loaded"), Chunk.X, Chunk.Y, LoadedChunks.Num());
+}
+
+void ADungeonStreamer::UnloadChunk(const FIntPoint& Chunk)
+{
+    ADungeonGenerator* Generator = nullptr;
+    LoadedChunks.RemoveAndCopyValue(Chunk, Generator);
+    if (IsValid(Generator))
+    {
+        // Tile actors aren't attached to the generator, destroying it alone would leave them behind
+        Generator->ClearSpawnedEnvironment();
+        Generator->Destroy();
+    }
+    UE_LOG(LogTemp, Log, TEXT("Dungeon chunk (%d, %d) unloaded, %d chunks loaded"), Chunk.X, Chunk.Y, LoadedChunks.Num());
+}
+
+void ADungeonStreamer::UnloadAllChunks()
+{
+    TArray<FIntPoint> Chunks;
+    LoadedChunks.GetKeys(Chunks);
+    for (const FIntPoint& Chunk : Chunks)
+    {
+        UnloadChunk(Chunk);
+    }
+}
+
+uint32 ADungeonStreamer::GetChunkSeed(const FIntPoint& Chunk) const
+{
+    return FDungeonLayout::MixSeed(FDungeonLayout::MixSeed(uint32(WorldSeed), Chunk.X), Chunk.Y);
+}
+
+void ADungeonStreamer::GetBorderCrossing(const FIntPoint& Chunk, int32 Axis, int32& OutPosition, int32& OutLevel) const
+{
+    const FIntVector Size = GetChunkSize();
+    FRandomStream Stream(int32(FDungeonLayout::MixSeed(GetChunkSeed(Chunk), Axis)));
+
+    // Never on the first or last cell of the border, so the crossings of two borders can't meet in a corner
+    const int32 BorderCells = Axis == 0 ? Size.Y : Size.X;
+    OutPosition = Stream.RandRange(1, FMath::Max(1, BorderCells - 2));
+    OutLevel = Stream.RandRange(0, Size.Z - 1);
+}
+
+void ADungeonStreamer::GetBorderRooms(const FIntPoint& Chunk, TArray<FRoom>& OutRooms) const
+{
+    OutRooms.Reset();
+    const FIntVector Size = GetChunkSize();
+    int32 Position, Level;
+
+    // The -X and -Y borders of a chunk are the +X and +Y borders of the chunks before it
+    GetBorderCrossing(Chunk, 0, Position, Level);
+    OutRooms.Add(MakeBorderRoom(Size.X - 1, Position, Level));
+    GetBorderCrossing(Chunk - FIntPoint(1, 0), 0, Position, Level);
+    OutRooms.Add(MakeBorderRoom(0, Position, Level));
+    GetBorderCrossing(Chunk, 1, Position, Level);
+    OutRooms.Add(MakeBorderRoom(Position, Size.Y - 1, Level));
+    GetBorderCrossing(Chunk - FIntPoint(0, 1), 1, Position, Level);
+    OutRooms.Add(MakeBorderRoom(Position, 0, Level));
+}
@@ -0,0 +1,105 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Actor.h"
+#include "DungeonStreamer.generated.h"
+
+class ADungeonGenerator;
+struct FRoom;
+
+// Open-ended dungeon made of chunks that are generated around the player and dropped again behind them. Every
+// chunk is its own ADungeonGenerator of ChunkGeneratorClass, laid out edge to edge on a horizontal grid, with
+// its own rooms, MST and corridors. Where two chunks touch, a seed derived from WorldSeed and the border picks
+// the crossing cell, and both chunks get a one-cell required room on their side of it. Their corridors end on
+// neighboring cells no matter which chunk is generated first, or whether the other one is loaded at all.
+//
+// Loaded chunks are limited to the square of UnloadRadius around the player, and at most
+// MaxConcurrentGenerations chunks are generating at once, each spawning within its own SpawnBudgetMs,
+// so memory and per frame cost don't grow with the distance walked.
+UCLASS()
+class REALONE_API ADungeonStreamer : public AActor
+{
+	GENERATED_BODY()
+
+public:
+	ADungeonStreamer();
+
+protected:
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+public:
+	virtual void Tick(float DeltaTime) override;
+
+    // Generator spawned for every chunk, with the meshes and tile classes to use. Its default Width, Height and
+    // Length are the chunk size in cells and its room settings apply per chunk
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Streaming")
+    TSubclassOf<ADungeonGenerator> ChunkGeneratorClass;
+
+    // Same seed, same chunks. Every chunk generator and border crossing gets a seed derived from it
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Streaming")
+    int32 WorldSeed = 0;
+
+    // Chunks within this many chunks of the player's chunk, on both axes, are generated
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Streaming", meta=(ClampMin="0"))
+    int32 LoadRadius = 1;
+
+    // Chunks further than this are unloaded. Kept above LoadRadius so walking along a chunk border doesn't
+    // generate and drop the same chunks over and over
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Streaming", meta=(ClampMin="0"))
+    int32 UnloadRadius = 2;
+
+    // Chunks generating at the same time. Each one runs its layout on a worker thread and spends up to its
+    // SpawnBudgetMs of game thread time per frame
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Streaming", meta=(ClampMin="1"))
+    int32 MaxConcurrentGenerations = 1;
+
+    // Moves the player into the first room of the chunk at the streamer's location, the first time it is generated
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category="Dungeon|Streaming")
+    bool bPlacePlayerInOriginChunk = true;
+
+    // Chunk coordinate containing a world position
+    UFUNCTION(BlueprintPure, Category="Dungeon|Streaming")
+    FIntPoint GetChunkAt(const FVector& WorldLocation) const;
+
+    // Generator of a loaded chunk, null when it isn't loaded
+    UFUNCTION(BlueprintPure, Category="Dungeon|Streaming")
+    ADungeonGenerator* GetChunkGenerator(const FIntPoint& Chunk) const;
+
+    UFUNCTION(BlueprintPure, Category="Dungeon|Streaming")
+    int32 GetNumLoadedChunks() const { return LoadedChunks.Num(); }
+
+    // Loads and unloads chunks around WorldLocation, Tick calls it with the player's location
+    void UpdateStreaming(const FVector& WorldLocation);
+
+    // Destroys every chunk and what it spawned
+    UFUNCTION(BlueprintCallable, Category="Dungeon|Streaming")
+    void UnloadAllChunks();
+
+    // The one-cell rooms where a chunk's corridors cross into its four neighbors. Only depends on WorldSeed,
+    // the chunk coordinate and the chunk size, so two neighbors always agree on their shared borders
+    void GetBorderRooms(const FIntPoint& Chunk, TArray<FRoom>& OutRooms) const;
+
+private:
+    void LoadChunk(const FIntPoint& Chunk);
+
+    void UnloadChunk(const FIntPoint& Chunk);
+
+    // Cell along the border between Chunk and the next chunk on Axis (0 for +X, 1 for +Y) where the corridors
+    // cross. Position is the cell along the border and Level its z-level
+    void GetBorderCrossing(const FIntPoint& Chunk, int32 Axis, int32& OutPosition, int32& OutLevel) const;
+
+    // Base of the border seeds and of the generator seed of a chunk
+    uint32 GetChunkSeed(const FIntPoint& Chunk) const;
+
+    // Chunk size in cells, the defaults of ChunkGeneratorClass
+    FIntVector GetChunkSize() const;
+
+    FVector GetChunkOrigin(const FIntPoint& Chunk) const;
+
+    UPROPERTY(Transient)
+    TMap<FIntPoint, ADungeonGenerator*> LoadedChunks;
+
+    bool bPlayerPlaced = false;
+};